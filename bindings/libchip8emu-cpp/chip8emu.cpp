@@ -17,6 +17,16 @@ int Chip8Emu::execTimerTick()
     return C8ERR_OK;
 }
 
+long Chip8Emu::runCycles(long n)
+{
+    return chip8emu_run_cycles(this->c8e, n);
+}
+
+int Chip8Emu::runFrame(long cycles_per_frame)
+{
+    return chip8emu_run_frame(this->c8e, cycles_per_frame);
+}
+
 int Chip8Emu::loadCode(unsigned char *code_buffer, long code_size)
 {
     chip8emu_load_code(this->c8e, code_buffer, code_size);
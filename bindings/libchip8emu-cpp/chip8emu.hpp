@@ -11,6 +11,8 @@ public:
 
     int execCycle();
     int execTimerTick();
+    long runCycles(long n);
+    int runFrame(long cycles_per_frame);
     int loadCode(unsigned char* code_buffer, long code_size);
     int loadRom(const char* filename);
 
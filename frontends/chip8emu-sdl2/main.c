@@ -28,12 +28,9 @@ static int keymap[16] = {
     SDLK_KP_DIVIDE,
 };
 
-static mtx_t key_mtx;
 static mtx_t draw_mtx;
 static cnd_t draw_cnd;
 
-static bool keystates[16] = {0};
-static chip8emu_snapshot snapshot;
 static bool draw_flag = false;
 
 void draw_callback(chip8emu *cpu) {
@@ -44,14 +41,6 @@ void draw_callback(chip8emu *cpu) {
     mtx_unlock(&draw_mtx);
 }
 
-bool keystate_callback(chip8emu* cpu, uint8_t key) {
-    (void)cpu;
-    mtx_lock(&key_mtx);
-    bool ret = keystates[key];
-    mtx_unlock(&key_mtx);
-    return ret;
-}
-
 void beep_callback(chip8emu * cpu) {
     (void)cpu;
 }
@@ -67,16 +56,19 @@ int main(int argc, char **argv) {
     (void) argc; (void) argv;
 
     mtx_init(&draw_mtx, mtx_plain);
-    mtx_init(&key_mtx, mtx_plain);
     cnd_init(&draw_cnd);
 
     chip8emu* cpu= chip8emu_new();
     cpu->draw = &draw_callback;
-    cpu->keystate = &keystate_callback;
+    cpu->vblank_draw = true;
+    cpu->key_events = true;
     cpu->beep = &beep_callback;
 
     chip8emu_load_rom(cpu, "/home/thaolt/Workspaces/roms/TETRIS");
     chip8emu_set_cpu_speed(cpu, 1200);
+    chip8emu_set_virtual_time(cpu, true); /* lets TAB fast-forward */
+    chip8emu_set_rewind(cpu, 4 << 20); /* BACKSPACE steps back, tens of minutes of history */
+    chip8emu_set_trace(cpu, 4096, "chip8emu.trace"); /* CHIP8EMU_TRACE builds: last instructions before a fault */
     chip8emu_start(cpu);
 
 
@@ -122,46 +114,81 @@ int main(int argc, char **argv) {
         .tv_sec = 0,
         .tv_nsec = 1000000
     };
+    Uint32 last_present = 0;
+    bool rewinding = false;
+    bool recording = false;
     while (!quit) {
         while (SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) quit = true;
 
             if (e.type == SDL_KEYDOWN) {
-                mtx_lock(&key_mtx);
+                /* hold TAB to fast-forward */
+                if (e.key.keysym.sym == SDLK_TAB && !e.key.repeat)
+                    chip8emu_set_time_scale(cpu, 0);
+                /* F9 starts and stops recording the session, replay with chip8emu-bench -m */
+                if (e.key.keysym.sym == SDLK_F9 && !e.key.repeat) {
+                    if (recording)
+                        chip8emu_stop_movie_file(cpu, "chip8emu.movie");
+                    else
+                        chip8emu_record_movie(cpu, (uint64_t) chip8emu_get_cpu_speed(cpu) * 1000,
+                                              (uint64_t) chip8emu_get_timer_speed(cpu) * 1000);
+                    recording = !recording;
+                }
+                /* hold BACKSPACE to rewind */
+                if (e.key.keysym.sym == SDLK_BACKSPACE && !e.key.repeat) {
+                    chip8emu_pause(cpu);
+                    rewinding = true;
+                }
                 for (int i = 0; i < 16; ++i) {
-                    if (e.key.keysym.sym == keymap[i]) {
-                        keystates[i] = true;
+                    if (e.key.keysym.sym == keymap[i] && !e.key.repeat) {
+                        chip8emu_key_down(cpu, i);
                     }
                 }
-                mtx_unlock(&key_mtx);
             }
 
             if (e.type == SDL_KEYUP) {
                 if (e.key.keysym.sym == SDLK_ESCAPE)
                     quit = true;
+                else if (e.key.keysym.sym == SDLK_TAB)
+                    chip8emu_set_time_scale(cpu, 1000);
+                else if (e.key.keysym.sym == SDLK_BACKSPACE) {
+                    rewinding = false;
+                    chip8emu_resume(cpu);
+                }
                 else {
-                    mtx_lock(&key_mtx);
                     for (int i = 0; i < 16; ++i) {
                         if (e.key.keysym.sym == keymap[i]) {
-                            keystates[i] = false;
+                            chip8emu_key_up(cpu, i);
                         }
                     }
-                    mtx_unlock(&key_mtx);
                 }
             }
         }
+        /* one frame back per present, outside draw_mtx: rewinding draws */
+        if (rewinding && SDL_GetTicks() - last_present >= 16 && chip8emu_rewind(cpu, 1))
+            draw_callback(cpu);
         mtx_lock(&draw_mtx);
-        if (draw_flag) {
+        /* at most 60 presents per second, fast-forwarded frames in between are skipped */
+        if (draw_flag && SDL_GetTicks() - last_present >= 16) {
+            last_present = SDL_GetTicks();
             int pitch;
             void* pixels;
-            chip8emu_take_snapshot(cpu, &snapshot);
-
-            /* Update SDL texture */
-            SDL_LockTexture(sdlTexture, NULL, &pixels, &pitch);
-            for (int i = 0; i < 2048; ++i) {
-                ((Uint32 *) pixels)[i] = snapshot.gfx[i] * 0x00FFFFFF | 0xFF000000;
+            const chip8emu_snapshot *snapshot = chip8emu_acquire_snapshot(cpu);
+
+            /* Update the changed rows of the SDL texture */
+            if (snapshot->dirty_rows) {
+                int first = 0, last = 31;
+                while (!(snapshot->dirty_rows & (1u << first))) first++;
+                while (!(snapshot->dirty_rows & (1u << last))) last--;
+                SDL_Rect rows = { 0, first, 64, last - first + 1 };
+                SDL_LockTexture(sdlTexture, &rows, &pixels, &pitch);
+                for (int y = first; y <= last; ++y) {
+                    Uint32 *line = (Uint32 *) ((uint8_t *) pixels + (y - first) * pitch);
+                    for (int x = 0; x < 64; ++x)
+                        line[x] = snapshot->gfx[y * 64 + x] * 0x00FFFFFF | 0xFF000000;
+                }
+                SDL_UnlockTexture(sdlTexture);
             }
-            SDL_UnlockTexture(sdlTexture);
 
             /* Clear screen and render */
             SDL_RenderClear(renderer);
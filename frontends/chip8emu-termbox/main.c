@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <stdatomic.h>
 #include <libgen.h> /* for basename() */
 
 #include "termbox.h"
@@ -15,15 +16,21 @@
 #define DISP_BG TB_BLACK
 #define CONTAINER_WIDTH 80
 #define CONTAINER_MIN_HEIGHT 25
+#define HOTSPOT_FRAMES 15 /* frames between hotspot pane refreshes */
+#define DRAW_POLL_NS 100000000 /* longest wait of the draw thread */
+#define HOTSPOT_LINES 32   /* addresses ranked for the hotspot pane */
+#define LOG_LINES 16      /* messages kept for the logs pane */
 
 static mtx_t draw_mtx;
 static cnd_t draw_cnd;
+static atomic_bool draw_pending = false; /* display changed since the draw thread last took a snapshot */
 static uint8_t keybuffer[0x10] = {0};
 static chip8emu_snapshot snapshot;
 
 static tbui_widget_t * container;
 static tbui_frame_t *cpu_pane;
 static tbui_frame_t *disp_pane;
+static tbui_monobitmap_t *disp_bitmap;
 static tbui_frame_t *keymap_pane;
 static tbui_frame_t *opcode_pane;
 static tbui_frame_t *logs_pane;
@@ -31,6 +38,23 @@ static chip8emu *emu;
 static char * basedir;
 static int cpu_clk_speed = 500;
 static int timer_clk_speed = 60;
+static bool fast_forward = false;
+static uint8_t state_slot[C8STATE_MAX_SIZE];
+static size_t state_slot_size = 0;
+static chip8emu_profile profile;
+static uint64_t profile_prev[4096];
+
+typedef struct {
+    uint16_t  addr;
+    uint16_t  opcode;
+    int       share;        /* percent of the instructions executed since the previous refresh */
+} hotspot;
+
+static hotspot hotspots[HOTSPOT_LINES];
+static int hotspot_count = 0;
+static bool profiled = true;
+static char log_lines[LOG_LINES][80];
+static int log_count = 0;
 
 static char *default_keymap[0x10] = {
     "1", "2", "3", "4",
@@ -85,6 +109,86 @@ void cpu_pane_draw_content(tbui_widget_t *widget) {
     tbui_printf(widget, 1, 8, 0, 0, "SP #%02X", snapshot.sp);
 }
 
+/* hottest addresses since the previous refresh, needs libchip8emu built with CHIP8EMU_PROFILE;
+   draw thread only, opcodes come from the snapshot it has just taken */
+static void update_hotspots(void) {
+    uint64_t delta[4096], total = 0;
+
+    hotspot_count = 0;
+    profiled = chip8emu_get_profile(emu, &profile);
+    if (!profiled)
+        return;
+    for (int a = 0; a < 4096; ++a) {
+        /* a reset or a loaded state may move counters back */
+        delta[a] = profile.exec[a] >= profile_prev[a] ? profile.exec[a] - profile_prev[a] : profile.exec[a];
+        profile_prev[a] = profile.exec[a];
+        total += delta[a];
+    }
+    while (hotspot_count < HOTSPOT_LINES) {
+        int hot = 0;
+        for (int a = 1; a < 4096; ++a)
+            if (delta[a] > delta[hot])
+                hot = a;
+        if (!delta[hot])
+            break;
+        hotspot *h = &hotspots[hotspot_count++];
+        h->addr = (uint16_t) hot;
+        h->opcode = (uint16_t) (snapshot.memory[hot] << 8 | snapshot.memory[(hot + 1) & 0xFFF]);
+        h->share = (int) (delta[hot] * 100 / total);
+        delta[hot] = 0;
+    }
+}
+
+/* prints the last update_hotspots result, also redrawn by the keypad thread */
+void draw_hotspots(tbui_widget_t *widget) {
+    tbui_bound_t* bound = tbui_real_bound(widget);
+    int lines = bound->h - 2;
+    free(bound);
+
+    if (!profiled) {
+        tbui_printf(widget, 1, 1, 0, 0, "needs a lib built");
+        tbui_printf(widget, 1, 2, 0, 0, "with");
+        tbui_printf(widget, 1, 3, 0, 0, "CHIP8EMU_PROFILE");
+        return;
+    }
+    for (int line = 0; line < lines; ++line) {
+        tbui_print(widget, "                 ", 1, 1 + line, 0, 0);
+        if (line >= hotspot_count)
+            continue;
+
+        const hotspot *h = &hotspots[line];
+        uint16_t heat = h->share >= 25 ? TB_RED : h->share >= 5 ? TB_YELLOW : TB_GREEN;
+        tbui_printf(widget, 1, 1 + line, 0, 0, "%03X %04X", h->addr, h->opcode);
+        for (int b = 0; b < 4 && b * 25 <= h->share; ++b)
+            tbui_change_cell(widget, 10 + b, 1 + line, 0x2588, heat, 0);
+        tbui_printf(widget, 14, 1 + line, 0, 0, "%3d%%", h->share);
+    }
+}
+
+/* called by chip8emu_drain_log in the draw thread, the emulation thread only queues messages */
+void log_callback(chip8emu *emu, int log_level, const char *file, int line, const char* message) {
+    static const char levels[] = "DIWEF";
+    (void)emu; (void)file; (void)line;
+    char *text = log_lines[log_count++ % LOG_LINES];
+    snprintf(text, sizeof log_lines[0], "%c %s", levels[log_level % 5], message);
+    text[strcspn(text, "\n")] = '\0';
+}
+
+/* latest messages, newest at the bottom */
+void draw_logs(tbui_widget_t *widget) {
+    tbui_bound_t* bound = tbui_real_bound(widget);
+    int lines = bound->h - 2, width = bound->w - 2;
+    free(bound);
+    if (width < 1)
+        return;
+
+    int first = log_count > lines ? log_count - lines : 0;
+    for (int line = 0; line < lines; ++line) {
+        const char *text = first + line < log_count ? log_lines[(first + line) % LOG_LINES] : "";
+        tbui_printf(widget, 1, 1 + line, 0, 0, "%-*.*s", width, width, text);
+    }
+}
+
 void draw_keyboard(tbui_widget_t *widget) {
     /* tbui_change_cell(widget, 0, 0, 0x251C, 0 ,0);
     tbui_change_cell(widget, widget->bound->w - 1, 0, 0x252C, 0 ,0);
@@ -185,7 +289,10 @@ void beep_callback() {
 
 void draw_callback(chip8emu *emu) {
     (void)emu;
-    mtx_lock(&draw_mtx);
+    atomic_store(&draw_pending, true);
+    /* busy drawing: the draw thread sees the flag when done, never stall the emulation */
+    if (mtx_trylock(&draw_mtx) != thrd_success)
+        return;
     cnd_broadcast(&draw_cnd);
     mtx_unlock(&draw_mtx);
 }
@@ -228,7 +335,7 @@ static void setup_ui() {
     tbui_set_visible(disp_pane->widget, true);
     tbui_child_append(container, disp_pane->widget);
     {
-        tbui_monobitmap_t* disp_bitmap = tbui_new_monobitmap(disp_pane->widget);
+        disp_bitmap = tbui_new_monobitmap(disp_pane->widget);
         tbui_set_bound(disp_bitmap->widget, 1, 1, 64, 16);
         tbui_set_visible(disp_bitmap->widget, true);
         tbui_child_append(disp_pane->widget, disp_bitmap->widget);
@@ -266,6 +373,7 @@ static void setup_ui() {
     tbui_set_bound(opcode_pane->widget, 14, 18, 20, 255);
     tbui_set_visible(opcode_pane->widget, true);
     tbui_child_append(container, opcode_pane->widget);
+    opcode_pane->widget->custom_draw = &draw_hotspots;
 
     logs_pane = tbui_new_frame(container);
     logs_pane->title = "[ Logs ]";
@@ -273,6 +381,7 @@ static void setup_ui() {
     tbui_set_bound(logs_pane->widget, 34, 18, 255, 255);
     tbui_set_visible(logs_pane->widget, true);
     tbui_child_append(container, logs_pane->widget);
+    logs_pane->widget->custom_draw = &draw_logs;
 
     tbui_redraw(NULL);
 }
@@ -291,10 +400,35 @@ int display_draw_thread(void *arg) {
     disp_pane->footnote = fps_str;
     while (true) {
         mtx_lock(&draw_mtx);
-        cnd_wait(&draw_cnd, &draw_mtx);
+        if (!atomic_exchange(&draw_pending, false)) {
+            /* the timeout catches a wakeup missed while the keypad thread held the lock */
+            struct timespec deadline;
+            timespec_get(&deadline, TIME_UTC);
+            deadline.tv_nsec += DRAW_POLL_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            cnd_timedwait(&draw_cnd, &draw_mtx, &deadline);
+            if (!atomic_exchange(&draw_pending, false)) {
+                if (chip8emu_drain_log(emu, 0)) {
+                    tbui_redraw(logs_pane->widget);
+                    tb_present();
+                }
+                mtx_unlock(&draw_mtx);
+                continue;
+            }
+        }
         chip8emu_take_snapshot(emu, &snapshot);
+        disp_bitmap->dirty_rows = snapshot.dirty_rows;
         tbui_redraw(disp_pane->widget);
         tbui_redraw(cpu_pane->widget);
+        if (frame_count % HOTSPOT_FRAMES == 0) {
+            update_hotspots();
+            tbui_redraw(opcode_pane->widget);
+        }
+        if (chip8emu_drain_log(emu, 0))
+            tbui_redraw(logs_pane->widget);
         tb_present();
         frame_count++;
         elapsed_time = (uint32_t)time(NULL) - start_time;
@@ -312,9 +446,12 @@ int keypad_thread(void *arg) {
     chip8emu * emu = (chip8emu*) arg;
     bool quit = false;
     char roms_path[1024] = {0};
+    char state_path[1024] = {0};
 
     strcat(roms_path, basedir);
     strcat(roms_path, "/roms");
+    strcat(state_path, basedir);
+    strcat(state_path, "/chip8emu.state");
 
     struct tb_event ev;
     while (!quit) {
@@ -372,9 +509,31 @@ int keypad_thread(void *arg) {
                     tbui_redraw(NULL);
                 }
                 break;
+            case TB_KEY_CTRL_F:
+                /* toggle fast-forward, the draw thread skips the frames it cannot keep up with */
+                fast_forward = !fast_forward;
+                chip8emu_set_time_scale(emu, fast_forward ? 0 : 1000);
+                break;
             case TB_KEY_CTRL_M:
+                /* memory slot for quick reloads, the file survives a restart */
+                state_slot_size = chip8emu_save_state(emu, state_slot, sizeof state_slot);
+                chip8emu_save_state_file(emu, state_path);
+                break;
+            case TB_KEY_CTRL_B:
+                /* held ^B repeats: two frames back per event, ^P resumes */
+                if (!emu->paused) {
+                    chip8emu_pause(emu);
+                    disp_pane->widget->children[1]->visible = true;
+                    tbui_redraw(NULL);
+                }
+                if (chip8emu_rewind(emu, 2))
+                    draw_callback(emu);
                 break;
             case TB_KEY_CTRL_L:
+                if (state_slot_size)
+                    chip8emu_load_state(emu, state_slot, state_slot_size);
+                else
+                    chip8emu_load_state_file(emu, state_path);
                 break;
             default: {
                 for (int i = 0; i < 0x10; ++i) {
@@ -382,11 +541,13 @@ int keypad_thread(void *arg) {
                         if (strlen(game_keymap[i])>1) {
                             if (ev.key == game_tb_keymap[i]) {
                                 keybuffer[i]++;
+                                chip8emu_key_notify(emu);
                                 break;
                             }
                         } else {
                             if ((uint8_t)ev.ch == game_keymap[i][0]) {
                                 keybuffer[i]++;
+                                chip8emu_key_notify(emu);
                                 break;
                             }
                         }
@@ -440,8 +601,11 @@ int main(int argc, char **argv) {
 
     emu = chip8emu_new();
     emu->draw = &draw_callback;
+    emu->vblank_draw = true;
     emu->keystate= &keystate_callback;
     emu->beep = &beep_callback;
+    emu->log = &log_callback;
+    chip8emu_set_log_ring(emu, 256);
 
     thrd_t thrd_draw;
     thrd_t thrd_keypad;
@@ -453,6 +617,9 @@ int main(int argc, char **argv) {
     chip8emu_load_rom(emu, rom_file);
     cpu_clk_speed = 1500;
     chip8emu_set_cpu_speed(emu, cpu_clk_speed);
+    chip8emu_set_virtual_time(emu, true);
+    chip8emu_set_rewind(emu, 4 << 20);
+    chip8emu_set_trace(emu, 4096, "chip8emu.trace");
     chip8emu_start(emu);
 
     if (thrd_create(&thrd_draw, display_draw_thread, (void*)emu) != thrd_success) {
@@ -268,7 +268,7 @@ void tbui_child_delete(tbui_widget_t *parent, tbui_widget_t *child)
     tbui_delete(child);
 }
 
-void tbui_draw_hbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_color, uint16_t bg_color, int real_width, int real_height)
+void tbui_draw_hbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_color, uint16_t bg_color, int real_width, int real_height, uint32_t dirty_rows)
 {
     int offset_x = bound->x;
     int offset_y = bound->y;
@@ -276,6 +276,9 @@ void tbui_draw_hbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_co
     int scaled_height = real_height / 2 + (real_height % 2);
 
     for (int line = 0; line < scaled_height; ++line) {
+        /* one cell line covers two rows, rows past 32 are always drawn */
+        if (line < 16 && !((dirty_rows >> (line * 2)) & 3))
+            continue;
         for (int x = 0; x < scaled_width; ++x) {
             int y = line * 2;
             int y2 = y + 1;
@@ -453,9 +456,10 @@ static void _draw_monobitmap(tbui_widget_t* widget) {
         tbui_draw_brbitmap_mono(real_bound, bitmap->data, bitmap->fg_color, bitmap->bg_color, bitmap->real_width, bitmap->real_height);
         break;
     default: /* TBUI_BITMAP_HALF_BLOCK */
-        tbui_draw_hbitmap_mono(real_bound, bitmap->data, bitmap->fg_color, bitmap->bg_color, bitmap->real_width, bitmap->real_height);
+        tbui_draw_hbitmap_mono(real_bound, bitmap->data, bitmap->fg_color, bitmap->bg_color, bitmap->real_width, bitmap->real_height, bitmap->dirty_rows);
         break;
     }
+    bitmap->dirty_rows = 0xFFFFFFFF;
     free(real_bound);
 }
 
@@ -471,6 +475,7 @@ tbui_monobitmap_t *tbui_new_monobitmap(tbui_widget_t *parent)
     bitmap->fg_color = TB_DEFAULT;
     bitmap->bg_color = TB_DEFAULT;
     bitmap->bitmap_style = TBUI_BITMAP_HALF_BLOCK;
+    bitmap->dirty_rows = 0xFFFFFFFF;
 
     return bitmap;
 }
@@ -73,6 +73,7 @@ struct tbui_monobitmap_t {
     uint16_t fg_color;
     uint16_t bg_color;
     uint8_t *data;
+    uint32_t dirty_rows; /* rows of data to draw on next redraw, bit n = row n; reset to all after drawing */
     bitmap_style_t bitmap_style;
     tbui_widget_t* widget;
 };
@@ -82,7 +83,7 @@ void tbui_print(tbui_widget_t* widget, const char *str, int x, int y, uint16_t f
 void tbui_printf(tbui_widget_t* widget, int x, int y, uint16_t fg, uint16_t bg, const char *fmt, ...);
 
 /* draw using half blocks characters */
-void tbui_draw_hbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_color, uint16_t bg_color, int real_width, int real_height);
+void tbui_draw_hbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_color, uint16_t bg_color, int real_width, int real_height, uint32_t dirty_rows);
 /* draw using quarter blocks characters */
 void tbui_draw_qbitmap_mono(tbui_bound_t* bound, uint8_t *buffer, uint16_t fg_color, uint16_t bg_color, int real_width, int real_height);
 /* draw using braille characters */
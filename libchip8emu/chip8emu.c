@@ -2,42 +2,303 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <memory.h>
+#include <string.h>
 #include <time.h>
 #include "chip8emu.h"
+#include "chip8emu_ops.h"
+#ifdef CHIP8EMU_JIT
+#ifndef CHIP8EMU_THREADED_DISPATCH
+#error "CHIP8EMU_JIT requires CHIP8EMU_THREADED_DISPATCH"
+#endif
+#include "chip8emu_jit.h"
+#endif /* CHIP8EMU_JIT */
+#ifdef CHIP8EMU_OPSTATS
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define _chip8emu_tsc() __rdtsc()
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define _chip8emu_tsc() __rdtsc()
+#elif defined(__GNUC__) && defined(__aarch64__)
+static inline uint64_t _chip8emu_tsc(void) {
+    uint64_t v;
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+}
+#else
+#define _chip8emu_tsc() ((uint64_t) 0) /* no timestamp counter: counts only */
+#endif
+#endif /* CHIP8EMU_OPSTATS */
 
 #ifndef CHIP8EMU_NO_THREAD
 #include "tinycthread.h"
-#define NANOSECS_PER_SEC 1000000000
+#include "chip8emu_sched.h"
 #endif /*CHIP8EMU_NO_THREAD*/
 
+/* _run_flags: events raised by executed instructions */
+#define C8_RUNF_DRAW        0x01
+#define C8_RUNF_KEY_WAIT    0x02
+#define C8_RUNF_FAULT       0x04
+#define C8_RUNF_IDLE        0x08    /* nothing changes before the next timer tick */
+#define C8_RUNF_VBLANK_WAIT 0x10    /* C8QUIRK_DISPLAY_WAIT: sleep until the next timer tick */
+
+/* published snapshots: triple buffer handed over with one atomic state word */
+typedef struct {
+    chip8emu_snapshot buffers[3];
+    uint64_t  state;        /* C8_SNAP_*: middle buffer, set by the publisher, taken by the reader */
+    int       back;         /* written by the publisher, under mtx_cpu */
+    int       front;        /* read by the reader */
+} _chip8emu_snapshots;
+
+/* input movie being recorded or replayed */
+typedef struct {
+    bool      playing;
+    uint16_t  keys;         /* keys read by the cpu, of the queried bits */
+    uint64_t  cycle;        /* cycle of the previous entry */
+    uint64_t  frames;       /* timer ticks since the start */
+    uint8_t  *data;         /* recorded: header, state, entries; replayed: entries */
+    size_t    size;
+    size_t    capacity;     /* recording */
+    size_t    pos;          /* replay: next entry */
+    bool      diverged;     /* replay: a display hash differed */
+} _chip8emu_movie;
+
+#define C8_SNAP_DIRTY       0x00000000FFFFFFFFULL   /* rows changed in publications not yet acquired */
+#define C8_SNAP_MIDDLE_SHIFT 32
+#define C8_SNAP_FRESH       0x0000000400000000ULL   /* middle is newer than front */
+
+#ifdef _MSC_VER
+#include <intrin.h>
+/* small fields: aligned accesses kept in order by a compiler barrier */
+#define _chip8emu_atomic_load_relaxed(p) (_ReadWriteBarrier(), *(p))
+#define _chip8emu_atomic_store(p, v)    do { _ReadWriteBarrier(); *(p) = (v); } while (0)
+#define _chip8emu_atomic_or16(p, v)     _InterlockedOr16((volatile short*) (p), (short) (v))
+#define _chip8emu_atomic_and16(p, v)    _InterlockedAnd16((volatile short*) (p), (short) (v))
+#define _chip8emu_atomic_load(p)        ((uint64_t) _InterlockedOr64((volatile long long*) (p), 0))
+#define _chip8emu_atomic_exchange(p, v) ((uint64_t) _InterlockedExchange64((volatile long long*) (p), (long long) (v)))
+#define _chip8emu_atomic_add(p, v)      _InterlockedExchangeAdd64((volatile long long*) (p), (long long) (v))
+static bool _chip8emu_atomic_cas(uint64_t *p, uint64_t *expected, uint64_t desired)
+{
+    uint64_t old = (uint64_t) _InterlockedCompareExchange64((volatile long long*) p, (long long) desired, (long long) *expected);
+    bool swapped = old == *expected;
+    *expected = old;
+    return swapped;
+}
+#else
+#define _chip8emu_atomic_load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define _chip8emu_atomic_store(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define _chip8emu_atomic_or16(p, v)     __atomic_fetch_or(p, (uint16_t) (v), __ATOMIC_SEQ_CST)
+#define _chip8emu_atomic_and16(p, v)    __atomic_fetch_and(p, (uint16_t) (v), __ATOMIC_SEQ_CST)
+#define _chip8emu_atomic_load(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define _chip8emu_atomic_exchange(p, v) __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL)
+#define _chip8emu_atomic_add(p, v)      __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define _chip8emu_atomic_cas(p, expected, desired) \
+    __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#endif /* _MSC_VER */
+
+/* key edge events of chip8emu.key_events */
+#define C8_KEY_QUEUE        ((int) sizeof ((chip8emu*) 0)->_key_queue) /* power of two */
+#define C8_KEYEV_DOWN       0x10    /* | key */
 
 /* Logging */
-enum { C8E_LOG_DEBUG, C8E_LOG_INFO, C8E_LOG_WARN, C8E_LOG_ERR, C8E_LOG_FATAL };
-#define _chip8emu_log_debug(emu, ...)   _chip8emu_log_forward(emu, C8E_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define _chip8emu_log_info(emu, ...)    _chip8emu_log_forward(emu, C8E_LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define _chip8emu_log_warn(emu, ...)    _chip8emu_log_forward(emu, C8E_LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define _chip8emu_log_error(emu, ...)   _chip8emu_log_forward(emu, C8E_LOG_ERR, __FILE__, __LINE__, __VA_ARGS__)
-#define _chip8emu_log_fatal(emu, ...)   _chip8emu_log_forward(emu, C8E_LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#define _chip8emu_log(emu, level, ...) \
+    do { if ((level) >= (emu)->log_level) _chip8emu_log_forward(emu, level, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define _chip8emu_log_debug(emu, ...)   _chip8emu_log(emu, C8E_LOG_DEBUG, __VA_ARGS__)
+#define _chip8emu_log_info(emu, ...)    _chip8emu_log(emu, C8E_LOG_INFO,  __VA_ARGS__)
+#define _chip8emu_log_warn(emu, ...)    _chip8emu_log(emu, C8E_LOG_WARN,  __VA_ARGS__)
+#define _chip8emu_log_error(emu, ...)   _chip8emu_log(emu, C8E_LOG_ERR, __VA_ARGS__)
+#define _chip8emu_log_fatal(emu, ...)   _chip8emu_log(emu, C8E_LOG_FATAL, __VA_ARGS__)
+
+/* deferred messages of chip8emu_set_log_ring */
+#define C8_LOG_ARGS         4
+#define C8_LOG_TEXT         96      /* copies of the %s arguments, or the whole message */
+
+/* argument taken by a conversion */
+enum {
+    C8_LOGARG_NONE, C8_LOGARG_INT, C8_LOGARG_LONG, C8_LOGARG_LLONG, C8_LOGARG_SIZE,
+    C8_LOGARG_INTMAX, C8_LOGARG_PTRDIFF, C8_LOGARG_DOUBLE, C8_LOGARG_PTR, C8_LOGARG_STR,
+    C8_LOGARG_OTHER     /* not captured: the message is formatted by the producer */
+};
 
-static void _chip8emu_log_forward(chip8emu* emu, int level, const char *file, int line, const char *fmt, ...)
+typedef union {
+    int        i;
+    long       l;
+    long long  ll;
+    size_t     z;           /* also offset of a %s copy in text */
+    intmax_t   j;
+    ptrdiff_t  t;
+    double     d;
+    const void *p;
+} _chip8emu_log_arg;
+
+typedef struct {
+    uint64_t    seq;        /* position it can be filled at, that position + 1 once filled */
+    int         level;
+    int         line;
+    const char *file;
+    const char *fmt;        /* NULL: text is the formatted message */
+    _chip8emu_log_arg args[C8_LOG_ARGS];
+    char        text[C8_LOG_TEXT];
+} _chip8emu_log_entry;
+
+/* bounded queue, lock-free: producers claim positions with a CAS on tail, one consumer */
+typedef struct {
+    _chip8emu_log_entry *entries;
+    uint64_t  mask;
+    uint64_t  tail;         /* next position to fill */
+    uint64_t  head;         /* next position to drain, consumer only */
+    uint64_t  dropped;      /* messages raised while the ring was full */
+} _chip8emu_log_ring;
+
+/* conversion starting at spec ('%'): sets the argument it takes, returns its end */
+static const char* _chip8emu_log_spec(const char *spec, int *kind)
 {
-    char message[255] = {0};
+    const char *p = spec + 1;
+    int length = C8_LOGARG_INT;
 
-    va_list args;
+    if (*p == '%') {
+        *kind = C8_LOGARG_NONE;
+        return p + 1;
+    }
+    p += strspn(p, "-+ #0123456789.");
+    switch (*p) {
+    case 'h': p += p[1] == 'h' ? 2 : 1; break;
+    case 'l':
+        length = p[1] == 'l' ? C8_LOGARG_LLONG : C8_LOGARG_LONG;
+        p += p[1] == 'l' ? 2 : 1;
+        break;
+    case 'z': length = C8_LOGARG_SIZE; p++; break;
+    case 'j': length = C8_LOGARG_INTMAX; p++; break;
+    case 't': length = C8_LOGARG_PTRDIFF; p++; break;
+    default: break;
+    }
+    if (p - spec > 16) {
+        *kind = C8_LOGARG_OTHER;
+        return p;
+    }
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+        *kind = length;
+        break;
+    case 'c':
+        *kind = length == C8_LOGARG_INT ? C8_LOGARG_INT : C8_LOGARG_OTHER;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        *kind = C8_LOGARG_DOUBLE;
+        break;
+    case 'p':
+        *kind = C8_LOGARG_PTR;
+        break;
+    case 's':
+        *kind = length == C8_LOGARG_INT ? C8_LOGARG_STR : C8_LOGARG_OTHER;
+        break;
+    default: /* '*' width, long double, %n, end of the format */
+        *kind = C8_LOGARG_OTHER;
+        return p;
+    }
+    return p + 1;
+}
 
-    va_start(args, fmt);
-    vsnprintf(message, 255, fmt, args);
-    va_end(args);
+/* stores the arguments of fmt, copying strings, instead of formatting the message */
+static void _chip8emu_log_capture(_chip8emu_log_entry *entry, const char *fmt, va_list args)
+{
+    va_list copy;
+    size_t used = 0;
+    int n = 0;
+
+    va_copy(copy, args);
+    entry->fmt = fmt;
+    for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        int kind;
+        p = _chip8emu_log_spec(p, &kind);
+        if (kind == C8_LOGARG_NONE)
+            continue;
+        if (kind == C8_LOGARG_OTHER || n == C8_LOG_ARGS) {
+            entry->fmt = NULL;
+            break;
+        }
+        _chip8emu_log_arg *arg = &entry->args[n++];
+        switch (kind) {
+        case C8_LOGARG_INT:     arg->i = va_arg(args, int); break;
+        case C8_LOGARG_LONG:    arg->l = va_arg(args, long); break;
+        case C8_LOGARG_LLONG:   arg->ll = va_arg(args, long long); break;
+        case C8_LOGARG_SIZE:    arg->z = va_arg(args, size_t); break;
+        case C8_LOGARG_INTMAX:  arg->j = va_arg(args, intmax_t); break;
+        case C8_LOGARG_PTRDIFF: arg->t = va_arg(args, ptrdiff_t); break;
+        case C8_LOGARG_DOUBLE:  arg->d = va_arg(args, double); break;
+        case C8_LOGARG_PTR:     arg->p = va_arg(args, void*); break;
+        case C8_LOGARG_STR: {
+            /* the string may not outlive the call: copied, truncated once text is full */
+            const char *str = va_arg(args, const char*);
+            size_t len = str ? strlen(str) : 0;
+            if (used == C8_LOG_TEXT) {
+                arg->z = C8_LOG_TEXT - 1;
+                break;
+            }
+            if (len > C8_LOG_TEXT - 1 - used)
+                len = C8_LOG_TEXT - 1 - used;
+            if (len)
+                memcpy(entry->text + used, str, len);
+            entry->text[used + len] = '\0';
+            arg->z = used;
+            used += len + 1;
+            break;
+        }
+        default: break;
+        }
+    }
+    if (!entry->fmt)
+        vsnprintf(entry->text, C8_LOG_TEXT, fmt, copy);
+    va_end(copy);
+}
 
-    emu->log(emu, level, file, line, message);
+static void _chip8emu_log_push(_chip8emu_log_ring *ring, int level, const char *file, int line,
+                               const char *fmt, va_list args)
+{
+    uint64_t pos = _chip8emu_atomic_load(&ring->tail);
+    _chip8emu_log_entry *entry;
+
+    for (;;) {
+        entry = &ring->entries[pos & ring->mask];
+        uint64_t seq = _chip8emu_atomic_load(&entry->seq);
+        if (seq == pos) {
+            if (_chip8emu_atomic_cas(&ring->tail, &pos, pos + 1))
+                break;
+        } else if (seq < pos) {
+            /* full: the entry of the previous lap is not drained yet */
+            _chip8emu_atomic_add(&ring->dropped, 1);
+            return;
+        } else {
+            pos = _chip8emu_atomic_load(&ring->tail);
+        }
+    }
+    entry->level = level;
+    entry->file = file;
+    entry->line = line;
+    _chip8emu_log_capture(entry, fmt, args);
+    _chip8emu_atomic_store(&entry->seq, pos + 1);
 }
 
 static void _dummy_logger(chip8emu *emu, int log_level, const char *file, int line, const char* message) {
     (void)emu; (void)log_level; (void)file; (void)line; (void)message;
 }
 
-static int _default_rand(void) {
-    return rand();
+static void _chip8emu_log_forward(chip8emu* emu, int level, const char *file, int line, const char *fmt, ...)
+{
+    if (emu->log == &_dummy_logger)
+        return;
+
+    va_list args;
+
+    va_start(args, fmt);
+    if (emu->_log_ring) {
+        _chip8emu_log_push((_chip8emu_log_ring*) emu->_log_ring, level, file, line, fmt, args);
+    } else {
+        char message[255] = {0};
+        vsnprintf(message, 255, fmt, args);
+        emu->log(emu, level, file, line, message);
+    }
+    va_end(args);
 }
 
 /* opcode handling prototypes */
@@ -58,11 +319,92 @@ static int _chip8emu_opcode_handler_D(chip8emu* emu);
 static int _chip8emu_opcode_handler_E(chip8emu* emu);
 static int _chip8emu_opcode_handler_F(chip8emu* emu);
 
+static int (* const _chip8emu_default_handlers[0x10])(chip8emu *) = {
+    &_chip8emu_opcode_handler_0, &_chip8emu_opcode_handler_1,
+    &_chip8emu_opcode_handler_2, &_chip8emu_opcode_handler_3,
+    &_chip8emu_opcode_handler_4, &_chip8emu_opcode_handler_5,
+    &_chip8emu_opcode_handler_6, &_chip8emu_opcode_handler_7,
+    &_chip8emu_opcode_handler_8, &_chip8emu_opcode_handler_9,
+    &_chip8emu_opcode_handler_A, &_chip8emu_opcode_handler_B,
+    &_chip8emu_opcode_handler_C, &_chip8emu_opcode_handler_D,
+    &_chip8emu_opcode_handler_E, &_chip8emu_opcode_handler_F
+};
+
+/* bit h: opcode_handlers[h] was replaced, also used by chip8emu_batch_new */
+uint16_t _chip8emu_overridden_handlers(const chip8emu *emu)
+{
+    uint16_t overridden = 0;
+    for (int h = 0; h < 0x10; ++h)
+        if (emu->opcode_handlers[h] != _chip8emu_default_handlers[h])
+            overridden |= 1 << h;
+    return overridden;
+}
+
 static uint8_t _chip8emu_timer_delay(chip8emu* emu);
+static uint8_t _chip8emu_timer_sound(chip8emu* emu);
 static void _chip8emu_timer_delay_set(chip8emu* emu, uint8_t val);
 
 static void _chip8emu_timer_sound_set(chip8emu* emu, uint8_t val);
 
+static void _chip8emu_draw(chip8emu* emu);
+static void _chip8emu_vblank(chip8emu* emu);
+static void _chip8emu_publish(chip8emu* emu);
+static void _chip8emu_rewind_capture(chip8emu* emu);
+static uint16_t _chip8emu_movie_replay_keys(chip8emu* emu);
+static void _chip8emu_movie_record_keys(chip8emu* emu, uint16_t queried, uint16_t pressed);
+static void _chip8emu_movie_tick(chip8emu* emu);
+static void _chip8emu_movie_free(chip8emu* emu);
+static void _chip8emu_log_ring_free(_chip8emu_log_ring *ring);
+static void _chip8emu_unpack_display(const uint64_t display[32], uint8_t *gfx);
+static uint8_t* _chip8emu_state_put(uint8_t *p, uint64_t v, int bytes);
+static bool _chip8emu_key_pressed(chip8emu* emu, uint8_t key);
+static uint8_t _chip8emu_first_key(chip8emu* emu);
+#ifdef CHIP8EMU_OPSTATS
+static void* _chip8emu_opstats_new(void);
+#endif /* CHIP8EMU_OPSTATS */
+#ifdef CHIP8EMU_PROFILE
+static void* _chip8emu_profile_new(void);
+#endif /* CHIP8EMU_PROFILE */
+#ifndef CHIP8EMU_NO_THREAD
+static uint64_t chip8emu_thread_slice(_chip8emu_task *task, uint64_t now);
+#endif /* CHIP8EMU_NO_THREAD */
+
+/* instruction classes of the dispatch engine */
+enum {
+    C8I_UNDECODED,
+    C8I_INVALID,
+    C8I_00E0, C8I_00EE, C8I_1NNN, C8I_2NNN, C8I_3XNN, C8I_4XNN, C8I_5XY0,
+    C8I_6XNN, C8I_7XNN, C8I_8XY0, C8I_8XY1, C8I_8XY2, C8I_8XY3, C8I_8XY4,
+    C8I_8XY5, C8I_8XY6, C8I_8XY7, C8I_8XYE, C8I_9XY0, C8I_ANNN, C8I_BNNN,
+    C8I_CXNN, C8I_DXYN, C8I_EX9E, C8I_EXA1, C8I_FX07, C8I_FX0A, C8I_FX15,
+    C8I_FX18, C8I_FX1E, C8I_FX29, C8I_FX33, C8I_FX55, C8I_FX65,
+    C8I_F_LOAD_SKIP, C8I_F_DELAY_LOOP, C8I_F_SPRITE, /* C8FUSE_* */
+    C8I_JIT,        /* translated region, CHIP8EMU_JIT builds */
+    C8I_COUNT
+};
+
+#ifdef CHIP8EMU_THREADED_DISPATCH
+/* predecoded instruction, see threaded dispatch engine */
+typedef struct {
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t  cls;       /* C8I_UNDECODED until first execution */
+    uint8_t  x;
+    uint8_t  y;
+    uint8_t  nn;        /* N is the low nibble */
+} _chip8emu_decoded;
+
+typedef struct {
+    uint16_t overridden;    /* opcode_handlers replaced when the entries were decoded */
+    uint64_t fused[C8FUSE_COUNT];
+    _chip8emu_decoded entries[4096];
+} _chip8emu_decode_cache;
+
+static void _chip8emu_code_written(chip8emu *emu, uint32_t addr, uint32_t len);
+#else
+#define _chip8emu_code_written(emu, addr, len) ((void)(emu), (void)(addr), (void)(len))
+#endif /* CHIP8EMU_THREADED_DISPATCH */
+
 /* Default font set */
 static uint8_t chip8_fontset[80] =
 {
@@ -95,7 +437,17 @@ chip8emu *chip8emu_new(void)
     emu->I      = 0;      /* Reset index register */
     emu->sp     = 0;      /* Reset stack pointer */
 
-    memset(emu->gfx, 0, 64 * 32);      /* Clear display */
+    emu->cycles = 0;
+    emu->idle_cycles = 0;
+    emu->_frame_cycles = 0;
+    emu->_run_flags = 0;
+    emu->_idle_period = 0;
+    emu->_timer_ticks = 0;
+
+    memset(emu->display, 0, sizeof emu->display); /* Clear display */
+    memset(emu->gfx, 0, 64 * 32);
+    emu->_gfx_stale = false;
+    emu->_dirty_rows = 0xFFFFFFFF;
     memset(emu->stack, 0, 16 * sizeof(uint16_t));         /* Clear stack */
     memset(emu->V, 0, 16);             /* Clear registers V0-VF */
     memset(emu->memory, 0, 4096);      /* Clear memory */
@@ -107,64 +459,81 @@ chip8emu *chip8emu_new(void)
     /* Reset timers */
     emu->delay_timer = 0;
     emu->sound_timer = 0;
+    emu->_delay_since = 0;
+    emu->_sound_since = 0;
+    emu->_vt_frac = 0;
 
+    emu->_snapshots = 0;   /* allocated by the first reader */
+    emu->_rewind = 0;
+    emu->_movie = 0;
     emu->draw = 0;
     emu->keystate = 0;
+    emu->key_events = false;
+    emu->_keys = 0;
+    emu->_cpu_keys = 0;
+    emu->_keys_unseen = 0;
+    emu->_key_head = 0;
+    emu->_key_tail = 0;
+    emu->_key_overflow = false;
     emu->beep = 0;
-    emu->rand = &_default_rand;
+    emu->rand = 0;
+    emu->_rng = 1;
     emu->log = &_dummy_logger;
-
-    emu->opcode_handlers[0x0] = &_chip8emu_opcode_handler_0;
-    emu->opcode_handlers[0x1] = &_chip8emu_opcode_handler_1;
-    emu->opcode_handlers[0x2] = &_chip8emu_opcode_handler_2;
-    emu->opcode_handlers[0x3] = &_chip8emu_opcode_handler_3;
-    emu->opcode_handlers[0x4] = &_chip8emu_opcode_handler_4;
-    emu->opcode_handlers[0x5] = &_chip8emu_opcode_handler_5;
-    emu->opcode_handlers[0x6] = &_chip8emu_opcode_handler_6;
-    emu->opcode_handlers[0x7] = &_chip8emu_opcode_handler_7;
-    emu->opcode_handlers[0x8] = &_chip8emu_opcode_handler_8;
-    emu->opcode_handlers[0x9] = &_chip8emu_opcode_handler_9;
-    emu->opcode_handlers[0xA] = &_chip8emu_opcode_handler_A;
-    emu->opcode_handlers[0xB] = &_chip8emu_opcode_handler_B;
-    emu->opcode_handlers[0xC] = &_chip8emu_opcode_handler_C;
-    emu->opcode_handlers[0xD] = &_chip8emu_opcode_handler_D;
-    emu->opcode_handlers[0xE] = &_chip8emu_opcode_handler_E;
-    emu->opcode_handlers[0xF] = &_chip8emu_opcode_handler_F;
+    emu->log_level = C8E_LOG_INFO;
+    emu->_log_ring = 0;
+
+    emu->vblank_draw = false;
+    emu->quirks = 0;
+    emu->_draw_pending = false;
+
+    for(int i = 0; i < 0x10; ++i)
+        emu->opcode_handlers[i] = _chip8emu_default_handlers[i];
+
+#ifdef CHIP8EMU_THREADED_DISPATCH
+    emu->_decode_cache = calloc(1, sizeof (_chip8emu_decode_cache));
+#else
+    emu->_decode_cache = 0;
+#endif /* CHIP8EMU_THREADED_DISPATCH */
+#ifdef CHIP8EMU_JIT
+    emu->_jit = _chip8emu_jit_new(); /* NULL: interpret only */
+#else
+    emu->_jit = 0;
+#endif /* CHIP8EMU_JIT */
+#ifdef CHIP8EMU_OPSTATS
+    emu->_opstats = _chip8emu_opstats_new();
+#else
+    emu->_opstats = 0;
+#endif /* CHIP8EMU_OPSTATS */
+#ifdef CHIP8EMU_PROFILE
+    emu->_profile = _chip8emu_profile_new();
+#else
+    emu->_profile = 0;
+#endif /* CHIP8EMU_PROFILE */
+    emu->_trace = 0;
 
 #ifndef CHIP8EMU_NO_THREAD
     emu->paused = true;
 
-    emu->_cpu_clk_delay = malloc(sizeof (struct timespec));
-    emu->_timer_clk_delay = malloc(sizeof (struct timespec));
-
-    struct timespec* cpu_clk_delay = (struct timespec*) emu->_cpu_clk_delay;
-    cpu_clk_delay->tv_sec = 0;
-    cpu_clk_delay->tv_nsec = 2000000; /* default to 500Hz */
+    _chip8emu_clock* cpu_clock = calloc(1, sizeof (_chip8emu_clock));
+    cpu_clock->millihz = 500 * 1000; /* default to 500Hz */
+    emu->_cpu_clock = cpu_clock;
 
-    struct timespec* timer_clk_delay = (struct timespec*) emu->_timer_clk_delay;
-    timer_clk_delay->tv_sec = 0;
-    timer_clk_delay->tv_nsec = 16666666; /* default to 60Hz */
+    _chip8emu_clock* timer_clock = calloc(1, sizeof (_chip8emu_clock));
+    timer_clock->millihz = 60 * 1000; /* default to 60Hz */
+    emu->_timer_clock = timer_clock;
 
-    emu->thrd_clk_timers = malloc(sizeof (thrd_t));
-    emu->thrd_timer_tick = malloc(sizeof (thrd_t));
-    emu->thrd_clk_cpu = malloc(sizeof (thrd_t));
-    emu->thrd_cpu_cycle = malloc(sizeof (thrd_t));
+    emu->_pace_clock = calloc(1, sizeof (_chip8emu_clock));
+    emu->_virtual_time = false;
+    emu->_time_scale = 1000;
 
     emu->mtx_cpu = malloc(sizeof (mtx_t));
     mtx_init(emu->mtx_cpu, mtx_plain);
-    emu->mtx_timers = malloc(sizeof (mtx_t));
-    mtx_init(emu->mtx_timers, mtx_plain);
     emu->mtx_pause = malloc(sizeof (mtx_t));
     mtx_init(emu->mtx_pause, mtx_plain);
 
-    emu->cnd_clk_cpu = malloc(sizeof (cnd_t));
-    cnd_init(emu->cnd_clk_cpu);
-    emu->cnd_clk_timers = malloc(sizeof (cnd_t));
-    cnd_init(emu->cnd_clk_timers);
-    emu->cnd_resume_cpu = malloc(sizeof (cnd_t));
-    cnd_init(emu->cnd_resume_cpu);
-    emu->cnd_resume_timers = malloc(sizeof (cnd_t));
-    cnd_init(emu->cnd_resume_timers);
+    emu->_task = _chip8emu_sched_task_new(&chip8emu_thread_slice, emu);
+    emu->_key_blocked = false;
+    emu->_cpu_waiting = false;
 #endif /* CHIP8EMU_NO_THREAD */
 
     return emu;
@@ -172,542 +541,2884 @@ chip8emu *chip8emu_new(void)
 
 void chip8emu_free(chip8emu *emu)
 {
+#ifndef CHIP8EMU_NO_THREAD
+    _chip8emu_sched_detach((_chip8emu_task*) emu->_task);
+    free(emu->_task);
+    free(emu->_cpu_clock);
+    free(emu->_timer_clock);
+    free(emu->_pace_clock);
+#endif /* CHIP8EMU_NO_THREAD */
+    free(emu->_decode_cache);
+    free(emu->_opstats);
+    free(emu->_profile);
+    chip8emu_set_trace(emu, 0, NULL);
+    free(emu->_snapshots);
+    chip8emu_set_rewind(emu, 0);
+    _chip8emu_movie_free(emu);
+    _chip8emu_log_ring_free((_chip8emu_log_ring*) emu->_log_ring);
+#ifdef CHIP8EMU_JIT
+    _chip8emu_jit_free((_chip8emu_jit*) emu->_jit);
+#endif /* CHIP8EMU_JIT */
     free(emu);
 }
 
+#ifdef CHIP8EMU_PROFILE
+/* ******************** Profiler ******************** */
+static void* _chip8emu_profile_new(void)
+{
+    return calloc(1, sizeof (chip8emu_profile));
+}
+
+/* count instructions executed at pc, pc + 2, ... */
+static inline void _chip8emu_profile_exec(chip8emu *emu, uint16_t pc, int count)
+{
+    chip8emu_profile *profile = (chip8emu_profile*) emu->_profile;
+    for (int k = 0; k < count; ++k, pc += 2) {
+        profile->exec[pc & 0xFFF]++;
+        profile->flags[pc & 0xFFF] |= C8PROF_CODE;
+        profile->flags[(pc + 1) & 0xFFF] |= C8PROF_CODE;
+    }
+}
+
+static inline void _chip8emu_profile_access(chip8emu *emu, uint16_t addr, int len, uint8_t flag)
+{
+    uint8_t *flags = ((chip8emu_profile*) emu->_profile)->flags;
+    for (int k = 0; k < len; ++k)
+        flags[(addr + k) & 0xFFF] |= flag;
+}
+
+#define C8_PROFILE_EXEC(var)                _chip8emu_profile_exec(emu, var, 1)
+#define C8_PROFILE_ACCESS(addr, len, flag)  _chip8emu_profile_access(emu, addr, len, flag)
+/* ******************** /Profiler ******************** */
+#else
+#define C8_PROFILE_EXEC(var)                ((void) 0)
+#define C8_PROFILE_ACCESS(addr, len, flag)  ((void) 0)
+#endif /* CHIP8EMU_PROFILE */
+
+#ifdef CHIP8EMU_TRACE
+/* ******************** Instruction trace ******************** */
+#define C8_TRACE_HEADER     16
+#define C8_TRACE_RECORD     8
+
+typedef struct {
+    uint64_t *ring;         /* pc | opcode << 16 | I << 32 | VX << 48 | VF << 56 */
+    uint64_t  mask;         /* capacity - 1 */
+    uint64_t  written;      /* records since the trace was set */
+    bool      faulted;
+    uint16_t  fault_pc;
+    uint16_t  fault_opcode;
+    uint64_t  fault_written;  /* written at the fault */
+    char     *fault_file;   /* NULL: not dumped on fault */
+} _chip8emu_trace;
+
+static inline uint64_t _chip8emu_trace_record(chip8emu *emu, uint16_t pc, uint16_t opcode)
+{
+    return pc | (uint64_t) opcode << 16 | (uint64_t) emu->I << 32
+        | (uint64_t) emu->V[(opcode >> 8) & 0xF] << 48 | (uint64_t) emu->V[0xF] << 56;
+}
+
+#ifdef CHIP8EMU_THREADED_DISPATCH
+/* records the first count instructions of a superinstruction run from pc, only the first may change registers */
+static void _chip8emu_trace_fused(chip8emu *emu, _chip8emu_trace *trace, uint16_t pc, int count)
+{
+    for (int k = 0; k < count; ++k, pc += 2) {
+        uint16_t opcode = (uint16_t) (emu->memory[pc & 0xFFF] << 8 | emu->memory[(pc + 1) & 0xFFF]);
+        trace->ring[trace->written++ & trace->mask] = _chip8emu_trace_record(emu, pc, opcode);
+    }
+}
+#endif /* CHIP8EMU_THREADED_DISPATCH */
+
+/* mtx_cpu held */
+static size_t _chip8emu_trace_write(_chip8emu_trace *trace, uint8_t *buf, size_t size)
+{
+    uint64_t count = trace->written < trace->mask + 1 ? trace->written : trace->mask + 1;
+    size_t needed = C8_TRACE_HEADER + (size_t) count * C8_TRACE_RECORD;
+    uint8_t *p = buf;
+
+    if (!buf)
+        return needed;
+    if (size < needed)
+        return 0;
+    memcpy(p, "C8TR", 4);
+    p[4] = C8TRACE_VERSION;
+    p[5] = trace->faulted ? C8TRACE_FAULTED : 0;
+    p = _chip8emu_state_put(p + 6, trace->fault_pc, 2);
+    p = _chip8emu_state_put(p, trace->fault_opcode, 2);
+    p = _chip8emu_state_put(p, count, 4);
+    p = _chip8emu_state_put(p, 0, 2);
+    for (uint64_t i = trace->written - count; i < trace->written; ++i)
+        p = _chip8emu_state_put(p, trace->ring[i & trace->mask], 8);
+    return needed;
+}
+
+/* mtx_cpu held */
+static int _chip8emu_trace_write_file(chip8emu *emu, _chip8emu_trace *trace, const char *filename)
+{
+    size_t size = _chip8emu_trace_write(trace, NULL, 0);
+    uint8_t *buf = malloc(size);
+    FILE *f = fopen(filename, "wb");
+    bool written = f && fwrite(buf, 1, _chip8emu_trace_write(trace, buf, size), f) == size;
+
+    free(buf);
+    if (f == NULL || fclose(f) != 0 || !written) {
+        _chip8emu_log_error(emu, "cannot write trace file %s\n", filename);
+        return C8ERR_FILE;
+    }
+    return C8ERR_OK;
+}
+
+/* emu->opcode at emu->pc could not be executed */
+static void _chip8emu_trace_fault(chip8emu *emu)
+{
+    _chip8emu_trace *trace = (_chip8emu_trace*) emu->_trace;
+    if (!trace)
+        return;
+    /* a started emulator retries the fault every timer tick: dumped once */
+    if (trace->faulted && trace->fault_pc == emu->pc && trace->fault_opcode == emu->opcode
+        && trace->fault_written == trace->written)
+        return;
+    trace->faulted = true;
+    trace->fault_pc = emu->pc;
+    trace->fault_opcode = emu->opcode;
+    trace->fault_written = trace->written;
+    if (trace->fault_file && _chip8emu_trace_write_file(emu, trace, trace->fault_file) == C8ERR_OK)
+        _chip8emu_log_info(emu, "fault at #%03X, trace written to %s\n", emu->pc, trace->fault_file);
+}
+
+#define C8_TRACE_EXEC(var) do { \
+        _chip8emu_trace *trace_ = (_chip8emu_trace*) emu->_trace; \
+        if (trace_) \
+            trace_->ring[trace_->written++ & trace_->mask] = _chip8emu_trace_record(emu, var, emu->opcode); \
+    } while (0)
+#define C8_TRACE_FAULT()    _chip8emu_trace_fault(emu)
+/* ******************** /Instruction trace ******************** */
+#else
+#define C8_TRACE_EXEC(var)  ((void) 0)
+#define C8_TRACE_FAULT()    ((void) 0)
+#endif /* CHIP8EMU_TRACE */
+
+#if defined(CHIP8EMU_PROFILE) || defined(CHIP8EMU_TRACE)
+#define C8_EXEC_PC(var)     uint16_t var = emu->pc
+#else
+#define C8_EXEC_PC(var)     ((void) 0)
+#endif
+
+/* ******************** Instruction semantics ******************** */
+/*
+ * Accessors of the C8_BODY_* statements of chip8emu_ops.h, which the batch
+ * lanes expand too. The _chip8emu_op_* functions add what only a whole
+ * emulator has (dirty rows, run flags, the profiler, the decode cache) and
+ * are shared by the opcode handlers and the dispatch engine, operands are
+ * decoded by the caller.
+ */
+#define C8_V(r)             emu->V[r]
+#define C8_I                emu->I
+#define C8_PC               emu->pc
+#define C8_SP               emu->sp
+#define C8_STACK(i)         emu->stack[i]
+#define C8_READ(addr)       emu->memory[(addr) & 0xFFF]
+#define C8_WRITE(addr, val) (emu->memory[(addr) & 0xFFF] = (uint8_t) (val))
+#define C8_DISPLAY(row)     emu->display[row]
+#define C8_DRAWN(row, bits) (emu->_dirty_rows |= (bits) ? 1u << (row) : 0)
+#define C8_DELAY()          _chip8emu_timer_delay(emu)
+#define C8_SET_DELAY(v)     _chip8emu_timer_delay_set(emu, v)
+#define C8_SET_SOUND(v)     _chip8emu_timer_sound_set(emu, v)
+#define C8_KEY(k)           _chip8emu_key_pressed(emu, k)
+#define C8_FIRST_KEY()      _chip8emu_first_key(emu)
+#define C8_KEY_WAIT()       (emu->_run_flags |= C8_RUNF_KEY_WAIT)
+#define C8_RAND()           _chip8emu_rand(emu)
+
+static inline void _chip8emu_op_00E0(chip8emu* emu) {
+    C8_BODY_00E0();
+    emu->_gfx_stale = true;
+    _chip8emu_draw(emu);
+}
+
+static inline void _chip8emu_op_00EE(chip8emu* emu) {
+    C8_BODY_00EE();
+}
+
+/*
+ * Raises C8_RUNF_IDLE for a jump to self, or for the jump of a delay loop
+ * (FX07, 3XNN/4XNN, 1NNN back to FX07) that will keep looping until the
+ * delay timer changes. The loop state then repeats every _idle_period
+ * instructions until the next timer tick.
+ */
+static void _chip8emu_idle_check(chip8emu* emu, uint16_t nnn)
+{
+    if (nnn == emu->pc) {
+        emu->_idle_period = 1;
+        emu->_run_flags |= C8_RUNF_IDLE;
+        return;
+    }
+    if (nnn + 3 >= 4096)
+        return;
+
+    uint8_t x = emu->memory[nnn] & 0x0F;
+    uint8_t skip = emu->memory[nnn + 2] >> 4;
+    uint8_t nn = emu->memory[nnn + 3];
+    if (emu->memory[nnn] >> 4 != 0xF || emu->memory[nnn + 1] != 0x07
+            || (skip != 0x3 && skip != 0x4) || (emu->memory[nnn + 2] & 0x0F) != x)
+        return;
+    if (emu->opcode_handlers[0xF] != _chip8emu_default_handlers[0xF]
+            || emu->opcode_handlers[skip] != _chip8emu_default_handlers[skip])
+        return;
+    /* the next FX07 must read the same value and the skip must not be taken */
+    if (emu->V[x] != _chip8emu_timer_delay(emu) || (skip == 0x3) == (emu->V[x] == nn))
+        return;
+
+    emu->_idle_period = 3;
+    emu->_run_flags |= C8_RUNF_IDLE;
+}
+
+static inline void _chip8emu_op_1NNN(chip8emu* emu, uint16_t nnn) {
+    if (nnn == emu->pc || nnn + 4 == emu->pc)
+        _chip8emu_idle_check(emu, nnn);
+    C8_BODY_1NNN(nnn);
+}
+
+static inline void _chip8emu_op_2NNN(chip8emu* emu, uint16_t nnn) {
+    C8_BODY_2NNN(nnn);
+}
+
+static inline void _chip8emu_op_3XNN(chip8emu* emu, uint8_t x, uint8_t nn) {
+    C8_BODY_3XNN(x, nn);
+}
+
+static inline void _chip8emu_op_4XNN(chip8emu* emu, uint8_t x, uint8_t nn) {
+    C8_BODY_4XNN(x, nn);
+}
+
+static inline void _chip8emu_op_5XY0(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_5XY0(x, y);
+}
+
+static inline void _chip8emu_op_6XNN(chip8emu* emu, uint8_t x, uint8_t nn) {
+    C8_BODY_6XNN(x, nn);
+}
+
+static inline void _chip8emu_op_7XNN(chip8emu* emu, uint8_t x, uint8_t nn) {
+    C8_BODY_7XNN(x, nn);
+}
+
+static inline void _chip8emu_op_8XY0(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY0(x, y);
+}
+
+static inline void _chip8emu_op_8XY1(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY1(x, y);
+}
+
+static inline void _chip8emu_op_8XY2(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY2(x, y);
+}
+
+static inline void _chip8emu_op_8XY3(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY3(x, y);
+}
+
+static inline void _chip8emu_op_8XY4(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY4(x, y);
+}
+
+static inline void _chip8emu_op_8XY5(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY5(x, y);
+}
+
+static inline void _chip8emu_op_8XY6(chip8emu* emu, uint8_t x) {
+    C8_BODY_8XY6(x);
+}
+
+static inline void _chip8emu_op_8XY7(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_8XY7(x, y);
+}
+
+static inline void _chip8emu_op_8XYE(chip8emu* emu, uint8_t x) {
+    C8_BODY_8XYE(x);
+}
+
+static inline void _chip8emu_op_9XY0(chip8emu* emu, uint8_t x, uint8_t y) {
+    C8_BODY_9XY0(x, y);
+}
+
+static inline void _chip8emu_op_ANNN(chip8emu* emu, uint16_t nnn) {
+    C8_BODY_ANNN(nnn);
+}
+
+static inline void _chip8emu_op_BNNN(chip8emu* emu, uint16_t nnn) {
+    C8_BODY_BNNN(nnn);
+}
+
+static inline uint8_t _chip8emu_rand(chip8emu* emu) {
+    if (emu->rand)
+        return (uint8_t) (emu->rand() % (0xFF + 1));
+    return _chip8emu_xorshift(&emu->_rng);
+}
+
+static inline void _chip8emu_op_CXNN(chip8emu* emu, uint8_t x, uint8_t nn) {
+    C8_BODY_CXNN(x, nn);
+}
+
+static inline void _chip8emu_op_DXYN(chip8emu* emu, uint8_t x, uint8_t y, uint8_t height) {
+    C8_PROFILE_ACCESS(emu->I, height, C8PROF_DATA);
+    C8_BODY_DXYN(x, y, height);
+    emu->_gfx_stale = true;
+    if (emu->quirks & C8QUIRK_DISPLAY_WAIT)
+        emu->_run_flags |= C8_RUNF_VBLANK_WAIT;
+    _chip8emu_draw(emu);
+}
+
+static inline void _chip8emu_op_EX9E(chip8emu* emu, uint8_t x) {
+    C8_BODY_EX9E(x);
+}
+
+static inline void _chip8emu_op_EXA1(chip8emu* emu, uint8_t x) {
+    C8_BODY_EXA1(x);
+}
+
+static inline void _chip8emu_op_FX07(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX07(x);
+}
+
+static inline void _chip8emu_op_FX0A(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX0A(x);
+}
+
+static inline void _chip8emu_op_FX15(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX15(x);
+}
+
+static inline void _chip8emu_op_FX18(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX18(x);
+}
+
+static inline void _chip8emu_op_FX1E(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX1E(x);
+}
+
+static inline void _chip8emu_op_FX29(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX29(x);
+}
+
+static inline void _chip8emu_op_FX33(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX33(x);
+    _chip8emu_code_written(emu, emu->I, 3);
+    C8_PROFILE_ACCESS(emu->I, 3, C8PROF_WRITTEN);
+}
+
+static inline void _chip8emu_op_FX55(chip8emu* emu, uint8_t x) {
+    C8_BODY_FX55(x);
+    _chip8emu_code_written(emu, emu->I, x + 1);
+    C8_PROFILE_ACCESS(emu->I, x + 1, C8PROF_WRITTEN);
+}
+
+static inline void _chip8emu_op_FX65(chip8emu* emu, uint8_t x) {
+    C8_PROFILE_ACCESS(emu->I, x + 1, C8PROF_DATA);
+    C8_BODY_FX65(x);
+}
+/* ******************** /Instruction semantics ******************** */
+
 /* ******************** Opcode handling implementation ******************** */
 int _chip8emu_opcode_handler_0(chip8emu* emu) {
     switch (emu->opcode) {
     case 0x00E0: /* clear screen */
-        memset(emu->gfx, 0, 64*32);
-        emu->pc += 2;
-        emu->draw(emu);
+        _chip8emu_op_00E0(emu);
         break;
 
     case 0x00EE: /* subroutine return */
-        emu->pc = emu->stack[--emu->sp & 0xF] + 2;
+        _chip8emu_op_00EE(emu);
         break;
 
     default: /* 0NNN: call program at NNN address */
         _chip8emu_log_error(emu, "OpCode 0NNN is not implemented");
-        break;
+        return C8ERR_BAD_OPCODE;
     }
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_1(chip8emu* emu) {
-     /* 1NNN: absolute jump */
-    emu->pc = emu->opcode & 0xFFF;
+    _chip8emu_op_1NNN(emu, C8_NNN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_2(chip8emu* emu) {
-    /* 2NNN: call subroutine */
-    emu->stack[emu->sp] = emu->pc;
-    ++emu->sp;
-    emu->pc = emu->opcode & 0x0FFF;
+    _chip8emu_op_2NNN(emu, C8_NNN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_3(chip8emu* emu) {
-    /* 3XNN: Skips the next instruction if VX equals NN */
-    if (emu->V[(emu->opcode & 0x0F00) >> 8] == (emu->opcode & 0x00FF)) {
-        emu->pc += 4;
-    } else {
-        emu->pc += 2;
-    }
+    _chip8emu_op_3XNN(emu, C8_X(emu->opcode), C8_NN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_4(chip8emu* emu) {
-    /* 4XNN: Skips the next instruction if VX doesn't equal NN */
-    if (emu->V[(emu->opcode & 0x0F00) >> 8] != (emu->opcode & 0x00FF)) {
-        emu->pc += 4;
-    } else {
-        emu->pc += 2;
-    }
+    _chip8emu_op_4XNN(emu, C8_X(emu->opcode), C8_NN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_5(chip8emu* emu) {
-    /* 5XY0: Skips the next instruction if VX equals VY */
-    if (emu->V[(emu->opcode & 0x0F00) >> 8] == emu->V[(emu->opcode & 0x00F0) >> 4]) {
-        emu->pc += 4;
-    } else {
-        emu->pc += 2;
-    }
+    _chip8emu_op_5XY0(emu, C8_X(emu->opcode), C8_Y(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_6(chip8emu* emu) {
-    /* 6XNN: Sets VX to NN */
-    emu->V[(emu->opcode & 0x0F00) >> 8] = (emu->opcode & 0x00FF);
-    emu->pc += 2;
+    _chip8emu_op_6XNN(emu, C8_X(emu->opcode), C8_NN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_7(chip8emu* emu) {
-    /* 7XNN: Adds NN to VX */
-    emu->V[(emu->opcode & 0x0F00) >> 8] += (emu->opcode & 0x00FF);
-    emu->pc += 2;
+    _chip8emu_op_7XNN(emu, C8_X(emu->opcode), C8_NN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_8(chip8emu* emu) {
+    uint8_t x = C8_X(emu->opcode);
+    uint8_t y = C8_Y(emu->opcode);
+
     switch (emu->opcode & 0x000F) {
-    case 0x0000: /* 8XY0: Vx = Vy  */
-        emu->V[(emu->opcode & 0x0F00) >> 8] = emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0001: /* 8XY1: Vx = Vx | Vy */
-        emu->V[(emu->opcode & 0x0F00) >> 8] |= emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0002: /* 8XY2: Vx = Vx & Vy*/
-        emu->V[(emu->opcode & 0x0F00) >> 8] &= emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0003: /* 8XY3: Vx = Vx XOR Vy */
-        emu->V[(emu->opcode & 0x0F00) >> 8] ^= emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0004: /* 8XY4: Vx += Vy; Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't */
-        if(emu->V[(emu->opcode & 0x00F0) >> 4] > (0xFF - emu->V[(emu->opcode & 0x0F00) >> 8]))
-            emu->V[0xF] = 1; /* carry over */
-        else
-            emu->V[0xF] = 0;
-        emu->V[(emu->opcode & 0x0F00) >> 8] += emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0005: /* 8XY5: Vx -= Vy; VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't */
-        if (emu->V[(emu->opcode & 0x00F0) >> 4] > emu->V[(emu->opcode & 0x0F00) >> 8]) {
-            emu->V[0xF] = 0;
-        } else {
-            emu->V[0xF] = 1;
-        }
-        emu->V[(emu->opcode & 0x0F00) >> 8] -= emu->V[(emu->opcode & 0x00F0) >> 4];
-        emu->pc += 2;
-        break;
-    case 0x0006: /* 8XY6: Vx>>=1; Stores the least significant bit of VX in VF and then shifts VX to the right by 1 */
-        emu->V[0xF] = emu->V[(emu->opcode & 0x0F00) >> 8] & 0x1;
-        emu->V[(emu->opcode & 0x0F00) >> 8] >>= 1;
-        emu->pc += 2;
-        break;
-    case 0x0007: /* 8XY7: Vx=Vy-Vx; Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't */
-        if (emu->V[(emu->opcode & 0x0F00) >> 8] > (int)emu->V[(emu->opcode & 0x00F0) >> 4]) {
-            emu->V[0xF] = 0;
-        } else {
-            emu->V[0xF] = 1;
-        }
-        emu->V[(emu->opcode & 0x0F00) >> 8] = emu->V[(emu->opcode & 0x00F0) >> 4] - emu->V[(emu->opcode & 0x0F00) >> 8];
-        emu->pc += 2;
-        break;
-    case 0x000E: /* 8XYE: Vx<<=1; Stores the most significant bit of VX in VF and then shifts VX to the left by 1 */
-        emu->V[0xF] = emu->V[(emu->opcode & 0x0F00) >> 8] >> 7;
-        emu->V[(emu->opcode & 0x0F00) >> 8] <<= 1;
-        emu->pc += 2;
-        break;
+    case 0x0000: _chip8emu_op_8XY0(emu, x, y); break;
+    case 0x0001: _chip8emu_op_8XY1(emu, x, y); break;
+    case 0x0002: _chip8emu_op_8XY2(emu, x, y); break;
+    case 0x0003: _chip8emu_op_8XY3(emu, x, y); break;
+    case 0x0004: _chip8emu_op_8XY4(emu, x, y); break;
+    case 0x0005: _chip8emu_op_8XY5(emu, x, y); break;
+    case 0x0006: _chip8emu_op_8XY6(emu, x); break;
+    case 0x0007: _chip8emu_op_8XY7(emu, x, y); break;
+    case 0x000E: _chip8emu_op_8XYE(emu, x); break;
+    default:
+        _chip8emu_log_error(emu, "Unknown opcode: 0x%X\n", emu->opcode);
+        return C8ERR_BAD_OPCODE;
     }
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_9(chip8emu* emu) {
-    /* 9XY0: Skips the next instruction if VX doesn't equal VY */
-    if(emu->V[(emu->opcode & 0x0F00) >> 8] != emu->V[(emu->opcode & 0x00F0) >> 4]) {
-        emu->pc += 4;
-    } else {
-        emu->pc += 2;
-    }
+    _chip8emu_op_9XY0(emu, C8_X(emu->opcode), C8_Y(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_A(chip8emu* emu) {
-    /* ANNN: Sets I to the address NNN */
-    emu->I = emu->opcode & 0x0FFF;
-    emu->pc += 2;
+    _chip8emu_op_ANNN(emu, C8_NNN(emu->opcode));
     return C8ERR_OK;
 }
+
 int _chip8emu_opcode_handler_B(chip8emu* emu) {
-    /* BNNN: Jumps to the address NNN plus V0 */
-    emu->pc = (emu->opcode & 0x0FFF) + emu->V[0];
+    _chip8emu_op_BNNN(emu, C8_NNN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_C(chip8emu* emu) {
-    /* CXNN: Vx=rand() & NN */
-    emu->V[(emu->opcode & 0x0F00) >> 8] = (emu->rand() % (0xFF + 1)) & (emu->opcode & 0x00FF);
-    emu->pc += 2;
+    _chip8emu_op_CXNN(emu, C8_X(emu->opcode), C8_NN(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_D(chip8emu* emu) {
-    /* DXYN: draw(Vx,Vy,N); draw at X,Y width 8, height N sprite from I register */
-    uint8_t xo = emu->V[(emu->opcode & 0x0F00) >> 8]; /* x origin */
-    uint8_t yo = emu->V[(emu->opcode & 0x00F0) >> 4];
-    uint8_t height = emu->opcode & 0x000F;
-    uint8_t sprite[0x10] = {0};
-
-    memcpy(sprite, emu->memory + (emu->I * sizeof (uint8_t)), height);
-
-    emu->V[0xF] = 0;
-    for (uint8_t y = 0; y < height; y++) {
-        for (uint8_t x = 0; x < 8; x++) {
-            int dx = (xo + x) % 64; /* display x or dest x*/
-            int dy = (yo + y) % 32;
-            if ((sprite[y] & (0x80 >> x)) != 0) { /* 0x80 -> 10000000b */
-                if (!emu->V[0xF] && emu->gfx[(dx + (dy * 64))])
-                    emu->V[0xF] = 1;
-                emu->gfx[dx + (dy * 64)] ^= 1;
-            }
-        }
-    }
-
-    emu->draw(emu);
-    emu->pc += 2;
+    _chip8emu_op_DXYN(emu, C8_X(emu->opcode), C8_Y(emu->opcode), C8_N(emu->opcode));
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_E(chip8emu* emu) {
     switch (emu->opcode & 0x00FF) {
-    case 0x009E: /* EX9E: Skips the next instruction if the key stored in VX is pressed */
-        if(emu->keystate(emu, emu->V[(emu->opcode & 0x0F00) >> 8])) {
-            emu->pc += 4;
-        } else {
-            emu->pc += 2;
-        }
-        break;
-    case 0x00A1: /* EXA1: Skips the next instruction if the key stored in VX isn't pressed */
-        if(!emu->keystate(emu, emu->V[(emu->opcode & 0x0F00) >> 8])) {
-            emu->pc += 4;
-        } else {
-            emu->pc += 2;
-        }
-        break;
+    case 0x009E: _chip8emu_op_EX9E(emu, C8_X(emu->opcode)); break;
+    case 0x00A1: _chip8emu_op_EXA1(emu, C8_X(emu->opcode)); break;
     default:
         _chip8emu_log_error(emu, "Unknown opcode: 0x%X\n", emu->opcode);
+        return C8ERR_BAD_OPCODE;
     }
     return C8ERR_OK;
 }
 
 int _chip8emu_opcode_handler_F(chip8emu* emu) {
+    uint8_t x = C8_X(emu->opcode);
+
     switch (emu->opcode & 0x00FF) {
-    case 0x0007: /* FX07: Sets VX to the value of the delay timer */
-        emu->V[(emu->opcode & 0x0F00) >> 8] = _chip8emu_timer_delay(emu);;
-        emu->pc += 2;
-        break;
-    case 0x000A: /* FX0A: A key press is awaited, and then stored in VX. (blocking) */
-        for (uint8_t i = 0; i < 0x10; i++) {
-            if (emu->keystate(emu, i)) {
-                emu->V[(emu->opcode & 0x0F00) >> 8] = i;
-                emu->pc += 2;
-                break;
-            }
-        }
-        break;
-    case 0x0015: /* FX15: Sets the delay timer to VX */
-        _chip8emu_timer_delay_set(emu, emu->V[(emu->opcode & 0x0F00) >> 8]);
-        emu->pc += 2;
-        break;
-    case 0x0018: /* FX18: Sets the sound timer to VX */
-        _chip8emu_timer_sound_set(emu, emu->V[(emu->opcode & 0x0F00) >> 8]);
-        emu->pc += 2;
-        break;
-    case 0x001E: /* FX1E: Add VX to I register */
-        emu->I += emu->V[(emu->opcode & 0x0F00) >> 8];
-        emu->pc += 2;
-        break;
-    case 0x0029: /* FX29: I=sprite_addr[Vx]; Sets I to the location of the sprite for the character in VX */
-        emu->I = emu->V[(emu->opcode & 0x0F00) >> 8] * 5;
-        emu->pc += 2;
-        break;
-    case 0x0033: /* FX33: Store a Binary Coded Decimal (BCD) of register VX to memory started from I */
-        emu->memory[emu->I]     = emu->V[(emu->opcode & 0x0F00) >> 8] / 100;
-        emu->memory[emu->I + 1] = (emu->V[(emu->opcode & 0x0F00) >> 8] / 10) % 10;
-        emu->memory[emu->I + 2] = emu->V[(emu->opcode & 0x0F00) >> 8] % 10;
-        emu->pc += 2;
-        break;
-    case 0x0055: /* FX55: */
-        for (int i = 0; i <= ((emu->opcode & 0x0F00) >> 8); i++) {
-            emu->memory[emu->I+i] = emu->V[i];
-        }
-        emu->pc += 2;
-        break;
-    case 0x0065: /* FX65: */
-        for (int i = 0; i <= ((emu->opcode & 0x0F00) >> 8); i++) {
-            emu->V[i] = emu->memory[emu->I + i];
-        }
-        emu->pc += 2;
-        break;
+    case 0x0007: _chip8emu_op_FX07(emu, x); break;
+    case 0x000A: _chip8emu_op_FX0A(emu, x); break;
+    case 0x0015: _chip8emu_op_FX15(emu, x); break;
+    case 0x0018: _chip8emu_op_FX18(emu, x); break;
+    case 0x001E: _chip8emu_op_FX1E(emu, x); break;
+    case 0x0029: _chip8emu_op_FX29(emu, x); break;
+    case 0x0033: _chip8emu_op_FX33(emu, x); break;
+    case 0x0055: _chip8emu_op_FX55(emu, x); break;
+    case 0x0065: _chip8emu_op_FX65(emu, x); break;
     default:
         _chip8emu_log_error(emu, "Unknown opcode: 0x%X\n", emu->opcode);
+        return C8ERR_BAD_OPCODE;
     }
     return C8ERR_OK;
 }
 /* ******************** /Opcode handling implementation ******************** */
 
-void chip8emu_exec_cycle(chip8emu *emu)
+#if defined(CHIP8EMU_THREADED_DISPATCH) || defined(CHIP8EMU_OPSTATS)
+static uint8_t _chip8emu_decode(uint16_t opcode)
 {
-    emu->opcode = (uint16_t) (emu->memory[emu->pc] << 8 | emu->memory[emu->pc + 1]);
-
-    emu->opcode_handlers[(emu->opcode & 0xF000) >> 12](emu);
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0) return C8I_00E0;
+        if (opcode == 0x00EE) return C8I_00EE;
+        return C8I_INVALID; /* 0NNN */
+    case 0x1: return C8I_1NNN;
+    case 0x2: return C8I_2NNN;
+    case 0x3: return C8I_3XNN;
+    case 0x4: return C8I_4XNN;
+    case 0x5: return C8I_5XY0;
+    case 0x6: return C8I_6XNN;
+    case 0x7: return C8I_7XNN;
+    case 0x8:
+        switch (opcode & 0x000F) {
+        case 0x0: return C8I_8XY0;
+        case 0x1: return C8I_8XY1;
+        case 0x2: return C8I_8XY2;
+        case 0x3: return C8I_8XY3;
+        case 0x4: return C8I_8XY4;
+        case 0x5: return C8I_8XY5;
+        case 0x6: return C8I_8XY6;
+        case 0x7: return C8I_8XY7;
+        case 0xE: return C8I_8XYE;
+        }
+        return C8I_INVALID;
+    case 0x9: return C8I_9XY0;
+    case 0xA: return C8I_ANNN;
+    case 0xB: return C8I_BNNN;
+    case 0xC: return C8I_CXNN;
+    case 0xD: return C8I_DXYN;
+    case 0xE:
+        if ((opcode & 0x00FF) == 0x009E) return C8I_EX9E;
+        if ((opcode & 0x00FF) == 0x00A1) return C8I_EXA1;
+        return C8I_INVALID;
+    default:
+        switch (opcode & 0x00FF) {
+        case 0x07: return C8I_FX07;
+        case 0x0A: return C8I_FX0A;
+        case 0x15: return C8I_FX15;
+        case 0x18: return C8I_FX18;
+        case 0x1E: return C8I_FX1E;
+        case 0x29: return C8I_FX29;
+        case 0x33: return C8I_FX33;
+        case 0x55: return C8I_FX55;
+        case 0x65: return C8I_FX65;
+        }
+        return C8I_INVALID;
+    }
 }
-
-
-int chip8emu_load_code(chip8emu *emu, uint8_t *code, long code_size)
+#endif /* CHIP8EMU_THREADED_DISPATCH || CHIP8EMU_OPSTATS */
+
+#ifdef CHIP8EMU_OPSTATS
+/* ******************** Opcode statistics ******************** */
+/*
+ * Every executed instruction is counted; one in C8_OPSTATS_PERIOD is timed
+ * with the timestamp counter, minus the cost of reading it. The instructions
+ * of a superinstruction share its time evenly. JIT regions are not translated
+ * in these builds so that every instruction is seen.
+ */
+#define C8_OPSTATS_PERIOD   64
+
+typedef struct {
+    uint32_t countdown;     /* instructions until the next timed one */
+    uint64_t overhead;      /* ticks of two back to back counter reads */
+    chip8emu_opstat ops[C8OP_COUNT];
+} _chip8emu_opstats;
+
+static void* _chip8emu_opstats_new(void)
 {
-    for(int i = 0; i < code_size; ++i)
-      emu->memory[i + 512] = code[i];
-    return C8ERR_OK;
+    _chip8emu_opstats *stats = calloc(1, sizeof (_chip8emu_opstats));
+    stats->countdown = C8_OPSTATS_PERIOD;
+    stats->overhead = UINT64_MAX;
+    for (int k = 0; k < 64; ++k) {
+        uint64_t t0 = _chip8emu_tsc();
+        uint64_t t1 = _chip8emu_tsc();
+        if (t1 - t0 < stats->overhead)
+            stats->overhead = t1 - t0;
+    }
+    return stats;
 }
 
+/* returns the start time if this instruction is timed, 0 otherwise */
+static inline uint64_t _chip8emu_opstats_begin(chip8emu *emu)
+{
+    _chip8emu_opstats *stats = (_chip8emu_opstats*) emu->_opstats;
+    if (--stats->countdown)
+        return 0;
+    stats->countdown = C8_OPSTATS_PERIOD;
+    return _chip8emu_tsc();
+}
 
-int chip8emu_load_rom(chip8emu *emu, const char *filename)
+/* counts ops[0..count), sharing the time since t0 if it was timed */
+static void _chip8emu_opstats_end(chip8emu *emu, const uint8_t *ops, int count, uint64_t t0)
 {
-    uint16_t filelen = 0;
-    FILE *f = fopen(filename, "r");
+    _chip8emu_opstats *stats = (_chip8emu_opstats*) emu->_opstats;
+    uint64_t ticks = 0;
 
-    if (f == NULL) {
-        _chip8emu_log_error(emu, "file %s does not exist\n", filename);
-        return 1;
+    if (t0) {
+        ticks = _chip8emu_tsc() - t0;
+        ticks = ticks > stats->overhead ? (ticks - stats->overhead) / count : 0;
     }
-    uint8_t c;
-    while (fread(&c, 1, 1, f) != 0) {
-        emu->memory[filelen + 512] = c;
-        filelen++;
+    for (int k = 0; k < count; ++k) {
+        chip8emu_opstat *op = &stats->ops[ops[k]];
+        op->count++;
+        if (t0) {
+            int bucket = 0;
+            while (bucket < C8OPSTAT_BUCKETS - 1 && ticks >> (bucket + 1))
+                bucket++;
+            op->samples++;
+            op->ticks += ticks;
+            op->histogram[bucket]++;
+        }
     }
-    fclose(f);
-
-    return C8ERR_OK;
 }
 
-void chip8emu_timer_tick(chip8emu *emu)
+static uint8_t _chip8emu_opstats_op(uint16_t opcode)
 {
-    if(emu->delay_timer > 0)
-        --emu->delay_timer;
-
-    if(emu->sound_timer > 0) {
-        if(emu->sound_timer == 1)
-            emu->beep(emu);
-        --emu->sound_timer;
-    }
+    uint8_t cls = _chip8emu_decode(opcode);
+    return cls == C8I_INVALID ? C8OP_0NNN : (uint8_t) (cls - C8I_00E0); /* same order */
 }
 
-#ifndef CHIP8EMU_NO_THREAD
-
-static int chip8emu_thread_clk_timers(void *arg) {
-    chip8emu * emu = (chip8emu*) arg;
-    while (true) {
-        mtx_lock(emu->mtx_pause);
-        if (emu->paused)
-            cnd_wait(emu->cnd_resume_timers, emu->mtx_pause);
-        mtx_unlock(emu->mtx_pause);
+static void _chip8emu_opstats_opcode(chip8emu *emu, uint16_t opcode, uint64_t t0)
+{
+    uint8_t op = _chip8emu_opstats_op(opcode);
+    _chip8emu_opstats_end(emu, &op, 1, t0);
+}
 
-        cnd_signal(emu->cnd_clk_timers);
+#define C8_OPSTATS_BEGIN(t0)            uint64_t t0 = _chip8emu_opstats_begin(emu)
+#define C8_OPSTATS_OPCODE(t0, opcode)   _chip8emu_opstats_opcode(emu, opcode, t0)
+/* ******************** /Opcode statistics ******************** */
+#else
+#define C8_OPSTATS_BEGIN(t0)            ((void) 0)
+#define C8_OPSTATS_OPCODE(t0, opcode)   ((void) 0)
+#endif /* CHIP8EMU_OPSTATS */
 
-        thrd_sleep(emu->_timer_clk_delay, 0);
+void chip8emu_exec_cycle(chip8emu *emu)
+{
+    emu->opcode = (uint16_t) (emu->memory[emu->pc & 0xFFF] << 8 | emu->memory[(emu->pc + 1) & 0xFFF]);
+
+    C8_OPSTATS_BEGIN(stats_t0);
+    C8_EXEC_PC(exec_pc);
+    if (emu->opcode_handlers[(emu->opcode & 0xF000) >> 12](emu) == C8ERR_OK) {
+        emu->cycles++;
+        C8_OPSTATS_OPCODE(stats_t0, emu->opcode);
+        C8_PROFILE_EXEC(exec_pc);
+        C8_TRACE_EXEC(exec_pc);
+    } else {
+        C8_TRACE_FAULT();
     }
-    return C8ERR_OK;
 }
 
-static int chip8emu_thread_clk_cpu(void *arg) {
-    chip8emu * emu = (chip8emu*) arg;
-    while (true) {
-        mtx_lock(emu->mtx_pause);
-        if (emu->paused)
-            cnd_wait(emu->cnd_resume_cpu, emu->mtx_pause);
-        mtx_unlock(emu->mtx_pause);
-
-        mtx_lock(emu->mtx_cpu);
-        cnd_signal(emu->cnd_clk_cpu);
-        mtx_unlock(emu->mtx_cpu);
+#ifdef CHIP8EMU_THREADED_DISPATCH
+/* ******************** Threaded dispatch engine ******************** */
+/*
+ * Every address is decoded once, on first execution, into an entry holding the
+ * instruction class and its operands. Entries are dispatched with computed goto
+ * (GCC/Clang) or a flat switch. Nibbles whose handler was overridden by the
+ * library user are decoded as C8I_INVALID and go through opcode_handlers.
+ * Writes to memory must go through _chip8emu_code_written() to drop stale entries.
+ */
+
+/*
+ * Superinstructions: frequent sequences are matched when their first address
+ * is decoded and run with one dispatch. Operands of the following
+ * instructions go to fields the first one doesn't use:
+ * LOAD_SKIP: nnn = skip opcode; DELAY_LOOP: nn = 3XNN operand;
+ * SPRITE: x, y, nn = DXYN operands.
+ */
+static void _chip8emu_fuse(chip8emu *emu, _chip8emu_decoded *entry, uint16_t overridden)
+{
+    uint16_t pc = emu->pc;
+    if (pc + 3 >= 4096)
+        return;
+
+    uint16_t next = (uint16_t) (emu->memory[pc + 2] << 8 | emu->memory[pc + 3]);
+    if (overridden & (1 << (next >> 12)))
+        return;
+
+    switch (entry->cls) {
+    case C8I_6XNN:
+        if (next >> 12 == 0x3 || next >> 12 == 0x4 || next >> 12 == 0x5 || next >> 12 == 0x9) {
+            entry->cls = C8I_F_LOAD_SKIP;
+            entry->nnn = next;
+        }
+        break;
+    case C8I_ANNN:
+        if (next >> 12 == 0xD) {
+            entry->cls = C8I_F_SPRITE;
+            entry->x = C8_X(next);
+            entry->y = C8_Y(next);
+            entry->nn = C8_N(next);
+        }
+        break;
+    case C8I_FX07:
+        if (pc + 5 < 4096 && (next & 0xFF00) == (0x3000 | entry->x << 8) && !(overridden & (1 << 0x1))
+            && (emu->memory[pc + 4] << 8 | emu->memory[pc + 5]) == (0x1000 | pc)) {
+            entry->cls = C8I_F_DELAY_LOOP;
+            entry->nn = C8_NN(next);
+        }
+        break;
+    }
+}
+
+static void _chip8emu_decode_fill(chip8emu *emu, _chip8emu_decoded *entry, uint16_t overridden)
+{
+    uint16_t opcode = (uint16_t) (emu->memory[emu->pc & 0xFFF] << 8 | emu->memory[(emu->pc + 1) & 0xFFF]);
+
+    entry->opcode = opcode;
+    entry->nnn = C8_NNN(opcode);
+    entry->x = C8_X(opcode);
+    entry->y = C8_Y(opcode);
+    entry->nn = C8_NN(opcode);
+    entry->cls = overridden & (1 << (opcode >> 12)) ? C8I_INVALID : _chip8emu_decode(opcode);
+    emu->opcode = opcode;
+    _chip8emu_fuse(emu, entry, overridden);
+}
+
+static void _chip8emu_code_written(chip8emu *emu, uint32_t addr, uint32_t len)
+{
+    _chip8emu_decode_cache *cache = (_chip8emu_decode_cache*) emu->_decode_cache;
+    /* superinstructions starting up to 5 bytes before addr overlap it too */
+    uint32_t start = addr > 5 ? addr - 5 : 0;
+    uint32_t end = addr + len > 4096 ? 4096 : addr + len;
+
+    if (start < end)
+        memset(&cache->entries[start], 0, (end - start) * sizeof (_chip8emu_decoded));
+#ifdef CHIP8EMU_JIT
+    if (emu->_jit)
+        _chip8emu_jit_invalidate((_chip8emu_jit*) emu->_jit, addr, len);
+#endif /* CHIP8EMU_JIT */
+    /* FX33 and FX55 writes wrap around at 4 KB */
+    if (addr < 4096 && addr + len > 4096)
+        _chip8emu_code_written(emu, 0, addr + len - 4096);
+}
+
+#ifdef CHIP8EMU_OPSTATS
+/* counts the first count instructions of an executed entry of class cls */
+static void _chip8emu_opstats_entry(chip8emu *emu, uint8_t cls, uint16_t opcode,
+                                    const _chip8emu_decoded *entry, int count, uint64_t t0)
+{
+    uint8_t ops[3];
+
+    switch (cls) {
+    case C8I_INVALID:
+        ops[0] = _chip8emu_opstats_op(opcode);
+        break;
+    case C8I_F_LOAD_SKIP:
+        ops[0] = C8OP_6XNN;
+        ops[1] = _chip8emu_opstats_op(entry->nnn);
+        break;
+    case C8I_F_DELAY_LOOP:
+        ops[0] = C8OP_FX07;
+        ops[1] = C8OP_3XNN;
+        ops[2] = C8OP_1NNN;
+        break;
+    case C8I_F_SPRITE:
+        ops[0] = C8OP_ANNN;
+        ops[1] = C8OP_DXYN;
+        break;
+    default:
+        ops[0] = (uint8_t) (cls - C8I_00E0);
+        break;
+    }
+    _chip8emu_opstats_end(emu, ops, count, t0);
+}
+#endif /* CHIP8EMU_OPSTATS */
+
+#if defined(__GNUC__)
+#define C8_COMPUTED_GOTO
+#endif
+
+/* run up to n instructions, stop after any instruction raising stop_flags */
+static long _chip8emu_run(chip8emu *emu, long n, uint8_t stop_flags)
+{
+    long i = 0;
+    uint16_t overridden = 0;
+    _chip8emu_decode_cache *cache = (_chip8emu_decode_cache*) emu->_decode_cache;
+    _chip8emu_decoded *entry;
+    _chip8emu_decoded spill; /* pc out of the cached range */
+#ifdef CHIP8EMU_OPSTATS
+    uint64_t stats_t0 = 0;
+    uint8_t stats_cls = C8I_UNDECODED;
+    uint16_t stats_opcode = 0;
+#endif /* CHIP8EMU_OPSTATS */
+#if defined(CHIP8EMU_PROFILE) || defined(CHIP8EMU_TRACE)
+    uint16_t stats_pc = 0;
+#endif
+#ifdef CHIP8EMU_TRACE
+    /* ring position kept in locals, stored back on the way out */
+    _chip8emu_trace *trace = (_chip8emu_trace*) emu->_trace;
+    uint64_t *trace_ring = trace ? trace->ring : NULL;
+    uint64_t trace_mask = trace ? trace->mask : 0;
+    uint64_t trace_written = trace ? trace->written : 0;
+#endif /* CHIP8EMU_TRACE */
+#if defined(CHIP8EMU_OPSTATS) || defined(CHIP8EMU_PROFILE) || defined(CHIP8EMU_TRACE)
+    int stats_count = 1;    /* instructions run by the current entry */
+#endif
+
+    overridden = _chip8emu_overridden_handlers(emu);
+    if (cache->overridden != overridden) {
+        memset(cache->entries, 0, sizeof cache->entries);
+        cache->overridden = overridden;
+    }
+#ifdef CHIP8EMU_JIT
+    _chip8emu_jit *jit = (_chip8emu_jit*) emu->_jit;
+    if (jit && jit->overridden != overridden)
+        _chip8emu_jit_flush(jit, overridden);
+#endif /* CHIP8EMU_JIT */
+
+    emu->_run_flags = 0;
+    if (n <= 0)
+        return 0;
+
+
+#define C8_FETCH() do { \
+        if (emu->pc < 4095) { \
+            entry = &cache->entries[emu->pc]; \
+            emu->opcode = entry->opcode; \
+        } else { \
+            entry = &spill; \
+            _chip8emu_decode_fill(emu, entry, overridden); \
+        } \
+    } while (0)
+
+/* first instruction of a superinstruction or block that doesn't fit in the budget */
+#define C8_INTERPRET_ONE() do { \
+        emu->opcode_handlers[entry->opcode >> 12](emu); \
+        C8_NEXT(); \
+    } while (0)
+#define C8_NEXT_FUSED(kind, count) do { \
+        cache->fused[C8FUSE_##kind]++; \
+        C8_STATS_FUSED(count); \
+        C8_TRACE_FUSED(count); \
+        emu->cycles += (count) - 1; \
+        i += (count) - 1; \
+        C8_NEXT(); \
+    } while (0)
+
+#ifdef CHIP8EMU_OPSTATS
+/* the class is kept aside, FX55 may clear the entry it runs from */
+#define C8_STATS_OPSTATS_BEGIN() do { \
+        stats_t0 = _chip8emu_opstats_begin(emu); \
+        stats_cls = entry->cls; \
+        stats_opcode = entry->opcode; \
+    } while (0)
+#define C8_STATS_DECODED()      (stats_cls = entry->cls)
+#define C8_STATS_OPSTATS_END()  _chip8emu_opstats_entry(emu, stats_cls, stats_opcode, entry, stats_count, stats_t0)
+#else
+#define C8_STATS_OPSTATS_BEGIN() ((void) 0)
+#define C8_STATS_DECODED()      ((void) 0)
+#define C8_STATS_OPSTATS_END()  ((void) 0)
+#endif /* CHIP8EMU_OPSTATS */
+#if defined(CHIP8EMU_PROFILE) || defined(CHIP8EMU_TRACE)
+#define C8_STATS_PC_BEGIN()     (stats_pc = emu->pc)
+#else
+#define C8_STATS_PC_BEGIN()     ((void) 0)
+#endif
+#ifdef CHIP8EMU_PROFILE
+#define C8_STATS_PROFILE_END()  _chip8emu_profile_exec(emu, stats_pc, stats_count)
+#else
+#define C8_STATS_PROFILE_END()  ((void) 0)
+#endif /* CHIP8EMU_PROFILE */
+#ifdef CHIP8EMU_TRACE
+/* while tracing, JIT regions and the sprite superinstruction (its ANNN would show the VF of DXYN) run one instruction at a time */
+#define C8_TRACING()            (trace_ring != NULL)
+#define C8_TRACE_FUSED(count) do { \
+        if (trace_ring) { \
+            trace->written = trace_written; \
+            _chip8emu_trace_fused(emu, trace, stats_pc, (count) - 1); \
+            trace_written = trace->written; \
+        } \
+    } while (0)
+/* emu->opcode is the last instruction of the entry */
+#define C8_STATS_TRACE_END() do { \
+        if (trace_ring) \
+            trace_ring[trace_written++ & trace_mask] = _chip8emu_trace_record(emu, \
+                (uint16_t) (stats_pc + 2 * (stats_count - 1)), emu->opcode); \
+    } while (0)
+#define C8_STATS_TRACE_SYNC()   (trace ? (void) (trace->written = trace_written) : (void) 0)
+#else
+#define C8_TRACING()            false
+#define C8_TRACE_FUSED(count)   ((void) 0)
+#define C8_STATS_TRACE_END()    ((void) 0)
+#define C8_STATS_TRACE_SYNC()   ((void) 0)
+#endif /* CHIP8EMU_TRACE */
+#if defined(CHIP8EMU_OPSTATS) || defined(CHIP8EMU_PROFILE) || defined(CHIP8EMU_TRACE)
+#define C8_STATS_BEGIN() do { \
+        C8_STATS_OPSTATS_BEGIN(); \
+        C8_STATS_PC_BEGIN(); \
+    } while (0)
+#define C8_STATS_FUSED(count)   (stats_count = (count))
+#define C8_STATS_END() do { \
+        C8_STATS_OPSTATS_END(); \
+        C8_STATS_PROFILE_END(); \
+        C8_STATS_TRACE_END(); \
+        stats_count = 1; \
+    } while (0)
+#else
+#define C8_STATS_BEGIN()        ((void) 0)
+#define C8_STATS_FUSED(count)   ((void) 0)
+#define C8_STATS_END()          ((void) 0)
+#endif /* CHIP8EMU_OPSTATS || CHIP8EMU_PROFILE || CHIP8EMU_TRACE */
+
+#ifdef C8_COMPUTED_GOTO
+#define C8_LABEL(name) [C8I_##name] = &&op_##name
+    static void * const dispatch_table[C8I_COUNT] = {
+        C8_LABEL(UNDECODED), C8_LABEL(INVALID),
+        C8_LABEL(00E0), C8_LABEL(00EE), C8_LABEL(1NNN), C8_LABEL(2NNN),
+        C8_LABEL(3XNN), C8_LABEL(4XNN), C8_LABEL(5XY0), C8_LABEL(6XNN),
+        C8_LABEL(7XNN), C8_LABEL(8XY0), C8_LABEL(8XY1), C8_LABEL(8XY2),
+        C8_LABEL(8XY3), C8_LABEL(8XY4), C8_LABEL(8XY5), C8_LABEL(8XY6),
+        C8_LABEL(8XY7), C8_LABEL(8XYE), C8_LABEL(9XY0), C8_LABEL(ANNN),
+        C8_LABEL(BNNN), C8_LABEL(CXNN), C8_LABEL(DXYN), C8_LABEL(EX9E),
+        C8_LABEL(EXA1), C8_LABEL(FX07), C8_LABEL(FX0A), C8_LABEL(FX15),
+        C8_LABEL(FX18), C8_LABEL(FX1E), C8_LABEL(FX29), C8_LABEL(FX33),
+        C8_LABEL(FX55), C8_LABEL(FX65),
+        C8_LABEL(F_LOAD_SKIP), C8_LABEL(F_DELAY_LOOP), C8_LABEL(F_SPRITE),
+#ifdef CHIP8EMU_JIT
+        C8_LABEL(JIT)
+#endif /* CHIP8EMU_JIT */
+    };
+#define C8_CASE(name)   op_##name
+#define C8_DISPATCH() do { \
+        C8_FETCH(); \
+        C8_STATS_BEGIN(); \
+        goto *dispatch_table[entry->cls]; \
+    } while (0)
+#define C8_REDISPATCH() do { \
+        C8_STATS_DECODED(); \
+        goto *dispatch_table[entry->cls]; \
+    } while (0)
+#define C8_NEXT() do { \
+        emu->cycles++; \
+        C8_STATS_END(); \
+        if (++i >= n || (emu->_run_flags & stop_flags)) \
+            goto out; \
+        C8_DISPATCH(); \
+    } while (0)
+
+    C8_DISPATCH();
+#else
+#define C8_CASE(name)   case C8I_##name
+#define C8_NEXT()       goto next
+#define C8_REDISPATCH() continue
+
+    for (;;) {
+        C8_FETCH();
+        C8_STATS_BEGIN();
+        switch (entry->cls) {
+#endif /* C8_COMPUTED_GOTO */
+
+    C8_CASE(UNDECODED):
+        _chip8emu_decode_fill(emu, entry, overridden);
+#if defined(CHIP8EMU_JIT) && !defined(CHIP8EMU_OPSTATS) && !defined(CHIP8EMU_PROFILE)
+        if (jit && entry != &spill && _chip8emu_jit_compile(jit, emu, emu->pc))
+            entry->cls = C8I_JIT;
+#endif /* CHIP8EMU_JIT */
+        C8_REDISPATCH();
+    C8_CASE(INVALID): /* unknown opcodes and overridden handlers */
+        if (emu->opcode_handlers[entry->opcode >> 12](emu) != C8ERR_OK) {
+            emu->_run_flags |= C8_RUNF_FAULT;
+            C8_STATS_TRACE_SYNC();
+            C8_TRACE_FAULT();
+            goto out;
+        }
+        C8_NEXT();
+    C8_CASE(00E0): _chip8emu_op_00E0(emu); C8_NEXT();
+    C8_CASE(00EE): _chip8emu_op_00EE(emu); C8_NEXT();
+    C8_CASE(1NNN): _chip8emu_op_1NNN(emu, entry->nnn); C8_NEXT();
+    C8_CASE(2NNN): _chip8emu_op_2NNN(emu, entry->nnn); C8_NEXT();
+    C8_CASE(3XNN): _chip8emu_op_3XNN(emu, entry->x, entry->nn); C8_NEXT();
+    C8_CASE(4XNN): _chip8emu_op_4XNN(emu, entry->x, entry->nn); C8_NEXT();
+    C8_CASE(5XY0): _chip8emu_op_5XY0(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(6XNN): _chip8emu_op_6XNN(emu, entry->x, entry->nn); C8_NEXT();
+    C8_CASE(7XNN): _chip8emu_op_7XNN(emu, entry->x, entry->nn); C8_NEXT();
+    C8_CASE(8XY0): _chip8emu_op_8XY0(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY1): _chip8emu_op_8XY1(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY2): _chip8emu_op_8XY2(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY3): _chip8emu_op_8XY3(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY4): _chip8emu_op_8XY4(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY5): _chip8emu_op_8XY5(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XY6): _chip8emu_op_8XY6(emu, entry->x); C8_NEXT();
+    C8_CASE(8XY7): _chip8emu_op_8XY7(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(8XYE): _chip8emu_op_8XYE(emu, entry->x); C8_NEXT();
+    C8_CASE(9XY0): _chip8emu_op_9XY0(emu, entry->x, entry->y); C8_NEXT();
+    C8_CASE(ANNN): _chip8emu_op_ANNN(emu, entry->nnn); C8_NEXT();
+    C8_CASE(BNNN): _chip8emu_op_BNNN(emu, entry->nnn); C8_NEXT();
+    C8_CASE(CXNN): _chip8emu_op_CXNN(emu, entry->x, entry->nn); C8_NEXT();
+    C8_CASE(DXYN): _chip8emu_op_DXYN(emu, entry->x, entry->y, entry->nn & 0xF); C8_NEXT();
+    C8_CASE(EX9E): _chip8emu_op_EX9E(emu, entry->x); C8_NEXT();
+    C8_CASE(EXA1): _chip8emu_op_EXA1(emu, entry->x); C8_NEXT();
+    C8_CASE(FX07): _chip8emu_op_FX07(emu, entry->x); C8_NEXT();
+    C8_CASE(FX0A): _chip8emu_op_FX0A(emu, entry->x); C8_NEXT();
+    C8_CASE(FX15): _chip8emu_op_FX15(emu, entry->x); C8_NEXT();
+    C8_CASE(FX18): _chip8emu_op_FX18(emu, entry->x); C8_NEXT();
+    C8_CASE(FX1E): _chip8emu_op_FX1E(emu, entry->x); C8_NEXT();
+    C8_CASE(FX29): _chip8emu_op_FX29(emu, entry->x); C8_NEXT();
+    C8_CASE(FX33): _chip8emu_op_FX33(emu, entry->x); C8_NEXT();
+    C8_CASE(FX55): _chip8emu_op_FX55(emu, entry->x); C8_NEXT();
+    C8_CASE(FX65): _chip8emu_op_FX65(emu, entry->x); C8_NEXT();
+
+    C8_CASE(F_LOAD_SKIP):
+        if (n - i < 2)
+            C8_INTERPRET_ONE();
+        _chip8emu_op_6XNN(emu, entry->x, entry->nn);
+        emu->opcode = entry->nnn;
+        switch (entry->nnn >> 12) {
+        case 0x3: _chip8emu_op_3XNN(emu, C8_X(entry->nnn), C8_NN(entry->nnn)); break;
+        case 0x4: _chip8emu_op_4XNN(emu, C8_X(entry->nnn), C8_NN(entry->nnn)); break;
+        case 0x5: _chip8emu_op_5XY0(emu, C8_X(entry->nnn), C8_Y(entry->nnn)); break;
+        default:  _chip8emu_op_9XY0(emu, C8_X(entry->nnn), C8_Y(entry->nnn)); break;
+        }
+        C8_NEXT_FUSED(LOAD_SKIP, 2);
+    C8_CASE(F_DELAY_LOOP):
+        if (n - i < 3)
+            C8_INTERPRET_ONE();
+        _chip8emu_op_FX07(emu, entry->x);
+        if (emu->V[entry->x] == entry->nn) {
+            /* 3XNN skips the jump */
+            emu->opcode = (uint16_t) (0x3000 | entry->x << 8 | entry->nn);
+            emu->pc += 4;
+            C8_NEXT_FUSED(DELAY_LOOP, 2);
+        }
+        emu->pc -= 2;
+        emu->opcode = (uint16_t) (0x1000 | emu->pc);
+        emu->_idle_period = 3;
+        emu->_run_flags |= C8_RUNF_IDLE;
+        C8_NEXT_FUSED(DELAY_LOOP, 3);
+    C8_CASE(F_SPRITE):
+        if (n - i < 2 || C8_TRACING())
+            C8_INTERPRET_ONE();
+        _chip8emu_op_ANNN(emu, entry->nnn);
+        emu->opcode = (uint16_t) (0xD000 | entry->x << 8 | entry->y << 4 | entry->nn);
+        _chip8emu_op_DXYN(emu, entry->x, entry->y, entry->nn);
+        C8_NEXT_FUSED(SPRITE, 2);
+#ifdef CHIP8EMU_JIT
+    C8_CASE(JIT): {
+        _chip8emu_jit_block *block = jit->blocks[emu->pc];
+        if (!block) {
+            /* invalidated, decode and translate again */
+            entry->cls = C8I_UNDECODED;
+            C8_REDISPATCH();
+        }
+        if (C8_TRACING())
+            C8_INTERPRET_ONE();
+        /* 0: one pass of the region doesn't fit in the budget */
+        uint32_t done = block->fn(emu, n - i < INT32_MAX ? (uint32_t) (n - i) : INT32_MAX);
+        if (!done)
+            C8_INTERPRET_ONE();
+        emu->cycles += done - 1u;
+        i += done - 1;
+        C8_NEXT();
+    }
+#endif /* CHIP8EMU_JIT */
+
+#ifndef C8_COMPUTED_GOTO
+        }
+next:
+        emu->cycles++;
+        C8_STATS_END();
+        if (++i >= n || (emu->_run_flags & stop_flags))
+            break;
+    }
+#endif /* C8_COMPUTED_GOTO */
+
+out:
+    C8_STATS_TRACE_SYNC();
+    return i;
+
+#undef C8_FETCH
+#undef C8_INTERPRET_ONE
+#undef C8_NEXT_FUSED
+#undef C8_STATS_OPSTATS_BEGIN
+#undef C8_STATS_OPSTATS_END
+#undef C8_STATS_PC_BEGIN
+#undef C8_STATS_PROFILE_END
+#undef C8_TRACING
+#undef C8_TRACE_FUSED
+#undef C8_STATS_TRACE_END
+#undef C8_STATS_TRACE_SYNC
+#undef C8_STATS_BEGIN
+#undef C8_STATS_DECODED
+#undef C8_STATS_FUSED
+#undef C8_STATS_END
+#undef C8_CASE
+#undef C8_NEXT
+#undef C8_REDISPATCH
+#ifdef C8_COMPUTED_GOTO
+#undef C8_LABEL
+#undef C8_DISPATCH
+#endif /* C8_COMPUTED_GOTO */
+}
+/* ******************** /Threaded dispatch engine ******************** */
+#else
+/* run up to n instructions, stop after any instruction raising stop_flags */
+static long _chip8emu_run(chip8emu *emu, long n, uint8_t stop_flags)
+{
+    long i;
+
+    emu->_run_flags = 0;
+    for (i = 0; i < n; ++i) {
+        emu->opcode = (uint16_t) (emu->memory[emu->pc & 0xFFF] << 8 | emu->memory[(emu->pc + 1) & 0xFFF]);
+        C8_OPSTATS_BEGIN(stats_t0);
+        C8_EXEC_PC(exec_pc);
+        if (emu->opcode_handlers[(emu->opcode & 0xF000) >> 12](emu) != C8ERR_OK) {
+            emu->_run_flags |= C8_RUNF_FAULT;
+            C8_TRACE_FAULT();
+            break;
+        }
+        emu->cycles++;
+        C8_OPSTATS_OPCODE(stats_t0, emu->opcode);
+        C8_PROFILE_EXEC(exec_pc);
+        C8_TRACE_EXEC(exec_pc);
+        if (emu->_run_flags & stop_flags) {
+            ++i;
+            break;
+        }
+    }
+    return i;
+}
+#endif /* CHIP8EMU_THREADED_DISPATCH */
+
+long chip8emu_run_cycles(chip8emu *emu, long n)
+{
+    return _chip8emu_run(emu, n, 0);
+}
+
+int chip8emu_run_frame(chip8emu *emu, long cycles_per_frame)
+{
+    int ret = C8RUN_FRAME_DONE;
+    long left;
+
+    while ((left = cycles_per_frame - emu->_frame_cycles) > 0) {
+        emu->_frame_cycles += _chip8emu_run(emu, left,
+                                            C8_RUNF_DRAW | C8_RUNF_KEY_WAIT | C8_RUNF_IDLE | C8_RUNF_VBLANK_WAIT);
+        if (emu->_run_flags & C8_RUNF_FAULT)
+            return C8RUN_FAULT;
+        if (emu->_run_flags & C8_RUNF_KEY_WAIT) {
+            /* the rest of the frame would only poll the same keys again */
+            left = cycles_per_frame - emu->_frame_cycles;
+            emu->cycles += left;
+            emu->idle_cycles += left;
+            ret = C8RUN_KEY_WAIT;
+            break;
+        }
+        if (emu->_run_flags & C8_RUNF_VBLANK_WAIT) {
+            /* DXYN waits for vblank: the rest of the frame is spent waiting */
+            left = cycles_per_frame - emu->_frame_cycles;
+            emu->cycles += left;
+            emu->idle_cycles += left;
+            emu->_frame_cycles = cycles_per_frame;
+        }
+        if (emu->_run_flags & C8_RUNF_DRAW)
+            return C8RUN_DRAW;
+        if (emu->_run_flags & C8_RUNF_IDLE) {
+            /* skip whole loop iterations, the remainder runs normally */
+            left = cycles_per_frame - emu->_frame_cycles;
+            left -= left % emu->_idle_period;
+            emu->cycles += left;
+            emu->idle_cycles += left;
+            emu->_frame_cycles += left;
+        }
+    }
+
+    emu->_frame_cycles = 0;
+    chip8emu_timer_tick(emu);
+    return ret;
+}
+
+uint8_t* chip8emu_gfx(chip8emu *emu)
+{
+    if (emu->_gfx_stale) {
+        _chip8emu_unpack_display(emu->display, emu->gfx);
+        emu->_gfx_stale = false;
+    }
+    return emu->gfx;
+}
+
+double chip8emu_get_idle_ratio(chip8emu *emu)
+{
+    return emu->cycles ? (double) emu->idle_cycles / (double) emu->cycles : 0;
+}
+
+void chip8emu_invalidate_code(chip8emu *emu, uint16_t addr, uint16_t len)
+{
+    _chip8emu_code_written(emu, addr, len);
+}
+
+void chip8emu_get_fusion_stats(chip8emu *emu, uint64_t counts[C8FUSE_COUNT])
+{
+    for (int k = 0; k < C8FUSE_COUNT; ++k) {
+#ifdef CHIP8EMU_THREADED_DISPATCH
+        counts[k] = ((_chip8emu_decode_cache*) emu->_decode_cache)->fused[k];
+#else
+        counts[k] = 0;
+        (void) emu;
+#endif /* CHIP8EMU_THREADED_DISPATCH */
+    }
+}
+
+bool chip8emu_get_opcode_stats(chip8emu *emu, chip8emu_opstat stats[C8OP_COUNT])
+{
+#ifdef CHIP8EMU_OPSTATS
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    memcpy(stats, ((_chip8emu_opstats*) emu->_opstats)->ops, C8OP_COUNT * sizeof (chip8emu_opstat));
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    return true;
+#else
+    (void) emu;
+    memset(stats, 0, C8OP_COUNT * sizeof (chip8emu_opstat));
+    return false;
+#endif /* CHIP8EMU_OPSTATS */
+}
+
+void chip8emu_reset_opcode_stats(chip8emu *emu)
+{
+#ifdef CHIP8EMU_OPSTATS
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    memset(((_chip8emu_opstats*) emu->_opstats)->ops, 0, C8OP_COUNT * sizeof (chip8emu_opstat));
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+#else
+    (void) emu;
+#endif /* CHIP8EMU_OPSTATS */
+}
+
+const char* chip8emu_opcode_name(int op)
+{
+    static const char * const names[C8OP_COUNT] = {
+        "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0",
+        "6XNN", "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4",
+        "8XY5", "8XY6", "8XY7", "8XYE", "9XY0", "ANNN", "BNNN",
+        "CXNN", "DXYN", "EX9E", "EXA1", "FX07", "FX0A", "FX15",
+        "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65",
+        "0NNN"
+    };
+    return op >= 0 && op < C8OP_COUNT ? names[op] : "?";
+}
+
+bool chip8emu_get_profile(chip8emu *emu, chip8emu_profile *profile)
+{
+#ifdef CHIP8EMU_PROFILE
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    memcpy(profile, emu->_profile, sizeof (chip8emu_profile));
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    return true;
+#else
+    (void) emu;
+    memset(profile, 0, sizeof (chip8emu_profile));
+    return false;
+#endif /* CHIP8EMU_PROFILE */
+}
+
+void chip8emu_reset_profile(chip8emu *emu)
+{
+#ifdef CHIP8EMU_PROFILE
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    memset(emu->_profile, 0, sizeof (chip8emu_profile));
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+#else
+    (void) emu;
+#endif /* CHIP8EMU_PROFILE */
+}
+
+void chip8emu_seed(chip8emu *emu, uint32_t seed)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    emu->_rng = seed ? seed : 1; /* xorshift never leaves 0 */
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+}
+
+int chip8emu_load_code(chip8emu *emu, uint8_t *code, long code_size)
+{
+    for(int i = 0; i < code_size; ++i)
+      emu->memory[i + 512] = code[i];
+    _chip8emu_code_written(emu, 512, code_size);
+    return C8ERR_OK;
+}
+
+
+int chip8emu_load_rom(chip8emu *emu, const char *filename)
+{
+    uint16_t filelen = 0;
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL) {
+        _chip8emu_log_error(emu, "file %s does not exist\n", filename);
+        return C8ERR_FILE;
+    }
+    uint8_t c;
+    while (fread(&c, 1, 1, f) != 0) {
+        emu->memory[filelen + 512] = c;
+        filelen++;
+    }
+    fclose(f);
+    _chip8emu_code_written(emu, 512, filelen);
+
+    return C8ERR_OK;
+}
+
+void chip8emu_timer_tick(chip8emu *emu)
+{
+    emu->_timer_ticks++;
+    emu->_keys_unseen = 0; /* taps are held for one frame at least */
+    /* timers are computed from the tick count, only the end of the sound is an event */
+    if (emu->sound_timer && emu->_timer_ticks - emu->_sound_since == emu->sound_timer && emu->beep)
+        emu->beep(emu);
+    if (emu->_movie)
+        _chip8emu_movie_tick(emu);
+    if (emu->_rewind)
+        _chip8emu_rewind_capture(emu);
+    _chip8emu_vblank(emu);
+}
+
+/* ******************** Input ******************** */
+static void _chip8emu_key_push(chip8emu *emu, uint8_t event)
+{
+    uint8_t tail = emu->_key_tail;
+    if ((uint8_t) (tail - _chip8emu_atomic_load(&emu->_key_head)) == C8_KEY_QUEUE) {
+        _chip8emu_atomic_store(&emu->_key_overflow, true); /* the cpu resyncs with _keys */
+        return;
+    }
+    emu->_key_queue[tail % C8_KEY_QUEUE] = event;
+    _chip8emu_atomic_store(&emu->_key_tail, (uint8_t) (tail + 1));
+}
+
+void chip8emu_key_down(chip8emu *emu, uint8_t key)
+{
+    _chip8emu_atomic_or16(&emu->_keys, 1u << (key & 0xF));
+    if (emu->key_events)
+        _chip8emu_key_push(emu, C8_KEYEV_DOWN | (key & 0xF));
+#ifndef CHIP8EMU_NO_THREAD
+    /* the locked or above orders this read after the key; missing a block only delays FX0A to the next tick */
+    if (_chip8emu_atomic_load_relaxed(&emu->_key_blocked))
+        chip8emu_key_notify(emu);
+#endif /* CHIP8EMU_NO_THREAD */
+}
+
+void chip8emu_key_up(chip8emu *emu, uint8_t key)
+{
+    _chip8emu_atomic_and16(&emu->_keys, ~(1u << (key & 0xF)));
+    if (emu->key_events)
+        _chip8emu_key_push(emu, key & 0xF);
+}
+
+/* applies the queued edges in order; a release waits while its press is unseen */
+static void _chip8emu_key_drain(chip8emu *emu)
+{
+    uint8_t head = emu->_key_head;
+    uint8_t tail = _chip8emu_atomic_load(&emu->_key_tail);
+    while (head != tail) {
+        uint8_t event = emu->_key_queue[head % C8_KEY_QUEUE];
+        uint16_t bit = 1u << (event & 0xF);
+        if (event & C8_KEYEV_DOWN) {
+            emu->_cpu_keys |= bit;
+            emu->_keys_unseen |= bit;
+        } else if (emu->_keys_unseen & bit) {
+            break;
+        } else {
+            emu->_cpu_keys &= ~bit;
+        }
+        head++;
+    }
+    _chip8emu_atomic_store(&emu->_key_head, head);
+
+    if (head == tail && _chip8emu_atomic_load_relaxed(&emu->_key_overflow)) {
+        _chip8emu_atomic_store(&emu->_key_overflow, false);
+        emu->_cpu_keys = _chip8emu_atomic_load_relaxed(&emu->_keys) | (emu->_cpu_keys & emu->_keys_unseen);
+    }
+}
+
+/* pressed keys of the built-in input as the cpu sees them, bit k is key k */
+static uint16_t _chip8emu_keys(chip8emu* emu)
+{
+    if (!emu->key_events)
+        return _chip8emu_atomic_load_relaxed(&emu->_keys);
+    _chip8emu_key_drain(emu);
+    return emu->_cpu_keys;
+}
+
+/* lowest pressed key, 0x10 if none */
+static uint8_t _chip8emu_first_key(chip8emu* emu)
+{
+    uint8_t key = 0;
+    if (emu->_movie && ((_chip8emu_movie*) emu->_movie)->playing) {
+        uint16_t keys = _chip8emu_movie_replay_keys(emu);
+        while (key < 0x10 && !(keys & (1u << key)))
+            key++;
+        return key;
+    }
+    if (emu->keystate) {
+        while (key < 0x10 && !emu->keystate(emu, key))
+            key++;
+    } else {
+        uint16_t keys = _chip8emu_keys(emu);
+        while (key < 0x10 && !(keys & (1u << key)))
+            key++;
+        if (key < 0x10)
+            emu->_keys_unseen &= ~(1u << key);
+    }
+    if (emu->_movie) /* the keys up to the first pressed one were read */
+        _chip8emu_movie_record_keys(emu, key < 0x10 ? (uint16_t) ((2u << key) - 1) : 0xFFFF,
+                                    key < 0x10 ? (uint16_t) (1u << key) : 0);
+    return key;
+}
+/* ******************** /Input ******************** */
+
+/*
+ * One frame of virtual time: cpu / timer rate instructions, the fractional
+ * part carried to the next frames so the ratio stays exact, ended by a timer
+ * tick. Shared by started emulators and movie replays.
+ */
+static int _chip8emu_virtual_frame(chip8emu *emu, uint64_t cpu_millihz, uint64_t timer_millihz)
+{
+    emu->_vt_frac += cpu_millihz;
+    long cycles_per_frame = (long) (emu->_vt_frac / timer_millihz);
+    emu->_vt_frac %= timer_millihz;
+
+    int ret;
+    do {
+        ret = chip8emu_run_frame(emu, cycles_per_frame);
+    } while (ret == C8RUN_DRAW);
+    if (ret == C8RUN_FAULT) {
+        /* the faulting instruction is retried next frame */
+        long left = cycles_per_frame - emu->_frame_cycles;
+        emu->cycles += left;
+        emu->idle_cycles += left;
+        emu->_frame_cycles = 0;
+        chip8emu_timer_tick(emu);
+    }
+    return ret;
+}
+
+#ifndef CHIP8EMU_NO_THREAD
+
+#define C8_SCHED_QUANTUM_NS 4000000     /* a running cpu is resumed at least this often */
+#define C8_SCHED_MAX_LAG_NS 100000000   /* an instance further behind drops the backlog */
+
+/* cpu cycles due at or before until, spent idle */
+static void _chip8emu_idle_until(chip8emu *emu, uint64_t until)
+{
+    _chip8emu_clock *cpu = (_chip8emu_clock*) emu->_cpu_clock;
+    uint64_t n = _chip8emu_clock_due(cpu, until);
+    emu->cycles += n;
+    emu->idle_cycles += n;
+    _chip8emu_clock_advance(cpu, n);
+}
+
+/* further behind than C8_SCHED_MAX_LAG_NS, or ahead by more than that plus one tick */
+static bool _chip8emu_clock_off(const _chip8emu_clock *clock, uint64_t now)
+{
+    return clock->next + C8_SCHED_MAX_LAG_NS < now
+        || clock->next > now + C8_SCHED_MAX_LAG_NS + 1000000000000ULL / clock->millihz;
+}
+
+/* wall clocks restart at now, mtx_cpu held */
+static void _chip8emu_clocks_reset(chip8emu *emu, uint64_t now)
+{
+    _chip8emu_clock_reset((_chip8emu_clock*) emu->_cpu_clock, now);
+    _chip8emu_clock_reset((_chip8emu_clock*) emu->_timer_clock, now);
+    _chip8emu_clock_reset((_chip8emu_clock*) emu->_pace_clock, now);
+}
+
+/*
+ * Slice in virtual time: whole frames of cpu / timer speed instructions, each
+ * ended by a timer tick, as chip8emu_run_frame does, so the result depends on
+ * the instruction count only. Frames are paced at _time_scale times the timer
+ * speed, or run back to back for a quantum when unthrottled. mtx_cpu held.
+ */
+static uint64_t _chip8emu_virtual_slice(chip8emu *emu, uint64_t now)
+{
+    _chip8emu_clock *cpu = (_chip8emu_clock*) emu->_cpu_clock;
+    _chip8emu_clock *timer = (_chip8emu_clock*) emu->_timer_clock;
+    _chip8emu_clock *pace = (_chip8emu_clock*) emu->_pace_clock;
+
+    uint64_t frames = UINT64_MAX;
+    if (emu->_time_scale) {
+        uint64_t millihz = timer->millihz * emu->_time_scale / 1000;
+        if (pace->millihz != millihz) {
+            pace->millihz = millihz ? millihz : 1;
+            pace->frac = 0;
+        }
+        if (_chip8emu_clock_off(pace, now))
+            _chip8emu_clock_reset(pace, now);
+        frames = _chip8emu_clock_due(pace, now);
+    }
+
+    uint64_t done = 0;
+    while (done < frames) {
+        _chip8emu_virtual_frame(emu, cpu->millihz, timer->millihz);
+        done++;
+        if (!emu->_time_scale && _chip8emu_sched_now() >= now + C8_SCHED_QUANTUM_NS)
+            break;
+    }
+
+    if (!emu->_time_scale)
+        return now; /* overdue: runs again after the other due instances */
+    _chip8emu_clock_advance(pace, done);
+    return pace->next;
+}
+
+/*
+ * Scheduler slice of a started emulator: catches the cpu and timer clocks up
+ * with now, at most C8_SCHED_QUANTUM_NS worth of cycles, and returns when it
+ * needs to run again. Idle loops, vblank waits and FX0A sleep until the next
+ * timer tick; FX0A is woken earlier by chip8emu_key_notify.
+ */
+static uint64_t chip8emu_thread_slice(_chip8emu_task *task, uint64_t now)
+{
+    chip8emu *emu = (chip8emu*) task->arg;
+
+    mtx_lock(emu->mtx_pause);
+    bool paused = emu->paused;
+    mtx_unlock(emu->mtx_pause);
+    if (paused)
+        return C8_SCHED_PARK;
+
+    mtx_lock(emu->mtx_cpu);
+    if (emu->_virtual_time) {
+        uint64_t next = _chip8emu_virtual_slice(emu, now);
+        _chip8emu_publish(emu);
+        mtx_unlock(emu->mtx_cpu);
+        return next;
+    }
+    _chip8emu_clock *cpu = (_chip8emu_clock*) emu->_cpu_clock;
+    _chip8emu_clock *timer = (_chip8emu_clock*) emu->_timer_clock;
+
+    if (_chip8emu_clock_off(cpu, now) || _chip8emu_clock_off(timer, now)) {
+        _chip8emu_clock_reset(cpu, now);
+        _chip8emu_clock_reset(timer, now);
+    }
+
+    /* cycles this slice may run */
+    long budget = (long) (cpu->millihz * (C8_SCHED_QUANTUM_NS / 1000) / 1000000000) + 1;
+    while (true) {
+        if (timer->next <= cpu->next && timer->next <= now) {
+            chip8emu_timer_tick(emu);
+            /* idle loops re-check, FX0A re-polls the keys */
+            emu->_cpu_waiting = false;
+            emu->_key_blocked = false;
+            _chip8emu_clock_advance(timer, 1);
+            continue;
+        }
+        if (cpu->next > now || budget <= 0)
+            break;
+
+        /* cpu cycles due before the next tick */
+        uint64_t until = timer->next - 1 < now ? timer->next - 1 : now;
+        if (emu->_cpu_waiting || emu->_key_blocked) {
+            _chip8emu_idle_until(emu, until);
+            continue;
+        }
+        long n = (long) _chip8emu_clock_due(cpu, until);
+        if (n > budget)
+            n = budget;
+        long executed = _chip8emu_run(emu, n, C8_RUNF_KEY_WAIT | C8_RUNF_IDLE | C8_RUNF_VBLANK_WAIT);
+        budget -= executed;
+        _chip8emu_clock_advance(cpu, (uint64_t) executed);
+        if (emu->_run_flags & C8_RUNF_KEY_WAIT)
+            emu->_key_blocked = true;
+        else if (emu->_run_flags & (C8_RUNF_IDLE | C8_RUNF_VBLANK_WAIT | C8_RUNF_FAULT))
+            emu->_cpu_waiting = true; /* a faulting instruction is retried every tick */
+    }
+
+    uint64_t next;
+    if (cpu->next <= now)
+        next = cpu->next; /* out of budget, overdue: runs after more overdue instances */
+    else if (emu->_cpu_waiting || emu->_key_blocked)
+        next = timer->next;
+    else
+        next = cpu->next + C8_SCHED_QUANTUM_NS < timer->next ? cpu->next + C8_SCHED_QUANTUM_NS : timer->next;
+    _chip8emu_publish(emu);
+    mtx_unlock(emu->mtx_cpu);
+    return next;
+}
+
+void chip8emu_start(chip8emu *emu)
+{
+    _chip8emu_sched_attach((_chip8emu_task*) emu->_task);
+    chip8emu_resume(emu);
+}
+
+void chip8emu_run_realtime(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_pause);
+    emu->paused = false;
+    mtx_unlock(emu->mtx_pause);
+
+    mtx_lock(emu->mtx_cpu);
+    _chip8emu_clocks_reset(emu, _chip8emu_sched_now());
+    mtx_unlock(emu->mtx_cpu);
+
+    _chip8emu_sched_run_here((_chip8emu_task*) emu->_task);
+}
+
+void chip8emu_set_virtual_time(chip8emu *emu, bool enabled)
+{
+    mtx_lock(emu->mtx_cpu);
+    if (emu->_virtual_time != enabled) {
+        emu->_virtual_time = enabled;
+        emu->_vt_frac = 0;
+        emu->_frame_cycles = 0;
+        emu->_cpu_waiting = false;
+        emu->_key_blocked = false;
+        _chip8emu_clocks_reset(emu, _chip8emu_sched_now());
+    }
+    mtx_unlock(emu->mtx_cpu);
+    _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+}
+
+void chip8emu_set_time_scale(chip8emu *emu, uint32_t permille)
+{
+    mtx_lock(emu->mtx_cpu);
+    if (emu->_time_scale != permille) {
+        emu->_time_scale = permille;
+        /* the new pace starts now, not from the previous frame */
+        _chip8emu_clock_reset((_chip8emu_clock*) emu->_pace_clock, _chip8emu_sched_now());
+    }
+    mtx_unlock(emu->mtx_cpu);
+    _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+}
+
+void chip8emu_key_notify(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_cpu);
+    bool blocked = emu->_key_blocked;
+    if (blocked) {
+        uint64_t now = _chip8emu_sched_now();
+        uint64_t tick = ((_chip8emu_clock*) emu->_timer_clock)->next;
+        /* the cycles spent waiting until now were idle */
+        _chip8emu_idle_until(emu, now < tick ? now : tick - 1);
+        emu->_key_blocked = false;
+    }
+    mtx_unlock(emu->mtx_cpu);
+    if (blocked)
+        _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+}
+
+void chip8emu_pause(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_pause);
+    if (!emu->paused) {
+        emu->paused = true;
+    }
+    mtx_unlock(emu->mtx_pause);
+}
+
+void chip8emu_resume(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_pause);
+    bool resumed = emu->paused;
+    emu->paused = false;
+    mtx_unlock(emu->mtx_pause);
+
+    if (resumed) {
+        /* paused time is not caught up */
+        mtx_lock(emu->mtx_cpu);
+        _chip8emu_clocks_reset(emu, _chip8emu_sched_now());
+        mtx_unlock(emu->mtx_cpu);
+        _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+    }
+}
+
+void chip8emu_reset(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_cpu);
+
+    emu->pc     = 0x200;  /* Program counter starts at 0x200 */
+    emu->opcode = 0;      /* Reset current opcode */
+    emu->I      = 0;      /* Reset index register */
+    emu->sp     = 0;      /* Reset stack pointer */
+
+    emu->_frame_cycles = 0;
+    emu->_key_blocked = false;
+    emu->_cpu_waiting = false;
+
+    memset(emu->display, 0, sizeof emu->display); /* Clear display */
+    emu->_gfx_stale = true;
+    emu->_dirty_rows = 0xFFFFFFFF;
+    memset(&(emu->stack), 0, 16 * sizeof(uint16_t));         /* Clear stack */
+    memset(&(emu->V), 0, 16);             /* Clear registers V0-VF */
+
+    _chip8emu_timer_delay_set(emu, 0);
+    _chip8emu_timer_sound_set(emu, 0);
+
+    _chip8emu_draw(emu);
+
+    mtx_unlock(emu->mtx_cpu);
+
+    chip8emu_resume(emu);
+}
+
+
+void chip8emu_set_cpu_speed(chip8emu *emu, long speed_in_hz)
+{
+    chip8emu_set_cpu_speed_millihz(emu, (uint64_t) speed_in_hz * 1000);
+}
+
+void chip8emu_set_cpu_speed_millihz(chip8emu *emu, uint64_t speed_in_millihz)
+{
+    _chip8emu_clock *cpu = (_chip8emu_clock*) emu->_cpu_clock;
+    mtx_lock(emu->mtx_cpu);
+    /* the next cycle keeps its due time, the following ones use the new rate */
+    cpu->frac = 0;
+    cpu->millihz = speed_in_millihz ? speed_in_millihz : 1;
+    mtx_unlock(emu->mtx_cpu);
+}
+
+long chip8emu_get_cpu_speed(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_cpu);
+    long speed_in_hz = (long) ((((_chip8emu_clock*) emu->_cpu_clock)->millihz + 500) / 1000);
+    mtx_unlock(emu->mtx_cpu);
+    return speed_in_hz;
+}
+
+void chip8emu_set_timer_speed(chip8emu *emu, long speed_in_hz)
+{
+    _chip8emu_clock *timer = (_chip8emu_clock*) emu->_timer_clock;
+    mtx_lock(emu->mtx_cpu);
+    timer->frac = 0;
+    timer->millihz = speed_in_hz > 0 ? (uint64_t) speed_in_hz * 1000 : 1;
+    mtx_unlock(emu->mtx_cpu);
+}
+
+long chip8emu_get_timer_speed(chip8emu *emu)
+{
+    mtx_lock(emu->mtx_cpu);
+    long speed_in_hz = (long) ((((_chip8emu_clock*) emu->_timer_clock)->millihz + 500) / 1000);
+    mtx_unlock(emu->mtx_cpu);
+    return speed_in_hz;
+}
+#endif /* CHIP8EMU_NO_THREAD */
+
+/* ******************** Snapshots ******************** */
+/* copies the state into the back buffer and swaps it with the middle one, mtx_cpu held */
+static void _chip8emu_publish(chip8emu* emu)
+{
+    _chip8emu_snapshots *snaps = (_chip8emu_snapshots*) emu->_snapshots;
+    if (!snaps)
+        return;
+
+    chip8emu_snapshot *snapshot = &snaps->buffers[snaps->back];
+    memcpy(snapshot->memory, emu->memory, 4096);
+    memcpy(snapshot->display, emu->display, sizeof snapshot->display);
+    memcpy(snapshot->V, emu->V, 16);
+    memcpy(snapshot->stack, emu->stack, sizeof snapshot->stack);
+    snapshot->opcode = emu->opcode;
+    snapshot->sp = emu->sp;
+    snapshot->I = emu->I;
+    snapshot->pc = emu->pc;
+    snapshot->delay_timer = _chip8emu_timer_delay(emu);
+    snapshot->sound_timer = _chip8emu_timer_sound(emu);
+
+    uint64_t dirty = emu->_dirty_rows;
+    emu->_dirty_rows = 0;
+    uint64_t state = _chip8emu_atomic_load(&snaps->state);
+    uint64_t published;
+    do {
+        /* rows of a publication the reader skipped stay dirty */
+        published = (state & C8_SNAP_DIRTY) | dirty | C8_SNAP_FRESH
+                    | (uint64_t) snaps->back << C8_SNAP_MIDDLE_SHIFT;
+    } while (!_chip8emu_atomic_cas(&snaps->state, &state, published));
+    snaps->back = (int) (state >> C8_SNAP_MIDDLE_SHIFT) & 3;
+}
+
+const chip8emu_snapshot* chip8emu_acquire_snapshot(chip8emu *emu)
+{
+    _chip8emu_snapshots *snaps = (_chip8emu_snapshots*) emu->_snapshots;
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_pause);
+    bool paused = emu->paused;
+    mtx_unlock(emu->mtx_pause);
+    /* nothing publishes while paused; the cpu is not running so the lock does not stall it */
+    if (!snaps || paused) {
+        mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+        if (!snaps) {
+            snaps = calloc(1, sizeof (_chip8emu_snapshots));
+            snaps->state = (uint64_t) 1 << C8_SNAP_MIDDLE_SHIFT;
+            snaps->back = 2;
+            emu->_snapshots = snaps;
+        }
+        _chip8emu_publish(emu);
+#ifndef CHIP8EMU_NO_THREAD
+        mtx_unlock(emu->mtx_cpu);
+    }
+#endif /* CHIP8EMU_NO_THREAD */
+
+    chip8emu_snapshot *snapshot;
+    if (_chip8emu_atomic_load(&snaps->state) & C8_SNAP_FRESH) {
+        uint64_t state = _chip8emu_atomic_exchange(&snaps->state, (uint64_t) snaps->front << C8_SNAP_MIDDLE_SHIFT);
+        snaps->front = (int) (state >> C8_SNAP_MIDDLE_SHIFT) & 3;
+        snapshot = &snaps->buffers[snaps->front];
+        snapshot->dirty_rows = (uint32_t) (state & C8_SNAP_DIRTY);
+        _chip8emu_unpack_display(snapshot->display, snapshot->gfx);
+    } else {
+        snapshot = &snaps->buffers[snaps->front];
+        snapshot->dirty_rows = 0;
+    }
+    return snapshot;
+}
+
+void chip8emu_take_snapshot(chip8emu *emu, chip8emu_snapshot *snapshot)
+{
+    memcpy(snapshot, chip8emu_acquire_snapshot(emu), sizeof (chip8emu_snapshot));
+}
+/* ******************** /Snapshots ******************** */
+
+/* ******************** Save states ******************** */
+/*
+ * Little-endian layout, C8_STATE_FIXED bytes then the non-zero memory pages of
+ * the page mask and the non-zero display rows of the row mask, in order:
+ * "C8ST", version, flags, quirks, _idle_period, pc, I, opcode, sp, V[16],
+ * stack[16], delay and sound timers (current values), cycles, idle_cycles,
+ * _timer_ticks, _frame_cycles, _vt_frac, _rng, _keys, _cpu_keys,
+ * _keys_unseen, page mask (16 pages of 256 bytes), row mask.
+ */
+#define C8_STATE_FIXED          118
+#define C8_STATE_PAGE           256
+#define C8_STATE_DRAW_PENDING   0x01    /* flags */
+
+static uint8_t* _chip8emu_state_put(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        *p++ = (uint8_t) (v >> (8 * i));
+    return p;
+}
+
+static uint64_t _chip8emu_state_get(const uint8_t **p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i)
+        v |= (uint64_t) (*p)[i] << (8 * i);
+    *p += bytes;
+    return v;
+}
+
+static bool _chip8emu_state_zero_page(const uint8_t *page)
+{
+    uint8_t any = 0;
+    for (int i = 0; i < C8_STATE_PAGE; ++i)
+        any |= page[i];
+    return !any;
+}
+
+/* dense: every page and row is stored, a fixed C8_STATE_DENSE layout for rewind deltas; mtx_cpu held */
+static size_t _chip8emu_state_write(chip8emu *emu, uint8_t *buf, size_t size, bool dense)
+{
+    uint16_t pages = 0;
+    uint32_t rows = 0;
+    size_t total = C8_STATE_FIXED;
+    for (int i = 0; i < 4096 / C8_STATE_PAGE; ++i) {
+        if (dense || !_chip8emu_state_zero_page(&emu->memory[i * C8_STATE_PAGE])) {
+            pages |= 1u << i;
+            total += C8_STATE_PAGE;
+        }
+    }
+    for (int y = 0; y < 32; ++y) {
+        if (dense || emu->display[y]) {
+            rows |= 1u << y;
+            total += 8;
+        }
+    }
+
+    if (total <= size) {
+        uint8_t *p = buf;
+        memcpy(p, "C8ST", 4);
+        p += 4;
+        *p++ = C8STATE_VERSION;
+        *p++ = emu->_draw_pending ? C8_STATE_DRAW_PENDING : 0;
+        *p++ = emu->quirks;
+        *p++ = emu->_idle_period;
+        p = _chip8emu_state_put(p, emu->pc, 2);
+        p = _chip8emu_state_put(p, emu->I, 2);
+        p = _chip8emu_state_put(p, emu->opcode, 2);
+        p = _chip8emu_state_put(p, emu->sp, 2);
+        memcpy(p, emu->V, 16);
+        p += 16;
+        for (int i = 0; i < 16; ++i)
+            p = _chip8emu_state_put(p, emu->stack[i], 2);
+        *p++ = _chip8emu_timer_delay(emu);
+        *p++ = _chip8emu_timer_sound(emu);
+        p = _chip8emu_state_put(p, emu->cycles, 8);
+        p = _chip8emu_state_put(p, emu->idle_cycles, 8);
+        p = _chip8emu_state_put(p, emu->_timer_ticks, 8);
+        p = _chip8emu_state_put(p, (uint32_t) emu->_frame_cycles, 4);
+        p = _chip8emu_state_put(p, emu->_vt_frac, 8);
+        p = _chip8emu_state_put(p, emu->_rng, 4);
+        p = _chip8emu_state_put(p, _chip8emu_atomic_load_relaxed(&emu->_keys), 2);
+        p = _chip8emu_state_put(p, emu->_cpu_keys, 2);
+        p = _chip8emu_state_put(p, emu->_keys_unseen, 2);
+        p = _chip8emu_state_put(p, pages, 2);
+        p = _chip8emu_state_put(p, rows, 4);
+        for (int i = 0; i < 4096 / C8_STATE_PAGE; ++i) {
+            if (pages & (1u << i)) {
+                memcpy(p, &emu->memory[i * C8_STATE_PAGE], C8_STATE_PAGE);
+                p += C8_STATE_PAGE;
+            }
+        }
+        for (int y = 0; y < 32; ++y) {
+            if (rows & (1u << y))
+                p = _chip8emu_state_put(p, emu->display[y], 8);
+        }
+    }
+    return total <= size ? total : 0;
+}
 
-        thrd_sleep(emu->_cpu_clk_delay, 0);
+/* buf was validated by _chip8emu_state_size, mtx_cpu held */
+static void _chip8emu_state_read(chip8emu *emu, const uint8_t *buf)
+{
+    if (emu->_movie && !((_chip8emu_movie*) emu->_movie)->playing) {
+        /* its cycle numbers would go back */
+        _chip8emu_log_warn(emu, "movie recording dropped, a state was loaded\n");
+        _chip8emu_movie_free(emu);
+    }
+    const uint8_t *masks = buf + C8_STATE_FIXED - 6;
+    uint16_t pages = (uint16_t) _chip8emu_state_get(&masks, 2);
+    uint32_t rows = (uint32_t) _chip8emu_state_get(&masks, 4);
+
+    const uint8_t *p = buf + 5;
+    emu->_draw_pending = (*p++ & C8_STATE_DRAW_PENDING) != 0;
+    emu->quirks = *p++;
+    emu->_idle_period = *p++;
+    emu->pc = (uint16_t) _chip8emu_state_get(&p, 2);
+    emu->I = (uint16_t) _chip8emu_state_get(&p, 2);
+    emu->opcode = (uint16_t) _chip8emu_state_get(&p, 2);
+    emu->sp = (uint16_t) _chip8emu_state_get(&p, 2);
+    memcpy(emu->V, p, 16);
+    p += 16;
+    for (int i = 0; i < 16; ++i)
+        emu->stack[i] = (uint16_t) _chip8emu_state_get(&p, 2);
+    uint8_t delay = *p++;
+    uint8_t sound = *p++;
+    emu->cycles = _chip8emu_state_get(&p, 8);
+    emu->idle_cycles = _chip8emu_state_get(&p, 8);
+    emu->_timer_ticks = _chip8emu_state_get(&p, 8);
+    /* the remaining values count down from the restored tick */
+    _chip8emu_timer_delay_set(emu, delay);
+    _chip8emu_timer_sound_set(emu, sound);
+    emu->_frame_cycles = (long) _chip8emu_state_get(&p, 4);
+    emu->_vt_frac = _chip8emu_state_get(&p, 8);
+    emu->_rng = (uint32_t) _chip8emu_state_get(&p, 4);
+    p += 2; /* _keys: the host keeps its held keys */
+    /* a key released since the save is not left down in the cpu's view */
+    uint16_t held = _chip8emu_atomic_load_relaxed(&emu->_keys);
+    emu->_cpu_keys = (uint16_t) _chip8emu_state_get(&p, 2) & held;
+    emu->_keys_unseen = (uint16_t) _chip8emu_state_get(&p, 2) & held;
+    p += 6; /* masks */
+    for (int i = 0; i < 4096 / C8_STATE_PAGE; ++i) {
+        if (pages & (1u << i)) {
+            memcpy(&emu->memory[i * C8_STATE_PAGE], p, C8_STATE_PAGE);
+            p += C8_STATE_PAGE;
+        } else {
+            memset(&emu->memory[i * C8_STATE_PAGE], 0, C8_STATE_PAGE);
+        }
     }
+    for (int y = 0; y < 32; ++y)
+        emu->display[y] = rows & (1u << y) ? _chip8emu_state_get(&p, 8) : 0;
+
+    _chip8emu_code_written(emu, 0, 4096);
+    emu->_run_flags = 0;
+    emu->_gfx_stale = true;
+    emu->_dirty_rows = 0xFFFFFFFF;
+#ifndef CHIP8EMU_NO_THREAD
+    emu->_cpu_waiting = false;
+    emu->_key_blocked = false;
+    _chip8emu_publish(emu);
+#endif /* CHIP8EMU_NO_THREAD */
+}
+
+/* size of the state in buf, 0 if it is not a complete, loadable state */
+static size_t _chip8emu_state_size(const uint8_t *buf, size_t size)
+{
+    if (size < C8_STATE_FIXED || memcmp(buf, "C8ST", 4) != 0 || buf[4] != C8STATE_VERSION)
+        return 0;
+    /* registers the engine indexes memory with */
+    const uint8_t *regs = buf + 8;
+    uint16_t pc = (uint16_t) _chip8emu_state_get(&regs, 2);
+    uint16_t I = (uint16_t) _chip8emu_state_get(&regs, 2);
+    if (buf[7] > 3 || pc > 0xFFE || I > 0xFFF)
+        return 0;
+    const uint8_t *masks = buf + C8_STATE_FIXED - 6;
+    uint16_t pages = (uint16_t) _chip8emu_state_get(&masks, 2);
+    uint32_t rows = (uint32_t) _chip8emu_state_get(&masks, 4);
+    size_t total = C8_STATE_FIXED;
+    for (int i = 0; i < 16; ++i)
+        total += (pages >> i & 1) * C8_STATE_PAGE;
+    for (int y = 0; y < 32; ++y)
+        total += (rows >> y & 1) * 8;
+    return total <= size ? total : 0;
+}
+
+size_t chip8emu_save_state(chip8emu *emu, uint8_t *buf, size_t size)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    size_t written = _chip8emu_state_write(emu, buf, size, false);
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    return written;
+}
+
+int chip8emu_load_state(chip8emu *emu, const uint8_t *buf, size_t size)
+{
+    if (!_chip8emu_state_size(buf, size))
+        return C8ERR_STATE;
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_state_read(emu, buf);
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+    _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+#endif /* CHIP8EMU_NO_THREAD */
     return C8ERR_OK;
 }
 
-static int chip8emu_thread_timer_tick(void *arg) {
-    chip8emu * emu = (chip8emu*) arg;
-    while (true) {
-        mtx_lock(emu->mtx_timers);
-        cnd_wait(emu->cnd_clk_timers, emu->mtx_timers);
-        chip8emu_timer_tick(emu);
-        mtx_unlock(emu->mtx_timers);
+int chip8emu_save_state_file(chip8emu *emu, const char *filename)
+{
+    uint8_t buf[C8STATE_MAX_SIZE];
+    size_t size = chip8emu_save_state(emu, buf, sizeof buf);
+    FILE *f = fopen(filename, "wb");
+
+    if (f == NULL) {
+        _chip8emu_log_error(emu, "cannot write state file %s\n", filename);
+        return C8ERR_FILE;
+    }
+    bool written = fwrite(buf, 1, size, f) == size;
+    if (fclose(f) != 0 || !written) {
+        _chip8emu_log_error(emu, "cannot write state file %s\n", filename);
+        return C8ERR_FILE;
     }
     return C8ERR_OK;
 }
 
+int chip8emu_load_state_file(chip8emu *emu, const char *filename)
+{
+    uint8_t buf[C8STATE_MAX_SIZE];
+    FILE *f = fopen(filename, "rb");
+
+    if (f == NULL) {
+        _chip8emu_log_error(emu, "state file %s does not exist\n", filename);
+        return C8ERR_FILE;
+    }
+    size_t size = fread(buf, 1, sizeof buf, f);
+    fclose(f);
+    int ret = chip8emu_load_state(emu, buf, size);
+    if (ret != C8ERR_OK)
+        _chip8emu_log_error(emu, "%s is not a valid state file\n", filename);
+    return ret;
+}
+/* ******************** /Save states ******************** */
+
+/* ******************** Rewind ******************** */
+/*
+ * The newest captured state is kept whole in the dense layout; the ring holds
+ * one entry per older frame, the xor of that frame's state with the next one,
+ * so stepping back pops the newest entry and xors it into the kept state.
+ * Entry: u16 length, packed delta, u16 length (walked from either end).
+ * Packed delta: runs of u16 unchanged bytes, u8 count, count changed bytes
+ * (xor values); the bytes after the last run are unchanged.
+ */
+#define C8_STATE_DENSE          (C8_STATE_FIXED + 4096 + 32 * 8)
+#define C8_REWIND_PACKED_MAX    (C8_STATE_DENSE + C8_STATE_DENSE / 64)
+#define C8_REWIND_ENTRY_EXTRA   4
+#define C8_REWIND_MIN_GAP       4   /* unchanged bytes shorter than this stay in a literal run */
+
+typedef struct {
+    uint8_t  *ring;
+    size_t    capacity;
+    size_t    head;         /* end of the newest entry */
+    size_t    used;         /* bytes of all entries */
+    long      frames;       /* entries, frames that can be stepped back */
+    bool      captured;     /* state holds a capture */
+    uint8_t   state[C8_STATE_DENSE];
+    uint8_t   delta[C8_STATE_DENSE];
+    uint8_t   packed[C8_REWIND_PACKED_MAX];
+} _chip8emu_rewind;
+
+static uint64_t _chip8emu_load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
 
-static int chip8emu_thread_cpu_cycle(void* arg) {
-    chip8emu * emu = (chip8emu*) arg;
+static size_t _chip8emu_rewind_pack(const uint8_t *delta, uint8_t *out)
+{
+    size_t i = 0, o = 0;
     while (true) {
-        mtx_lock(emu->mtx_cpu);
-        cnd_wait(emu->cnd_clk_cpu, emu->mtx_cpu);
-        chip8emu_exec_cycle(emu);
-        mtx_unlock(emu->mtx_cpu);
+        size_t start = i;
+        while (i + 8 <= C8_STATE_DENSE && !_chip8emu_load64(delta + i))
+            i += 8;
+        while (i < C8_STATE_DENSE && !delta[i])
+            i++;
+        if (i == C8_STATE_DENSE)
+            return o;
+        size_t skip = i - start;
+        /* the run ends at its last changed byte, the unchanged ones after it start the next skip */
+        size_t count = 0, end = 0;
+        while (i + count < C8_STATE_DENSE && count < 255 && count - end < C8_REWIND_MIN_GAP) {
+            if (delta[i + count])
+                end = count + 1;
+            count++;
+        }
+        count = end;
+        out[o++] = (uint8_t) skip;
+        out[o++] = (uint8_t) (skip >> 8);
+        out[o++] = (uint8_t) count;
+        memcpy(out + o, delta + i, count);
+        o += count;
+        i += count;
     }
-    return C8ERR_OK;
 }
 
+static void _chip8emu_rewind_unpack(const uint8_t *packed, size_t size, uint8_t *state)
+{
+    size_t i = 0, o = 0;
+    while (o < size) {
+        i += (size_t) packed[o] | (size_t) packed[o + 1] << 8;
+        size_t count = packed[o + 2];
+        o += 3;
+        for (size_t k = 0; k < count; ++k)
+            state[i + k] ^= packed[o + k];
+        i += count;
+        o += count;
+    }
+}
 
-void chip8emu_start(chip8emu *emu)
+/* copies between the ring and a flat buffer, at ring offset pos, wrapping around */
+static void _chip8emu_ring_write(_chip8emu_rewind *rw, size_t pos, const uint8_t *src, size_t n)
+{
+    pos %= rw->capacity;
+    size_t first = rw->capacity - pos < n ? rw->capacity - pos : n;
+    memcpy(rw->ring + pos, src, first);
+    memcpy(rw->ring, src + first, n - first);
+}
+
+static void _chip8emu_ring_read(_chip8emu_rewind *rw, size_t pos, uint8_t *dst, size_t n)
+{
+    pos %= rw->capacity;
+    size_t first = rw->capacity - pos < n ? rw->capacity - pos : n;
+    memcpy(dst, rw->ring + pos, first);
+    memcpy(dst + first, rw->ring, n - first);
+}
+
+static size_t _chip8emu_ring_length(_chip8emu_rewind *rw, size_t pos)
 {
-    /* start cpu clock */
-    if (thrd_create(emu->thrd_clk_cpu, chip8emu_thread_clk_cpu, (void*)emu) != thrd_success) {
-        _chip8emu_log_error(emu, "Cannot create cpu_clock thread!");
+    uint8_t len[2];
+    _chip8emu_ring_read(rw, pos, len, 2);
+    return (size_t) len[0] | (size_t) len[1] << 8;
+}
+
+/* end of a timer tick: pushes the delta from the previous capture, mtx_cpu held */
+static void _chip8emu_rewind_capture(chip8emu* emu)
+{
+    _chip8emu_rewind *rw = (_chip8emu_rewind*) emu->_rewind;
+    _chip8emu_state_write(emu, rw->delta, C8_STATE_DENSE, true);
+    if (!rw->captured) {
+        memcpy(rw->state, rw->delta, C8_STATE_DENSE);
+        rw->captured = true;
+        return;
+    }
+    /* delta = previous ^ new, state = new, a word at a time */
+    size_t i = 0;
+    for (; i + 8 <= C8_STATE_DENSE; i += 8) {
+        uint64_t current = _chip8emu_load64(rw->delta + i);
+        uint64_t delta = current ^ _chip8emu_load64(rw->state + i);
+        memcpy(rw->delta + i, &delta, 8);
+        memcpy(rw->state + i, &current, 8);
     }
+    for (; i < C8_STATE_DENSE; ++i) {
+        uint8_t current = rw->delta[i];
+        rw->delta[i] ^= rw->state[i];
+        rw->state[i] = current;
+    }
+    size_t len = _chip8emu_rewind_pack(rw->delta, rw->packed);
+    size_t entry = len + C8_REWIND_ENTRY_EXTRA;
+    if (entry > rw->capacity) {
+        /* history cut at this frame */
+        rw->used = 0;
+        rw->frames = 0;
+        return;
+    }
+    while (rw->used + entry > rw->capacity) {
+        /* drop the oldest frames */
+        size_t tail = rw->head + rw->capacity - rw->used;
+        rw->used -= _chip8emu_ring_length(rw, tail) + C8_REWIND_ENTRY_EXTRA;
+        rw->frames--;
+    }
+    uint8_t length[2] = { (uint8_t) len, (uint8_t) (len >> 8) };
+    _chip8emu_ring_write(rw, rw->head, length, 2);
+    _chip8emu_ring_write(rw, rw->head + 2, rw->packed, len);
+    _chip8emu_ring_write(rw, rw->head + 2 + len, length, 2);
+    rw->head = (rw->head + entry) % rw->capacity;
+    rw->used += entry;
+    rw->frames++;
+}
 
-    /* start timers clock */
-    if (thrd_create(emu->thrd_clk_timers, chip8emu_thread_clk_timers, (void*)emu) != thrd_success) {
-        _chip8emu_log_error(emu, "Cannot create timer_clock thread!");
+void chip8emu_set_rewind(chip8emu *emu, size_t size)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_rewind *rw = (_chip8emu_rewind*) emu->_rewind;
+    if (rw) {
+        free(rw->ring);
+        free(rw);
+        emu->_rewind = 0;
     }
+    if (size) {
+        rw = calloc(1, sizeof (_chip8emu_rewind));
+        rw->ring = malloc(size);
+        rw->capacity = size;
+        emu->_rewind = rw;
+    }
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+}
 
-    if (thrd_create(emu->thrd_cpu_cycle, chip8emu_thread_cpu_cycle, (void*)emu) != thrd_success) {
-        _chip8emu_log_error(emu, "Cannot create emu cycle timer clock thread!");
+long chip8emu_rewind(chip8emu *emu, long frames)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_rewind *rw = (_chip8emu_rewind*) emu->_rewind;
+    long stepped = 0;
+    if (rw && rw->captured) {
+        for (; stepped < frames && rw->frames; ++stepped) {
+            size_t len = _chip8emu_ring_length(rw, rw->head + rw->capacity - 2);
+            size_t entry = len + C8_REWIND_ENTRY_EXTRA;
+            _chip8emu_ring_read(rw, rw->head + rw->capacity - entry + 2, rw->packed, len);
+            _chip8emu_rewind_unpack(rw->packed, len, rw->state);
+            rw->head = (rw->head + rw->capacity - entry) % rw->capacity;
+            rw->used -= entry;
+            rw->frames--;
+        }
+        /* frames 0: back to the start of the current frame */
+        _chip8emu_state_read(emu, rw->state);
+        _chip8emu_draw(emu);
     }
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+    _chip8emu_sched_wake((_chip8emu_task*) emu->_task, 0);
+#endif /* CHIP8EMU_NO_THREAD */
+    return stepped;
+}
 
-    if (thrd_create(emu->thrd_timer_tick, chip8emu_thread_timer_tick, (void*)emu) != thrd_success) {
-        _chip8emu_log_error(emu, "Cannot create emu cycle timer clock thread!");
+long chip8emu_get_rewind_frames(chip8emu *emu)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_rewind *rw = (_chip8emu_rewind*) emu->_rewind;
+    long frames = rw ? rw->frames : 0;
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    return frames;
+}
+/* ******************** /Rewind ******************** */
+
+/* ******************** Movies ******************** */
+/*
+ * Movie: "C8MV", version, u16 hash period, u64 cpu and timer millihz, u16
+ * state size, the save state the recording started from, then entries, each
+ * a LEB128 varint of (cycles since the previous entry << 2 | tag):
+ * KEY: u16 keys read by the cpu, HASH: u32 display hash at a timer tick,
+ * END: varint frames, u32 display hash. All little-endian.
+ */
+#define C8_MOVIE_HEADER         23      /* bytes before the state size */
+#define C8_MOVIE_HASH_PERIOD    60      /* frames between display hashes */
+#define C8_MOVIE_KEY            0
+#define C8_MOVIE_HASH           1
+#define C8_MOVIE_END            2
+
+static uint32_t _chip8emu_display_hash(chip8emu *emu)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int y = 0; y < 32; ++y) {
+        for (int b = 0; b < 64; b += 8) {
+            hash ^= (uint8_t) (emu->display[y] >> b);
+            hash *= 16777619u;
+        }
     }
+    return hash;
+}
 
-    chip8emu_resume(emu);
+static void _chip8emu_movie_free(chip8emu* emu)
+{
+    _chip8emu_movie *movie = (_chip8emu_movie*) emu->_movie;
+    if (!movie)
+        return;
+    if (!movie->playing)
+        free(movie->data);
+    free(movie);
+    emu->_movie = 0;
 }
 
-void chip8emu_pause(chip8emu *emu)
+static void _chip8emu_movie_put(_chip8emu_movie *movie, uint64_t v, int bytes)
 {
-    mtx_lock(emu->mtx_pause);
-    if (!emu->paused) {
-        emu->paused = true;
+    if (movie->size + 10 > movie->capacity) {
+        movie->capacity *= 2;
+        movie->data = realloc(movie->data, movie->capacity);
     }
-    mtx_unlock(emu->mtx_pause);
+    if (bytes) {
+        _chip8emu_state_put(movie->data + movie->size, v, bytes);
+        movie->size += bytes;
+        return;
+    }
+    /* varint */
+    do {
+        movie->data[movie->size++] = (uint8_t) ((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v);
 }
 
-void chip8emu_resume(chip8emu *emu)
+static void _chip8emu_movie_entry(chip8emu *emu, _chip8emu_movie *movie, int tag)
 {
-    mtx_lock(emu->mtx_pause);
-    if (emu->paused == true) {
-        emu->paused = false;
-        cnd_signal(emu->cnd_resume_cpu);
-        cnd_signal(emu->cnd_resume_timers);
+    _chip8emu_movie_put(movie, (emu->cycles - movie->cycle) << 2 | (uint64_t) tag, 0);
+    movie->cycle = emu->cycles;
+}
+
+/* 0 at the end of the movie or on truncated data */
+static bool _chip8emu_movie_get(_chip8emu_movie *movie, size_t *pos, uint64_t *v, int bytes)
+{
+    if (bytes) {
+        if (*pos + (size_t) bytes > movie->size)
+            return false;
+        const uint8_t *p = movie->data + *pos;
+        *v = _chip8emu_state_get(&p, bytes);
+        *pos += (size_t) bytes;
+        return true;
     }
-    mtx_unlock(emu->mtx_pause);
+    *v = 0;
+    for (int shift = 0; *pos < movie->size && shift < 64; shift += 7) {
+        uint8_t b = movie->data[(*pos)++];
+        *v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
 }
 
-void chip8emu_reset(chip8emu *emu)
+/* reads the next entry without consuming it, tag -1 if there is none */
+static int _chip8emu_movie_peek(_chip8emu_movie *movie, uint64_t *cycle, size_t *next)
 {
-    mtx_lock(emu->mtx_timers);
-    mtx_lock(emu->mtx_cpu);
+    uint64_t head;
+    *next = movie->pos;
+    if (!_chip8emu_movie_get(movie, next, &head, 0))
+        return -1;
+    *cycle = movie->cycle + (head >> 2);
+    return (int) (head & 3);
+}
 
-    emu->pc     = 0x200;  /* Program counter starts at 0x200 */
-    emu->opcode = 0;      /* Reset current opcode */
-    emu->I      = 0;      /* Reset index register */
-    emu->sp     = 0;      /* Reset stack pointer */
+static void _chip8emu_movie_record_keys(chip8emu* emu, uint16_t queried, uint16_t pressed)
+{
+    _chip8emu_movie *movie = (_chip8emu_movie*) emu->_movie;
+    uint16_t keys = (uint16_t) ((movie->keys & ~queried) | pressed);
+    if (keys == movie->keys)
+        return;
+    movie->keys = keys;
+    _chip8emu_movie_entry(emu, movie, C8_MOVIE_KEY);
+    _chip8emu_movie_put(movie, keys, 2);
+}
 
-    memset(&(emu->gfx), 0, 64 * 32);      /* Clear display */
-    memset(&(emu->stack), 0, 16 * sizeof(uint16_t));         /* Clear stack */
-    memset(&(emu->V), 0, 16);             /* Clear registers V0-VF */
+/* keys of the entries up to the current cycle */
+static uint16_t _chip8emu_movie_replay_keys(chip8emu* emu)
+{
+    _chip8emu_movie *movie = (_chip8emu_movie*) emu->_movie;
+    uint64_t cycle, keys;
+    size_t next;
+    while (_chip8emu_movie_peek(movie, &cycle, &next) == C8_MOVIE_KEY && cycle <= emu->cycles
+           && _chip8emu_movie_get(movie, &next, &keys, 2)) {
+        movie->keys = (uint16_t) keys;
+        movie->cycle = cycle;
+        movie->pos = next;
+    }
+    return movie->keys;
+}
 
-    emu->delay_timer = 0;
-    emu->sound_timer = 0;
+static void _chip8emu_movie_tick(chip8emu* emu)
+{
+    _chip8emu_movie *movie = (_chip8emu_movie*) emu->_movie;
+    movie->frames++;
+    if (movie->frames % C8_MOVIE_HASH_PERIOD)
+        return;
+    if (!movie->playing) {
+        _chip8emu_movie_entry(emu, movie, C8_MOVIE_HASH);
+        _chip8emu_movie_put(movie, _chip8emu_display_hash(emu), 4);
+        return;
+    }
+    uint64_t cycle, hash;
+    size_t next;
+    if (_chip8emu_movie_peek(movie, &cycle, &next) != C8_MOVIE_HASH || cycle != emu->cycles
+            || !_chip8emu_movie_get(movie, &next, &hash, 4) || hash != _chip8emu_display_hash(emu)) {
+        movie->diverged = true;
+        return;
+    }
+    movie->cycle = cycle;
+    movie->pos = next;
+}
 
-    emu->draw(emu);
+void chip8emu_record_movie(chip8emu *emu, uint64_t cpu_millihz, uint64_t timer_millihz)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_movie_free(emu);
+    _chip8emu_movie *movie = calloc(1, sizeof (_chip8emu_movie));
+    movie->capacity = 64 * 1024;
+    movie->data = malloc(movie->capacity);
+    memcpy(movie->data, "C8MV", 4);
+    movie->data[4] = C8MOVIE_VERSION;
+    movie->size = 5;
+    _chip8emu_movie_put(movie, C8_MOVIE_HASH_PERIOD, 2);
+    _chip8emu_movie_put(movie, cpu_millihz ? cpu_millihz : 1, 8);
+    _chip8emu_movie_put(movie, timer_millihz ? timer_millihz : 1, 8);
+    size_t state_size = _chip8emu_state_write(emu, movie->data + C8_MOVIE_HEADER + 2, C8STATE_MAX_SIZE, false);
+    _chip8emu_movie_put(movie, state_size, 2);
+    movie->size += state_size;
+    movie->cycle = emu->cycles;
+    emu->_movie = movie;
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+}
 
+size_t chip8emu_stop_movie(chip8emu *emu, uint8_t **data)
+{
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_movie *movie = (_chip8emu_movie*) emu->_movie;
+    size_t size = 0;
+    *data = 0;
+    if (movie && !movie->playing) {
+        _chip8emu_movie_entry(emu, movie, C8_MOVIE_END);
+        _chip8emu_movie_put(movie, movie->frames, 0);
+        _chip8emu_movie_put(movie, _chip8emu_display_hash(emu), 4);
+        *data = movie->data;
+        size = movie->size;
+        movie->data = 0;
+        _chip8emu_movie_free(emu);
+    }
+#ifndef CHIP8EMU_NO_THREAD
     mtx_unlock(emu->mtx_cpu);
-    mtx_unlock(emu->mtx_timers);
+#endif /* CHIP8EMU_NO_THREAD */
+    return size;
+}
 
-    chip8emu_resume(emu);
+int chip8emu_play_movie(chip8emu *emu, const uint8_t *data, size_t size, long *frames)
+{
+    *frames = 0;
+    if (size < C8_MOVIE_HEADER + 2 || memcmp(data, "C8MV", 4) != 0 || data[4] != C8MOVIE_VERSION)
+        return C8ERR_STATE;
+    const uint8_t *p = data + 5;
+    uint64_t period = _chip8emu_state_get(&p, 2);
+    uint64_t cpu_millihz = _chip8emu_state_get(&p, 8);
+    uint64_t timer_millihz = _chip8emu_state_get(&p, 8);
+    size_t state_size = (size_t) _chip8emu_state_get(&p, 2);
+    if (period != C8_MOVIE_HASH_PERIOD || !cpu_millihz || !timer_millihz
+            || size - C8_MOVIE_HEADER - 2 < state_size || _chip8emu_state_size(p, state_size) != state_size)
+        return C8ERR_STATE;
+
+    _chip8emu_movie_free(emu);
+    _chip8emu_state_read(emu, p);
+    _chip8emu_movie *movie = calloc(1, sizeof (_chip8emu_movie));
+    movie->playing = true;
+    movie->data = (uint8_t*) p + state_size;
+    movie->size = size - C8_MOVIE_HEADER - 2 - state_size;
+    movie->cycle = emu->cycles;
+    emu->_movie = movie;
+
+    int ret = C8ERR_DESYNC;
+    while (!movie->diverged) {
+        uint64_t cycle, end_frames, hash;
+        size_t next;
+        int tag = _chip8emu_movie_peek(movie, &cycle, &next);
+        if (tag < 0 || (tag == C8_MOVIE_END && (!_chip8emu_movie_get(movie, &next, &end_frames, 0)
+                                                 || !_chip8emu_movie_get(movie, &next, &hash, 4)))) {
+            ret = C8ERR_STATE; /* truncated */
+            break;
+        }
+        if (tag == C8_MOVIE_END && movie->frames >= end_frames) {
+            if (movie->frames == end_frames && cycle == emu->cycles && hash == _chip8emu_display_hash(emu))
+                ret = C8ERR_OK;
+            break;
+        }
+        _chip8emu_virtual_frame(emu, cpu_millihz, timer_millihz);
+        *frames = (long) movie->frames;
+    }
+    _chip8emu_movie_free(emu);
+    return ret;
 }
 
+int chip8emu_stop_movie_file(chip8emu *emu, const char *filename)
+{
+    uint8_t *data;
+    size_t size = chip8emu_stop_movie(emu, &data);
+    if (!size)
+        return C8ERR_OK;
+    FILE *f = fopen(filename, "wb");
+    bool written = f && fwrite(data, 1, size, f) == size;
+    if (f && fclose(f) != 0)
+        written = false;
+    free(data);
+    if (!written) {
+        _chip8emu_log_error(emu, "cannot write movie file %s\n", filename);
+        return C8ERR_FILE;
+    }
+    return C8ERR_OK;
+}
 
-void chip8emu_set_cpu_speed(chip8emu *emu, long speed_in_hz)
+int chip8emu_play_movie_file(chip8emu *emu, const char *filename, long *frames)
+{
+    FILE *f = fopen(filename, "rb");
+    *frames = 0;
+    if (f == NULL) {
+        _chip8emu_log_error(emu, "movie file %s does not exist\n", filename);
+        return C8ERR_FILE;
+    }
+    size_t capacity = 64 * 1024, size = 0, n;
+    uint8_t *data = malloc(capacity);
+    while ((n = fread(data + size, 1, capacity - size, f)) > 0) {
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    fclose(f);
+    int ret = chip8emu_play_movie(emu, data, size, frames);
+    free(data);
+    return ret;
+}
+/* ******************** /Movies ******************** */
+
+/* ******************** Instruction trace ******************** */
+bool chip8emu_set_trace(chip8emu *emu, size_t records, const char *fault_file)
 {
-    struct timespec* cpu_clk_delay = (struct timespec*) emu->_cpu_clk_delay;
+#ifdef CHIP8EMU_TRACE
+    _chip8emu_trace *trace = NULL;
+    if (records) {
+        size_t capacity = 1;
+        while (capacity < records)
+            capacity <<= 1;
+        trace = calloc(1, sizeof(_chip8emu_trace));
+        trace->ring = malloc(capacity * sizeof(uint64_t));
+        trace->mask = capacity - 1;
+        if (fault_file) {
+            size_t len = strlen(fault_file) + 1;
+            trace->fault_file = malloc(len);
+            memcpy(trace->fault_file, fault_file, len);
+        }
+    }
+#ifndef CHIP8EMU_NO_THREAD
     mtx_lock(emu->mtx_cpu);
-    cpu_clk_delay->tv_nsec = NANOSECS_PER_SEC / speed_in_hz;
+#endif /* CHIP8EMU_NO_THREAD */
+    _chip8emu_trace *old = (_chip8emu_trace*) emu->_trace;
+    emu->_trace = trace;
+#ifndef CHIP8EMU_NO_THREAD
     mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    if (old) {
+        free(old->ring);
+        free(old->fault_file);
+        free(old);
+    }
+    return true;
+#else
+    (void) emu;
+    (void) records;
+    (void) fault_file;
+    return false;
+#endif /* CHIP8EMU_TRACE */
 }
 
-long chip8emu_get_cpu_speed(chip8emu *emu)
+size_t chip8emu_dump_trace(chip8emu *emu, uint8_t *buf, size_t size)
 {
-    struct timespec* cpu_clk_delay = (struct timespec*) emu->_cpu_clk_delay;
+#ifdef CHIP8EMU_TRACE
+    size_t written = 0;
+#ifndef CHIP8EMU_NO_THREAD
     mtx_lock(emu->mtx_cpu);
-    long speed_in_hz =  NANOSECS_PER_SEC / cpu_clk_delay->tv_nsec;
+#endif /* CHIP8EMU_NO_THREAD */
+    if (emu->_trace)
+        written = _chip8emu_trace_write((_chip8emu_trace*) emu->_trace, buf, size);
+#ifndef CHIP8EMU_NO_THREAD
     mtx_unlock(emu->mtx_cpu);
-    return speed_in_hz;
+#endif /* CHIP8EMU_NO_THREAD */
+    return written;
+#else
+    (void) emu;
+    (void) buf;
+    (void) size;
+    return 0;
+#endif /* CHIP8EMU_TRACE */
 }
 
-void chip8emu_set_timer_speed(chip8emu *emu, long speed_in_hz)
+int chip8emu_dump_trace_file(chip8emu *emu, const char *filename)
 {
-    struct timespec* timer_clk_delay = (struct timespec*) emu->_timer_clk_delay;
-    mtx_lock(emu->mtx_timers);
-    timer_clk_delay->tv_nsec = NANOSECS_PER_SEC / speed_in_hz;
-    mtx_unlock(emu->mtx_timers);
+#ifdef CHIP8EMU_TRACE
+    int ret = C8ERR_FILE;
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_lock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    if (emu->_trace)
+        ret = _chip8emu_trace_write_file(emu, (_chip8emu_trace*) emu->_trace, filename);
+#ifndef CHIP8EMU_NO_THREAD
+    mtx_unlock(emu->mtx_cpu);
+#endif /* CHIP8EMU_NO_THREAD */
+    return ret;
+#else
+    (void) filename;
+    _chip8emu_log_error(emu, "instruction trace not compiled in (CHIP8EMU_TRACE)\n");
+    return C8ERR_FILE;
+#endif /* CHIP8EMU_TRACE */
 }
+/* ******************** /Instruction trace ******************** */
 
-long chip8emu_get_timer_speed(chip8emu *emu)
+/* ******************** Log ring ******************** */
+static void _chip8emu_log_ring_free(_chip8emu_log_ring *ring)
 {
-    struct timespec* timer_clk_delay = (struct timespec*) emu->_timer_clk_delay;
-    mtx_lock(emu->mtx_timers);
-    long speed_in_hz = NANOSECS_PER_SEC / timer_clk_delay->tv_nsec;
-    mtx_unlock(emu->mtx_timers);
-    return speed_in_hz;
+    if (ring) {
+        free(ring->entries);
+        free(ring);
+    }
 }
-#endif /* CHIP8EMU_NO_THREAD */
 
-void chip8emu_take_snapshot(chip8emu *emu, chip8emu_snapshot *snapshot)
+/* message of a drained entry, each conversion formatted alone with its captured argument */
+static void _chip8emu_log_format(const _chip8emu_log_entry *entry, char *message, size_t size)
+{
+    const char *p = entry->fmt;
+    size_t len = 0;
+    int n = 0;
+
+    message[0] = '\0';
+    if (!p) {
+        snprintf(message, size, "%s", entry->text);
+        return;
+    }
+    while (*p && len < size - 1) {
+        const char *spec = strchr(p, '%');
+        size_t literal = spec ? (size_t) (spec - p) : strlen(p);
+        if (literal > size - 1 - len)
+            literal = size - 1 - len;
+        memcpy(message + len, p, literal);
+        len += literal;
+        message[len] = '\0';
+        if (!spec)
+            break;
+
+        int kind;
+        char conv[24];
+        const char *end = _chip8emu_log_spec(spec, &kind);
+        memcpy(conv, spec, (size_t) (end - spec));
+        conv[end - spec] = '\0';
+
+        char *out = message + len;
+        size_t room = size - len;
+        const _chip8emu_log_arg *arg = &entry->args[n];
+        int written = 0;
+        switch (kind) {
+        case C8_LOGARG_NONE:    written = snprintf(out, room, "%%"); break;
+        case C8_LOGARG_INT:     written = snprintf(out, room, conv, arg->i); break;
+        case C8_LOGARG_LONG:    written = snprintf(out, room, conv, arg->l); break;
+        case C8_LOGARG_LLONG:   written = snprintf(out, room, conv, arg->ll); break;
+        case C8_LOGARG_SIZE:    written = snprintf(out, room, conv, arg->z); break;
+        case C8_LOGARG_INTMAX:  written = snprintf(out, room, conv, arg->j); break;
+        case C8_LOGARG_PTRDIFF: written = snprintf(out, room, conv, arg->t); break;
+        case C8_LOGARG_DOUBLE:  written = snprintf(out, room, conv, arg->d); break;
+        case C8_LOGARG_PTR:     written = snprintf(out, room, conv, arg->p); break;
+        case C8_LOGARG_STR:     written = snprintf(out, room, conv, entry->text + arg->z); break;
+        default: break;
+        }
+        if (kind != C8_LOGARG_NONE)
+            n++;
+        if (written > 0)
+            len += (size_t) written < room ? (size_t) written : room - 1;
+        p = end;
+    }
+}
+
+void chip8emu_set_log_ring(chip8emu *emu, size_t entries)
+{
+    _chip8emu_log_ring *ring = NULL;
+    if (entries) {
+        size_t capacity = 1;
+        while (capacity < entries)
+            capacity <<= 1;
+        ring = calloc(1, sizeof(_chip8emu_log_ring));
+        ring->entries = calloc(capacity, sizeof(_chip8emu_log_entry));
+        for (size_t i = 0; i < capacity; ++i)
+            ring->entries[i].seq = i;
+        ring->mask = capacity - 1;
+    }
+    /* messages still queued go to log before the ring is replaced */
+    chip8emu_drain_log(emu, 0);
+    _chip8emu_log_ring_free((_chip8emu_log_ring*) emu->_log_ring);
+    emu->_log_ring = ring;
+}
+
+int chip8emu_drain_log(chip8emu *emu, int max)
+{
+    _chip8emu_log_ring *ring = (_chip8emu_log_ring*) emu->_log_ring;
+    char message[255];
+    int count = 0;
+
+    if (!ring)
+        return 0;
+    uint64_t dropped = _chip8emu_atomic_exchange(&ring->dropped, 0);
+    if (dropped) {
+        snprintf(message, sizeof message, "%llu log messages dropped, the log ring was full\n",
+                 (unsigned long long) dropped);
+        emu->log(emu, C8E_LOG_WARN, __FILE__, __LINE__, message);
+        count++;
+    }
+    while (max <= 0 || count < max) {
+        _chip8emu_log_entry *entry = &ring->entries[ring->head & ring->mask];
+        if (_chip8emu_atomic_load(&entry->seq) != ring->head + 1)
+            break;
+        int level = entry->level, line = entry->line;
+        const char *file = entry->file;
+        _chip8emu_log_format(entry, message, sizeof message);
+        /* the entry is free again one lap later */
+        _chip8emu_atomic_store(&entry->seq, ring->head + ring->mask + 1);
+        ring->head++;
+        emu->log(emu, level, file, line, message);
+        count++;
+    }
+    return count;
+}
+/* ******************** /Log ring ******************** */
+
+uint32_t chip8emu_consume_dirty_rows(chip8emu *emu)
 {
 #ifndef CHIP8EMU_NO_THREAD
     mtx_lock(emu->mtx_cpu);
 #endif /* CHIP8EMU_NO_THREAD */
-    memcpy(snapshot->memory, emu->memory, 4096);
-    memcpy(snapshot->gfx, emu->gfx, 2048);
-    memcpy(snapshot->V, emu->V, 16);
-    memcpy(snapshot->stack, emu->stack, 16);
-    snapshot->opcode = emu->opcode;
-    snapshot->sp = emu->sp;
-    snapshot->I = emu->I;
-    snapshot->pc = emu->pc;
+    uint32_t dirty = emu->_dirty_rows;
+    emu->_dirty_rows = 0;
 #ifndef CHIP8EMU_NO_THREAD
     mtx_unlock(emu->mtx_cpu);
-    mtx_lock(emu->mtx_timers);
-#endif /* CHIP8EMU_NO_THREAD */
-    snapshot->delay_timer = emu->delay_timer;
-    snapshot->sound_timer = emu->sound_timer;
-#ifndef CHIP8EMU_NO_THREAD
-    mtx_unlock(emu->mtx_timers);
 #endif /* CHIP8EMU_NO_THREAD */
+    return dirty;
 }
 
+/* timers hold the value written at tick _*_since and count down from there */
 static uint8_t _chip8emu_timer_delay(chip8emu* emu)
+{
+    uint64_t elapsed = emu->_timer_ticks - emu->_delay_since;
+    return elapsed < emu->delay_timer ? (uint8_t) (emu->delay_timer - elapsed) : 0;
+}
+
+static uint8_t _chip8emu_timer_sound(chip8emu* emu)
+{
+    uint64_t elapsed = emu->_timer_ticks - emu->_sound_since;
+    return elapsed < emu->sound_timer ? (uint8_t) (emu->sound_timer - elapsed) : 0;
+}
+
+static void _chip8emu_timer_delay_set(chip8emu* emu, uint8_t val)
+{
+    emu->delay_timer = val;
+    emu->_delay_since = emu->_timer_ticks;
+}
+
+static void _chip8emu_timer_sound_set(chip8emu* emu, uint8_t val)
+{
+    emu->sound_timer = val;
+    emu->_sound_since = emu->_timer_ticks;
+}
+
+uint8_t chip8emu_get_delay_timer(chip8emu *emu)
 {
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_lock(emu->mtx_timers);
+    mtx_lock(emu->mtx_cpu);
 #endif /* CHIP8EMU_NO_THREAD */
-    uint8_t ret = emu->delay_timer;
+    uint8_t ret = _chip8emu_timer_delay(emu);
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_unlock(emu->mtx_timers);
+    mtx_unlock(emu->mtx_cpu);
 #endif /* CHIP8EMU_NO_THREAD */
     return ret;
 }
 
-static void _chip8emu_timer_delay_set(chip8emu* emu, uint8_t val)
+uint8_t chip8emu_get_sound_timer(chip8emu *emu)
 {
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_lock(emu->mtx_timers);
+    mtx_lock(emu->mtx_cpu);
 #endif /* CHIP8EMU_NO_THREAD */
-    emu->delay_timer = val;
+    uint8_t ret = _chip8emu_timer_sound(emu);
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_unlock(emu->mtx_timers);
+    mtx_unlock(emu->mtx_cpu);
 #endif /* CHIP8EMU_NO_THREAD */
+    return ret;
 }
 
-static void _chip8emu_timer_sound_set(chip8emu* emu, uint8_t val)
+static void _chip8emu_unpack_display(const uint64_t display[32], uint8_t *gfx)
+{
+    for (int y = 0; y < 32; ++y)
+        for (int x = 0; x < 64; ++x)
+            gfx[y * 64 + x] = (display[y] >> (63 - x)) & 1;
+}
+
+static void _chip8emu_draw(chip8emu* emu)
 {
+    if (emu->vblank_draw) {
+        emu->_draw_pending = true; /* delivered by _chip8emu_vblank */
+        return;
+    }
+    emu->_run_flags |= C8_RUNF_DRAW;
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_lock(emu->mtx_timers);
+    _chip8emu_publish(emu); /* the frontend reads the snapshot once notified */
 #endif /* CHIP8EMU_NO_THREAD */
-    emu->sound_timer = val;
+    if (emu->draw)
+        emu->draw(emu);
+}
+
+/* end of a timer tick: one draw for all display changes since the previous one */
+static void _chip8emu_vblank(chip8emu* emu)
+{
+    if (emu->_draw_pending) {
+        emu->_draw_pending = false;
 #ifndef CHIP8EMU_NO_THREAD
-    mtx_unlock(emu->mtx_timers);
+        _chip8emu_publish(emu);
 #endif /* CHIP8EMU_NO_THREAD */
+        if (emu->draw)
+            emu->draw(emu);
+    }
+}
+
+static bool _chip8emu_key_pressed(chip8emu* emu, uint8_t key)
+{
+    uint16_t bit = 1u << (key & 0xF);
+    bool pressed;
+    if (emu->_movie && ((_chip8emu_movie*) emu->_movie)->playing)
+        return (_chip8emu_movie_replay_keys(emu) & bit) != 0;
+    if (emu->keystate) {
+        pressed = emu->keystate(emu, key);
+    } else {
+        pressed = (_chip8emu_keys(emu) & bit) != 0;
+        emu->_keys_unseen &= ~bit;
+    }
+    if (emu->_movie)
+        _chip8emu_movie_record_keys(emu, bit, pressed ? bit : 0);
+    return pressed;
 }
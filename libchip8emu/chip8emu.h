@@ -7,8 +7,72 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define C8ERR_OK 0
+#define C8ERR_FILE 1
+#define C8ERR_BAD_OPCODE 2
+#define C8ERR_STATE 3       /* save state truncated, corrupt or of another version */
+#define C8ERR_DESYNC 4      /* movie replay diverged from the recording */
+
+/* chip8emu.log_level, levels of the log callback */
+enum { C8E_LOG_DEBUG, C8E_LOG_INFO, C8E_LOG_WARN, C8E_LOG_ERR, C8E_LOG_FATAL };
+
+/* chip8emu_save_state() format */
+#define C8STATE_VERSION 1
+#define C8STATE_MAX_SIZE 4608   /* fits any state, zero memory pages and display rows are not stored */
+#define C8MOVIE_VERSION 1
+#define C8TRACE_VERSION 1
+#define C8TRACE_FAULTED 0x01    /* trace header flags: the last instruction faulted */
+
+/* chip8emu.quirks */
+#define C8QUIRK_DISPLAY_WAIT 0x01   /* VIP: DXYN waits for the next timer tick (vblank) */
+
+/* chip8emu_run_frame() return codes */
+enum {
+    C8RUN_FRAME_DONE,   /* frame completed, timers ticked */
+    C8RUN_DRAW,         /* display changed, frame not completed yet */
+    C8RUN_KEY_WAIT,     /* FX0A is waiting for a key, rest of the frame skipped */
+    C8RUN_FAULT         /* unknown opcode, pc points to faulty instruction */
+};
+
+/* superinstructions of the dispatch engine, see chip8emu_get_fusion_stats() */
+enum {
+    C8FUSE_LOAD_SKIP,   /* 6XNN then 3XNN/4XNN/5XY0/9XY0 */
+    C8FUSE_DELAY_LOOP,  /* FX07 then 3XNN then 1NNN back to FX07 */
+    C8FUSE_SPRITE,      /* ANNN then DXYN */
+    C8FUSE_COUNT
+};
+
+/* instructions counted by chip8emu_get_opcode_stats() */
+enum {
+    C8OP_00E0, C8OP_00EE, C8OP_1NNN, C8OP_2NNN, C8OP_3XNN, C8OP_4XNN, C8OP_5XY0,
+    C8OP_6XNN, C8OP_7XNN, C8OP_8XY0, C8OP_8XY1, C8OP_8XY2, C8OP_8XY3, C8OP_8XY4,
+    C8OP_8XY5, C8OP_8XY6, C8OP_8XY7, C8OP_8XYE, C8OP_9XY0, C8OP_ANNN, C8OP_BNNN,
+    C8OP_CXNN, C8OP_DXYN, C8OP_EX9E, C8OP_EXA1, C8OP_FX07, C8OP_FX0A, C8OP_FX15,
+    C8OP_FX18, C8OP_FX1E, C8OP_FX29, C8OP_FX33, C8OP_FX55, C8OP_FX65,
+    C8OP_0NNN,          /* and any other opcode accepted by a replaced opcode_handlers entry */
+    C8OP_COUNT
+};
+
+#define C8OPSTAT_BUCKETS    16
+
+typedef struct {
+    uint64_t  count;        /* executions */
+    uint64_t  samples;      /* executions timed */
+    uint64_t  ticks;        /* timestamp counter ticks of the timed executions */
+    uint64_t  histogram[C8OPSTAT_BUCKETS]; /* timed executions by ticks: bucket b from 2^b to 2^(b+1) - 1, 0 and 1 in the first, the last is open */
+} chip8emu_opstat;
+
+/* chip8emu_profile flags of a memory byte */
+#define C8PROF_CODE     0x01    /* fetched as part of an executed instruction */
+#define C8PROF_DATA     0x02    /* read by DXYN or FX65 */
+#define C8PROF_WRITTEN  0x04    /* written by FX33 or FX55 */
+
+typedef struct {
+    uint64_t  exec[4096];   /* instructions executed at each address */
+    uint8_t   flags[4096];  /* C8PROF_* of each byte */
+} chip8emu_profile;
 
 typedef struct chip8emu_snapshot chip8emu_snapshot;
 typedef struct chip8emu chip8emu;
@@ -21,6 +85,8 @@ struct chip8emu_snapshot {
     uint16_t  pc;           /* program counter */
 
     uint8_t   gfx[64 * 32];
+    uint64_t  display[32];  /* packed rows, bit 63 is x = 0 */
+    uint32_t  dirty_rows;   /* rows changed since the previous snapshot, bit n is row n */
 
     uint8_t   delay_timer;
     uint8_t   sound_timer;
@@ -32,53 +98,88 @@ struct chip8emu_snapshot {
 struct chip8emu
 {
     uint8_t   memory[4096];
-    uint8_t   gfx[64 * 32];
+    uint64_t  display[32];  /* one row per word, bit 63 is x = 0 */
+    uint8_t   gfx[64 * 32]; /* byte per pixel view of display, refreshed by chip8emu_gfx() */
     uint8_t   V[16];        /* registers from V0 .. VF */
 
     uint16_t  I;            /* index register */
     uint16_t  pc;           /* program counter */
     uint16_t  opcode;
 
-    uint8_t   delay_timer;
-    uint8_t   sound_timer;
+    uint8_t   delay_timer;  /* value written at tick _delay_since, current one: chip8emu_get_delay_timer */
+    uint8_t   sound_timer;  /* value written at tick _sound_since, current one: chip8emu_get_sound_timer */
 
     uint16_t  stack[16];
     uint16_t  sp;           /* stack pointer */
 
+    uint64_t  cycles;       /* number of executed instructions */
+    uint64_t  idle_cycles;  /* part of cycles spent in idle loops, skipped or parked */
+    long      _frame_cycles;  /* cycles executed in current frame */
+    uint8_t   _idle_period;   /* instructions per iteration of the detected idle loop */
+    uint64_t  _timer_ticks;   /* number of chip8emu_timer_tick calls, the clock of the timers */
+    uint64_t  _delay_since;   /* _timer_ticks when delay_timer was written */
+    uint64_t  _sound_since;
+    uint64_t  _vt_frac;       /* remainder of the virtual time frame lengths, in millihz */
+    uint8_t   _run_flags;     /* events raised by the last executed instruction */
+    bool      _gfx_stale;     /* display changed since gfx was expanded */
+    uint32_t  _dirty_rows;    /* display rows changed since last consumed */
+    void*     _snapshots;     /* published snapshots, once a reader asked for one */
+    void*     _decode_cache;  /* predecoded instructions of chip8emu_run_* */
+    void*     _jit;           /* translated regions of chip8emu_run_*, CHIP8EMU_JIT builds */
+    void*     _rewind;        /* history of chip8emu_set_rewind */
+    void*     _movie;         /* movie being recorded or replayed */
+    void*     _opstats;       /* per instruction counters, CHIP8EMU_OPSTATS builds */
+    void*     _profile;       /* per address counters, CHIP8EMU_PROFILE builds */
+    void*     _trace;         /* last executed instructions, chip8emu_set_trace */
+    void*     _log_ring;      /* messages waiting for chip8emu_drain_log */
+
+    bool      vblank_draw;  /* call draw at most once per timer tick instead of on every DXYN/00E0 */
+    uint8_t   quirks;       /* C8QUIRK_* */
+    bool      _draw_pending;  /* display changed since the last vblank, vblank_draw mode */
+
     /* opcode handling functions, can be overrided */
     int  (*opcode_handlers[0x10])(chip8emu *);
     
-    /* random number generator */
+    /* random number generator, NULL (default): built-in xorshift, see chip8emu_seed */
     int (*rand)(void);
+    uint32_t  _rng;         /* state of the built-in generator */
     
     /* API callbacks */
     void (*draw)(chip8emu *);
     bool (*keystate)(chip8emu *, uint8_t);
     void (*beep)(chip8emu *);
     void (*log)(chip8emu *, int log_level, const char *file, int line, const char* message);
+    int       log_level;    /* C8E_LOG_*, messages below it are dropped before being formatted (C8E_LOG_INFO) */
+
+    /* built-in input of chip8emu_key_down/up, used while keystate is not set */
+    bool      key_events;   /* queue key edges: a tap shorter than the game's polling is still seen */
+    uint16_t  _keys;        /* held keys, bit k is key k, atomic */
+    uint16_t  _cpu_keys;    /* keys as the cpu sees them in key_events mode */
+    uint16_t  _keys_unseen; /* pressed by an event, not read by any key instruction yet */
+    uint8_t   _key_queue[32]; /* edge events, single producer single consumer */
+    uint8_t   _key_head;    /* written by the cpu */
+    uint8_t   _key_tail;    /* written by the host */
+    bool      _key_overflow;
 
 #ifndef CHIP8EMU_NO_THREAD
     bool paused;
 
-    void* _cpu_clk_delay;     /* struct timespec */
-    void* _timer_clk_delay;   /* struct timespec */
-
-    /* clock threads */
-    void* thrd_clk_timers;
-    void* thrd_clk_cpu;
-    /* emulation threads */
-    void* thrd_cpu_cycle;
-    void* thrd_timer_tick;
+    void* _cpu_clock;         /* drift-free clocks, protected by mtx_cpu */
+    void* _timer_clock;
 
     /* mutexes */
     void* mtx_cpu;
-    void* mtx_timers;
     void* mtx_pause;
-    /* conditional signals */
-    void* cnd_clk_timers;
-    void* cnd_clk_cpu;
-    void* cnd_resume_cpu;
-    void* cnd_resume_timers;
+
+    /* cpu and timers run as slices on the shared worker pool */
+    void* _task;
+    bool _cpu_waiting;        /* idle loop or vblank wait, sleeps until the next timer tick, protected by mtx_cpu */
+    bool _key_blocked;        /* cpu waits in FX0A, protected by mtx_cpu */
+
+    /* virtual time, protected by mtx_cpu */
+    bool _virtual_time;       /* timer ticks every cpu / timer speed instructions */
+    uint32_t _time_scale;     /* frames paced at this many 1/1000 of real time, 0: unthrottled */
+    void* _pace_clock;
 #endif /* CHIP8EMU_NO_THREAD */
 };
 
@@ -87,28 +188,187 @@ void chip8emu_free(chip8emu*);
 int chip8emu_load_code(chip8emu *emu, uint8_t* code, long code_size);
 int chip8emu_load_rom(chip8emu* emu, const char* filename);
 void chip8emu_exec_cycle(chip8emu *emu);
+/* call after writing to emu->memory directly, drops predecoded instructions */
+void chip8emu_invalidate_code(chip8emu *emu, uint16_t addr, uint16_t len);
 void chip8emu_timer_tick(chip8emu *emu);
 
+/**
+  * headless execution, do not mix with chip8emu_start threads
+  * run_cycles: execute up to n instructions, stop early on fault
+  *     returns number of executed instructions
+  * run_frame: execute until cycles_per_frame instructions of current frame
+  *     are done then tick timers, returns C8RUN_* code; on C8RUN_DRAW the
+  *     next call continues the same frame. Idle loops (jump to self, delay
+  *     timer polling) are fast-forwarded to the end of the frame
+  **/
+long chip8emu_run_cycles(chip8emu *emu, long n);
+int chip8emu_run_frame(chip8emu *emu, long cycles_per_frame);
+/* seeds the built-in random number generator (1 by default), same generator as chip8emu_batch lanes */
+void chip8emu_seed(chip8emu *emu, uint32_t seed);
+/* expands display into emu->gfx if it changed and returns it; with threads use chip8emu_take_snapshot */
+uint8_t* chip8emu_gfx(chip8emu *emu);
+/* current timer values, computed from the number of timer ticks since they were set; not from callbacks with threads */
+uint8_t chip8emu_get_delay_timer(chip8emu *emu);
+uint8_t chip8emu_get_sound_timer(chip8emu *emu);
+/* idle_cycles / cycles */
+double chip8emu_get_idle_ratio(chip8emu *emu);
+/* executions of each C8FUSE_* superinstruction, all zero without CHIP8EMU_THREADED_DISPATCH */
+void chip8emu_get_fusion_stats(chip8emu *emu, uint64_t counts[C8FUSE_COUNT]);
+/* execution counts and sampled timestamp counter costs of each C8OP_* instruction,
+   false and all zero unless built with CHIP8EMU_OPSTATS */
+bool chip8emu_get_opcode_stats(chip8emu *emu, chip8emu_opstat stats[C8OP_COUNT]);
+void chip8emu_reset_opcode_stats(chip8emu *emu);
+/* "00E0" ... "FX65", "0NNN" */
+const char* chip8emu_opcode_name(int op);
+/* executions per address and code/data use of each memory byte since the emulator was created,
+   false and all zero unless built with CHIP8EMU_PROFILE */
+bool chip8emu_get_profile(chip8emu *emu, chip8emu_profile *profile);
+void chip8emu_reset_profile(chip8emu *emu);
+
+/**
+  * built-in input, from one input thread: EX9E, EXA1 and FX0A read an atomic
+  * key mask instead of calling keystate for every check
+  * with key_events set, presses and releases are also queued and applied in
+  * order: a key released before any key instruction read it stays down until
+  * one did or until the next timer tick
+  **/
+void chip8emu_key_down(chip8emu *emu, uint8_t key);
+void chip8emu_key_up(chip8emu *emu, uint8_t key);
+
 #ifndef CHIP8EMU_NO_THREAD
-/* */
+/**
+  * started emulators are run by a pool of worker threads shared by the process
+  * set_worker_threads: pool size, call before the first chip8emu_start;
+  *     0 (default) is one worker per core
+  **/
+void chip8emu_set_worker_threads(int count);
 void chip8emu_start(chip8emu *emu);
+/* runs the emulator in the calling thread instead of the pool until chip8emu_pause, do not mix with chip8emu_start */
+void chip8emu_run_realtime(chip8emu *emu);
 void chip8emu_pause(chip8emu *emu);
 void chip8emu_resume(chip8emu *emu);
 void chip8emu_reset(chip8emu *emu);
 
 void chip8emu_set_cpu_speed(chip8emu *emu, long speed_in_hz);
+/* 1/1000 Hz resolution, for speeds below 1Hz or between whole Hz */
+void chip8emu_set_cpu_speed_millihz(chip8emu *emu, uint64_t speed_in_millihz);
 long chip8emu_get_cpu_speed(chip8emu *emu);
 void chip8emu_set_timer_speed(chip8emu *emu, long speed_in_hz);
 long chip8emu_get_timer_speed(chip8emu *emu);
 
+/**
+  * virtual time: the timer ticks after every cpu speed / timer speed executed
+  * instructions, as with chip8emu_run_frame, instead of by the wall clock, so
+  * the same ROM and input give the same frames on every run
+  * set_time_scale: pace of virtual time in 1/1000 of real time (1000 default,
+  *     2000 is twice as fast), 0 runs as fast as the host allows
+  **/
+void chip8emu_set_virtual_time(chip8emu *emu, bool enabled);
+void chip8emu_set_time_scale(chip8emu *emu, uint32_t permille);
+
+/* a key was pressed, wakes the cpu if it is blocked on FX0A (otherwise re-polled every timer tick); chip8emu_key_down does it */
+void chip8emu_key_notify(chip8emu *emu);
+
 #endif /* CHIP8EMU_NO_THREAD */
 
 /**
-  * can be use with thread or without thread 
-  * with threads: do not use take_snapshot inside of any API callback function
+  * save states: cpu, memory, display, timers, built-in random generator,
+  * quirks and the keys seen by the cpu, in a versioned little-endian format
+  * where zero memory pages and display rows are skipped
+  * save_state: returns the size written to buf, 0 if size is too small
+  *     (C8STATE_MAX_SIZE always fits)
+  * load_state: C8ERR_OK, or C8ERR_STATE and the emulator is left untouched;
+  *     the keys held by the host are kept, speeds and callbacks too
+  * *_file: one state per file, C8ERR_FILE if it cannot be opened or written
+  * with threads: callable while the emulator runs, not from API callbacks
+  **/
+size_t chip8emu_save_state(chip8emu *emu, uint8_t *buf, size_t size);
+int chip8emu_load_state(chip8emu *emu, const uint8_t *buf, size_t size);
+int chip8emu_save_state_file(chip8emu *emu, const char *filename);
+int chip8emu_load_state_file(chip8emu *emu, const char *filename);
+
+/**
+  * rewind: with a history of size bytes (0, the default, turns it off) the
+  * state is captured at the end of every timer tick, stored as the packed
+  * difference with the next frame; the oldest frames are dropped once full
+  * rewind: steps back up to frames frames (0: to the start of the current
+  *     one) and returns how many, the history before them is kept
+  * get_rewind_frames: number of frames that can be stepped back
+  * with threads: pause the emulator while stepping back, not from callbacks
+  **/
+void chip8emu_set_rewind(chip8emu *emu, size_t size);
+long chip8emu_rewind(chip8emu *emu, long frames);
+long chip8emu_get_rewind_frames(chip8emu *emu);
+
+/**
+  * input movies
+  * record_movie: saves the current state into a new movie, then records every
+  *     key value read by the cpu with its cycle number and a display hash
+  *     every 60 frames; frames are cpu_millihz / timer_millihz instructions,
+  *     record in virtual time or in a chip8emu_run_frame loop of that length.
+  *     Loading a state or rewinding drops the recording
+  * stop_movie: ends the recording, *movie receives it (free() it), returns
+  *     its size, 0 if nothing was recorded
+  * play_movie: headless, not on a started emulator: loads the movie state
+  *     and replays its frames as fast as possible, *frames receives how many
+  *     were replayed; C8ERR_DESYNC at the first hash that differs,
+  *     C8ERR_STATE if it is not a complete movie
+  **/
+void chip8emu_record_movie(chip8emu *emu, uint64_t cpu_millihz, uint64_t timer_millihz);
+size_t chip8emu_stop_movie(chip8emu *emu, uint8_t **movie);
+int chip8emu_play_movie(chip8emu *emu, const uint8_t *movie, size_t size, long *frames);
+int chip8emu_stop_movie_file(chip8emu *emu, const char *filename);
+int chip8emu_play_movie_file(chip8emu *emu, const char *filename, long *frames);
+
+/**
+  * instruction trace, CHIP8EMU_TRACE builds: a ring of 8 byte records of the
+  * last executed instructions (pc, opcode, then I, VX and VF after it)
+  * set_trace: keeps the last records instructions (rounded up to a power of
+  *     two, 0 turns it off), and dumps them to fault_file (if not NULL) when
+  *     an instruction faults; false without CHIP8EMU_TRACE
+  * dump_trace: writes the records, oldest first, and the faulting instruction
+  *     if any to buf, returns the size written, 0 if size is too small or
+  *     nothing is traced; with buf NULL returns the size needed
+  * dump_trace_file: C8ERR_FILE if it cannot be written or nothing is traced
+  * dump layout, little endian: "C8TR", C8TRACE_VERSION, flags (C8TRACE_FAULTED),
+  *     u16 fault pc, u16 fault opcode, u32 record count, u16 0, then u64
+  *     records pc | opcode << 16 | I << 32 | VX << 48 | VF << 56
+  * tools/chip8emu-trace disassembles the dumps
+  **/
+bool chip8emu_set_trace(chip8emu *emu, size_t records, const char *fault_file);
+size_t chip8emu_dump_trace(chip8emu *emu, uint8_t *buf, size_t size);
+int chip8emu_dump_trace_file(chip8emu *emu, const char *filename);
+
+/**
+  * deferred logging: with a log ring, messages are queued with their format
+  * and arguments instead of being formatted and passed to log by the thread
+  * that raised them, the emulation thread most of the time
+  * set_log_ring: room for entries messages (rounded up to a power of two, 0
+  *     turns it off and messages go to log again), call while no emulation
+  *     thread is running; messages raised while the ring is full are dropped
+  *     and counted
+  * drain_log: from one consumer thread, formats up to max messages (0: all)
+  *     and passes them to log, oldest first, preceded by a warning with the
+  *     number of messages dropped if any; returns how many were passed
+  * %s arguments are copied into the ring (96 bytes per message for them all),
+  * the format and file strings must stay valid until drained
+  **/
+void chip8emu_set_log_ring(chip8emu *emu, size_t entries);
+int chip8emu_drain_log(chip8emu *emu, int max);
+
+/**
+  * can be use with thread or without thread, from one reader thread
+  * the running emulator publishes its state after each draw and each slice,
+  * the reader gets the latest publication without blocking the emulation
+  * acquire_snapshot: zero-copy, valid until the next acquire or take call
+  * take_snapshot: copies it into snapshot
+  * with threads: do not use them inside of any API callback function
   * it's very likely to create thread deadlocks
   **/
+const chip8emu_snapshot* chip8emu_acquire_snapshot(chip8emu *emu);
 void chip8emu_take_snapshot(chip8emu *emu, chip8emu_snapshot* snapshot);
+/* rows changed since the previous call (bit n is row n), only without snapshots: they take the rows */
+uint32_t chip8emu_consume_dirty_rows(chip8emu *emu);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chip8emu_batch.h"
+#include "chip8emu_ops.h"
+
+/*
+ * Running lanes are kept in groups sharing a pc, each step executes every
+ * group with one decode. A group splits when its lanes take different paths
+ * and groups meeting at the same pc merge again. While all lanes share the pc
+ * (the common case for copies fed with different inputs) the step is a single
+ * group over contiguous lanes and the instruction loops vectorize. Lanes
+ * running code they wrote themselves are executed one by one.
+ *
+ * The instructions are the C8_BODY_* statements of chip8emu_ops.h, also
+ * expanded by chip8emu.c, over the registers of lane l.
+ */
+
+/* chip8emu.c: bit h set when opcode_handlers[h] was replaced */
+uint16_t _chip8emu_overridden_handlers(const chip8emu *emu);
+
+/* runs stmt for every lane l of the group, lanes == NULL: lanes 0 .. count - 1 */
+#define C8B_LANES(stmt) do {                                            \
+        if (lanes == NULL) {                                            \
+            for (uint32_t l = 0; l < count; ++l) { stmt; }              \
+        } else {                                                        \
+            for (uint32_t k = 0; k < count; ++k) {                      \
+                uint32_t l = lanes[k]; stmt;                            \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+static inline uint8_t _chip8emu_batch_read(chip8emu_batch *b, uint32_t l, uint16_t addr)
+{
+    addr &= 0xFFF;
+    return b->_pages[l * 16 + (addr >> 8)][addr & 0xFF];
+}
+
+static void _chip8emu_batch_write(chip8emu_batch *b, uint32_t l, uint16_t addr, uint8_t val)
+{
+    addr &= 0xFFF;
+    uint16_t page = addr >> 8;
+    if (!(b->_private[l] & (1u << page))) {
+        uint8_t *copy = malloc(256);
+        memcpy(copy, b->_image + page * 256, 256);
+        b->_pages[l * 16 + page] = copy;
+        b->_private[l] |= 1u << page;
+        b->_private_any |= 1u << page;
+    }
+    b->_pages[l * 16 + page][addr & 0xFF] = val;
+}
+
+/* pages holding the instruction at pc */
+static inline uint16_t _chip8emu_batch_code_pages(uint16_t pc)
+{
+    return (uint16_t) (1u << ((pc & 0xFFF) >> 8) | 1u << (((pc + 1) & 0xFFF) >> 8));
+}
+
+static inline uint16_t _chip8emu_batch_fetch(chip8emu_batch *b, uint32_t l, uint16_t pc)
+{
+    return (uint16_t) (_chip8emu_batch_read(b, l, pc) << 8 | _chip8emu_batch_read(b, l, pc + 1));
+}
+
+/* a lane writing data next to the code still runs the shared instruction at pc */
+static inline bool _chip8emu_batch_shared_code(chip8emu_batch *b, uint32_t l, uint16_t pc)
+{
+    return !(b->_private[l] & _chip8emu_batch_code_pages(pc))
+        || _chip8emu_batch_fetch(b, l, pc) == (b->_image[pc & 0xFFF] << 8 | b->_image[(pc + 1) & 0xFFF]);
+}
+
+static inline uint8_t _chip8emu_batch_first_key(chip8emu_batch *b, uint32_t l)
+{
+    for (uint8_t i = 0; i < 0x10; i++) {
+        if (b->keys[l] & (1u << i))
+            return i;
+    }
+    return 0x10;
+}
+
+static inline bool _chip8emu_batch_key(chip8emu_batch *b, uint32_t l, uint8_t key)
+{
+    return key < 0x10 && (b->keys[l] & (1u << key));
+}
+
+/* accessors of the C8_BODY_* statements, lane l; a lane keeps executing FX0A until a key is pressed */
+#define C8_V(r)             b->V[r][l]
+#define C8_I                b->I[l]
+#define C8_PC               b->pc[l]
+#define C8_SP               b->sp[l]
+#define C8_STACK(i)         b->stack[l * 16 + (i)]
+#define C8_READ(addr)       _chip8emu_batch_read(b, l, (uint16_t) (addr))
+#define C8_WRITE(addr, val) _chip8emu_batch_write(b, l, (uint16_t) (addr), (uint8_t) (val))
+#define C8_DISPLAY(row)     b->display[l * 32 + (row)]
+#define C8_DRAWN(row, bits) ((void) 0)
+#define C8_DELAY()          b->delay_timer[l]
+#define C8_SET_DELAY(v)     (b->delay_timer[l] = (v))
+#define C8_SET_SOUND(v)     (b->sound_timer[l] = (v))
+#define C8_KEY(k)           _chip8emu_batch_key(b, l, k)
+#define C8_FIRST_KEY()      _chip8emu_batch_first_key(b, l)
+#define C8_KEY_WAIT()       ((void) 0)
+#define C8_RAND()           _chip8emu_xorshift(&b->rng[l])
+
+/* executes opcode on a group of lanes, returns false if it is unknown (the lanes are faulted) */
+static bool _chip8emu_batch_exec(chip8emu_batch *b, uint16_t opcode, const uint32_t *lanes, uint32_t count)
+{
+    uint8_t x = C8_X(opcode), y = C8_Y(opcode), nn = C8_NN(opcode);
+    uint16_t nnn = C8_NNN(opcode);
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0)
+            C8B_LANES(C8_BODY_00E0());
+        else if (opcode == 0x00EE)
+            C8B_LANES(C8_BODY_00EE());
+        else
+            return false;
+        break;
+    case 0x1: C8B_LANES(C8_BODY_1NNN(nnn)); break;
+    case 0x2: C8B_LANES(C8_BODY_2NNN(nnn)); break;
+    case 0x3: C8B_LANES(C8_BODY_3XNN(x, nn)); break;
+    case 0x4: C8B_LANES(C8_BODY_4XNN(x, nn)); break;
+    case 0x5: C8B_LANES(C8_BODY_5XY0(x, y)); break;
+    case 0x6: C8B_LANES(C8_BODY_6XNN(x, nn)); break;
+    case 0x7: C8B_LANES(C8_BODY_7XNN(x, nn)); break;
+    case 0x8:
+        switch (opcode & 0x000F) {
+        case 0x0: C8B_LANES(C8_BODY_8XY0(x, y)); break;
+        case 0x1: C8B_LANES(C8_BODY_8XY1(x, y)); break;
+        case 0x2: C8B_LANES(C8_BODY_8XY2(x, y)); break;
+        case 0x3: C8B_LANES(C8_BODY_8XY3(x, y)); break;
+        case 0x4: C8B_LANES(C8_BODY_8XY4(x, y)); break;
+        case 0x5: C8B_LANES(C8_BODY_8XY5(x, y)); break;
+        case 0x6: C8B_LANES(C8_BODY_8XY6(x)); break;
+        case 0x7: C8B_LANES(C8_BODY_8XY7(x, y)); break;
+        case 0xE: C8B_LANES(C8_BODY_8XYE(x)); break;
+        default: return false;
+        }
+        break;
+    case 0x9: C8B_LANES(C8_BODY_9XY0(x, y)); break;
+    case 0xA: C8B_LANES(C8_BODY_ANNN(nnn)); break;
+    case 0xB: C8B_LANES(C8_BODY_BNNN(nnn)); break;
+    case 0xC: C8B_LANES(C8_BODY_CXNN(x, nn)); break;
+    case 0xD: C8B_LANES(C8_BODY_DXYN(x, y, C8_N(opcode))); break;
+    case 0xE:
+        if (nn == 0x9E)
+            C8B_LANES(C8_BODY_EX9E(x));
+        else if (nn == 0xA1)
+            C8B_LANES(C8_BODY_EXA1(x));
+        else
+            return false;
+        break;
+    case 0xF:
+        switch (nn) {
+        case 0x07: C8B_LANES(C8_BODY_FX07(x)); break;
+        case 0x0A: C8B_LANES(C8_BODY_FX0A(x)); break;
+        case 0x15: C8B_LANES(C8_BODY_FX15(x)); break;
+        case 0x18: C8B_LANES(C8_BODY_FX18(x)); break;
+        case 0x1E: C8B_LANES(C8_BODY_FX1E(x)); break;
+        case 0x29: C8B_LANES(C8_BODY_FX29(x)); break;
+        case 0x33: C8B_LANES(C8_BODY_FX33(x)); break;
+        case 0x55: C8B_LANES(C8_BODY_FX55(x)); break;
+        case 0x65: C8B_LANES(C8_BODY_FX65(x)); break;
+        default:
+            return false;
+        }
+        break;
+    }
+    return true;
+}
+
+static void _chip8emu_batch_fault(chip8emu_batch *b, const uint32_t *lanes, uint32_t count)
+{
+    C8B_LANES(b->status[l] = C8RUN_FAULT);
+}
+
+/* counting sort of the running lanes into one group per pc, drops faulted lanes */
+static void _chip8emu_batch_regroup(chip8emu_batch *b)
+{
+    uint32_t kept = 0, used = 0;
+    for (uint32_t k = 0; k < b->_active_count; ++k) {
+        uint32_t l = b->_active[k];
+        if (b->status[l] == C8RUN_FAULT)
+            continue;
+        b->_active[kept++] = l;
+        uint16_t pc = b->pc[l] & 0xFFF;
+        if (b->_pc_count[pc]++ == 0)
+            b->_pc_used[used++] = pc;
+    }
+    b->_active_count = kept;
+
+    uint32_t offset = 0;
+    for (uint32_t g = 0; g < used; ++g) {
+        uint16_t pc = b->_pc_used[g];
+        b->_group_start[g] = offset;
+        b->_group_size[g] = b->_pc_count[pc];
+        b->_pc_count[pc] = g; /* becomes the group of pc */
+        offset += b->_group_size[g];
+    }
+    for (uint32_t g = 0; g < used; ++g)
+        b->_group_size[g] = 0;
+    for (uint32_t k = 0; k < kept; ++k) {
+        uint32_t l = b->_active[k];
+        uint32_t g = b->_pc_count[b->pc[l] & 0xFFF];
+        b->_order[b->_group_start[g] + b->_group_size[g]++] = l;
+    }
+    for (uint32_t g = 0; g < used; ++g)
+        b->_pc_count[b->_pc_used[g]] = 0;
+
+    b->_group_count = used;
+    /* _active is in lane order, a single group of every lane is lanes 0 .. n - 1 */
+    b->_converged = used == 1 && kept == b->lanes;
+}
+
+/*
+ * Executes group g, lanes whose own copy of the code differs run alone.
+ * Returns false if lanes of the group faulted.
+ */
+static bool _chip8emu_batch_exec_group(chip8emu_batch *b, uint32_t g)
+{
+    uint32_t *group = b->_order + b->_group_start[g];
+    uint32_t size = b->_group_size[g];
+    uint16_t pc = b->pc[group[0]] & 0xFFF;
+    uint16_t opcode = (uint16_t) (b->_image[pc] << 8 | b->_image[(pc + 1) & 0xFFF]);
+    bool ok = true;
+
+    b->groups++;
+    if (b->_private_any & _chip8emu_batch_code_pages(pc)) {
+        uint32_t shared = 0;
+        for (uint32_t k = 0; k < size; ++k) {
+            uint32_t l = group[k];
+            if (_chip8emu_batch_shared_code(b, l, pc)) {
+                b->_scratch[shared++] = l;
+            } else if (!_chip8emu_batch_exec(b, _chip8emu_batch_fetch(b, l, pc), &group[k], 1)) {
+                _chip8emu_batch_fault(b, &group[k], 1);
+                ok = false;
+            }
+        }
+        if (shared && !_chip8emu_batch_exec(b, opcode, b->_scratch, shared)) {
+            _chip8emu_batch_fault(b, b->_scratch, shared);
+            ok = false;
+        }
+        return ok;
+    }
+
+    if (!_chip8emu_batch_exec(b, opcode, b->_converged ? NULL : group, size)) {
+        _chip8emu_batch_fault(b, group, size);
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * Splits group g if its lanes took different paths. Two targets (a skip,
+ * FX0A, a key test) are split in place into a new group, returns false if
+ * there are more and the lanes have to be regrouped.
+ */
+static bool _chip8emu_batch_split_group(chip8emu_batch *b, uint32_t g)
+{
+    uint32_t *group = b->_order + b->_group_start[g];
+    uint32_t size = b->_group_size[g];
+    uint16_t pc0 = b->pc[group[0]] & 0xFFF;
+    uint32_t k = 1;
+
+    while (k < size && (b->pc[group[k]] & 0xFFF) == pc0)
+        ++k;
+    if (k == size)
+        return true;
+
+    uint32_t head = k;
+    uint16_t pc1 = b->pc[group[k]] & 0xFFF;
+    for (; k < size; ++k) {
+        uint16_t pc = b->pc[group[k]] & 0xFFF;
+        if (pc == pc0) {
+            uint32_t l = group[k];
+            group[k] = group[head];
+            group[head++] = l;
+        } else if (pc != pc1) {
+            return false;
+        }
+    }
+    b->_group_start[b->_group_count] = b->_group_start[g] + head;
+    b->_group_size[b->_group_count] = size - head;
+    b->_group_count++;
+    b->_group_size[g] = head;
+    b->_converged = false;
+    return true;
+}
+
+/* one instruction on every running lane */
+static void _chip8emu_batch_step(chip8emu_batch *b)
+{
+    uint32_t groups = b->_group_count;
+    bool regroup = false;
+
+    for (uint32_t g = 0; g < groups; ++g) {
+        if (!_chip8emu_batch_exec_group(b, g))
+            regroup = true;
+        else if (!regroup && !_chip8emu_batch_split_group(b, g))
+            regroup = true;
+    }
+
+    /* groups arriving at the same pc merge again */
+    for (uint32_t g = 0; g < b->_group_count && !regroup; ++g) {
+        uint16_t pc = b->pc[b->_order[b->_group_start[g]]] & 0xFFF;
+        if (b->_pc_count[pc])
+            regroup = true;
+        b->_pc_count[pc] = 1;
+    }
+    for (uint32_t g = 0; g < b->_group_count; ++g)
+        b->_pc_count[b->pc[b->_order[b->_group_start[g]]] & 0xFFF] = 0;
+
+    if (regroup)
+        _chip8emu_batch_regroup(b);
+}
+
+chip8emu_batch* chip8emu_batch_new(const chip8emu *tmpl, uint32_t lanes)
+{
+    /* lanes only implement the default instructions, they would diverge from tmpl */
+    if (tmpl->quirks || _chip8emu_overridden_handlers(tmpl))
+        return NULL;
+
+    chip8emu_batch *b = calloc(1, sizeof(chip8emu_batch));
+    b->lanes = lanes;
+
+    for (int x = 0; x < 16; ++x)
+        b->V[x] = malloc(lanes);
+    b->I = malloc(lanes * sizeof(uint16_t));
+    b->pc = malloc(lanes * sizeof(uint16_t));
+    b->sp = malloc(lanes * sizeof(uint16_t));
+    b->stack = malloc(lanes * 16 * sizeof(uint16_t));
+    b->delay_timer = malloc(lanes);
+    b->sound_timer = malloc(lanes);
+    b->display = malloc(lanes * 32 * sizeof(uint64_t));
+    b->keys = calloc(lanes, sizeof(uint16_t));
+    b->rng = malloc(lanes * sizeof(uint32_t));
+    b->status = calloc(lanes, 1);
+    b->_pages = malloc(lanes * 16 * sizeof(uint8_t*));
+    b->_private = calloc(lanes, sizeof(uint16_t));
+    b->_active = malloc(lanes * sizeof(uint32_t));
+    b->_order = malloc(lanes * sizeof(uint32_t));
+    b->_scratch = malloc(lanes * sizeof(uint32_t));
+    b->_group_start = malloc(lanes * sizeof(uint32_t));
+    b->_group_size = malloc(lanes * sizeof(uint32_t));
+
+    memcpy(b->_image, tmpl->memory, sizeof b->_image);
+    for (uint32_t l = 0; l < lanes; ++l) {
+        for (int x = 0; x < 16; ++x)
+            b->V[x][l] = tmpl->V[x];
+        b->I[l] = tmpl->I;
+        b->pc[l] = tmpl->pc;
+        b->sp[l] = tmpl->sp;
+        memcpy(b->stack + l * 16, tmpl->stack, sizeof tmpl->stack);
+        b->delay_timer[l] = chip8emu_get_delay_timer((chip8emu*) tmpl);
+        b->sound_timer[l] = chip8emu_get_sound_timer((chip8emu*) tmpl);
+        memcpy(b->display + l * 32, tmpl->display, sizeof tmpl->display);
+        for (int p = 0; p < 16; ++p)
+            b->_pages[l * 16 + p] = b->_image + p * 256;
+        b->_active[l] = l;
+        chip8emu_batch_seed(b, l, l + 1);
+    }
+    b->_active_count = lanes;
+    _chip8emu_batch_regroup(b);
+    return b;
+}
+
+void chip8emu_batch_free(chip8emu_batch *b)
+{
+    for (uint32_t l = 0; l < b->lanes; ++l) {
+        for (int p = 0; p < 16; ++p) {
+            if (b->_private[l] & (1u << p))
+                free(b->_pages[l * 16 + p]);
+        }
+    }
+    for (int x = 0; x < 16; ++x)
+        free(b->V[x]);
+    free(b->I);
+    free(b->pc);
+    free(b->sp);
+    free(b->stack);
+    free(b->delay_timer);
+    free(b->sound_timer);
+    free(b->display);
+    free(b->keys);
+    free(b->rng);
+    free(b->status);
+    free(b->_pages);
+    free(b->_private);
+    free(b->_active);
+    free(b->_order);
+    free(b->_scratch);
+    free(b->_group_start);
+    free(b->_group_size);
+    free(b);
+}
+
+void chip8emu_batch_seed(chip8emu_batch *b, uint32_t lane, uint32_t seed)
+{
+    b->rng[lane] = seed ? seed : 1; /* xorshift never leaves 0 */
+}
+
+long chip8emu_batch_run_cycles(chip8emu_batch *b, long n)
+{
+    long executed = 0;
+    for (long i = 0; i < n && b->_active_count; ++i) {
+        b->cycles++;
+        _chip8emu_batch_step(b);
+        executed += b->_active_count; /* faulted lanes did not execute */
+    }
+    return executed;
+}
+
+long chip8emu_batch_run_frame(chip8emu_batch *b, long cycles_per_frame)
+{
+    long executed = chip8emu_batch_run_cycles(b, cycles_per_frame);
+    chip8emu_batch_timer_tick(b);
+    return executed;
+}
+
+void chip8emu_batch_timer_tick(chip8emu_batch *b)
+{
+    for (uint32_t l = 0; l < b->lanes; ++l) {
+        b->delay_timer[l] -= b->delay_timer[l] > 0;
+        b->sound_timer[l] -= b->sound_timer[l] > 0;
+    }
+}
+
+void chip8emu_batch_get_lane(chip8emu_batch *b, uint32_t lane, chip8emu *emu)
+{
+    for (int p = 0; p < 16; ++p)
+        memcpy(emu->memory + p * 256, b->_pages[lane * 16 + p], 256);
+    chip8emu_invalidate_code(emu, 0, sizeof emu->memory);
+    for (int x = 0; x < 16; ++x)
+        emu->V[x] = b->V[x][lane];
+    emu->I = b->I[lane];
+    emu->pc = b->pc[lane];
+    emu->sp = b->sp[lane];
+    memcpy(emu->stack, b->stack + lane * 16, sizeof emu->stack);
+    emu->delay_timer = b->delay_timer[lane];
+    emu->sound_timer = b->sound_timer[lane];
+    emu->_delay_since = emu->_sound_since = emu->_timer_ticks;
+    memcpy(emu->display, b->display + lane * 32, sizeof emu->display);
+    emu->_gfx_stale = true;
+    emu->_dirty_rows = 0xFFFFFFFF;
+    emu->cycles = b->cycles;
+}
@@ -0,0 +1,80 @@
+#ifndef CHIP8EMU_BATCH_H_
+#define CHIP8EMU_BATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "chip8emu.h"
+
+/**
+  * lockstep engine running many copies of one program, headless
+  * every lane executes one instruction per step; lanes sharing a pc are
+  * executed together, one decode for the whole group, registers are stored
+  * one array per register (V[x][lane]) so group loops vectorize
+  **/
+
+typedef struct chip8emu_batch chip8emu_batch;
+
+struct chip8emu_batch
+{
+    uint32_t  lanes;
+
+    /* per lane state, structure of arrays indexed by lane */
+    uint8_t  *V[16];        /* V[x][lane] */
+    uint16_t *I;
+    uint16_t *pc;
+    uint16_t *sp;
+    uint16_t *stack;        /* 16 entries per lane */
+    uint8_t  *delay_timer;
+    uint8_t  *sound_timer;
+    uint64_t *display;      /* 32 packed rows per lane, bit 63 is x = 0 */
+    uint16_t *keys;         /* pressed keys, bit k is key k, set by the caller */
+    uint32_t *rng;          /* xorshift32 state of CXNN */
+    uint8_t  *status;       /* C8RUN_FAULT once the lane hit an unknown opcode */
+
+    uint64_t  cycles;       /* steps executed, every running lane executes one instruction per step */
+    uint64_t  groups;       /* decoded groups, groups / cycles is the average divergence */
+
+    /* memory: one shared image, 256 bytes pages are copied on a lane's first write */
+    uint8_t   _image[4096];
+    uint8_t **_pages;       /* 16 page pointers per lane, into _image or private */
+    uint16_t *_private;     /* private pages of each lane, bit p is page p */
+    uint16_t  _private_any; /* union of _private */
+
+    uint32_t *_active;      /* running lanes, in lane order */
+    uint32_t  _active_count;
+    uint32_t *_order;       /* running lanes, by group */
+    uint32_t *_group_start; /* groups of lanes sharing a pc, slices of _order */
+    uint32_t *_group_size;
+    uint32_t  _group_count;
+    bool      _converged;   /* one group of every lane, _order is 0 .. lanes - 1 */
+    uint32_t *_scratch;
+    uint32_t  _pc_count[4096];
+    uint16_t  _pc_used[4096];
+};
+
+/**
+  * lanes start as copies of tmpl (memory, registers, timers and display)
+  * they implement the default instructions only: NULL if tmpl has quirks set
+  * (C8QUIRK_DISPLAY_WAIT) or replaced opcode_handlers, which lanes would ignore
+  **/
+chip8emu_batch* chip8emu_batch_new(const chip8emu *tmpl, uint32_t lanes);
+void chip8emu_batch_free(chip8emu_batch *batch);
+/* CXNN generator of a lane, default seed is lane + 1 */
+void chip8emu_batch_seed(chip8emu_batch *batch, uint32_t lane, uint32_t seed);
+/* execute n steps, returns the number of instructions executed over all lanes */
+long chip8emu_batch_run_cycles(chip8emu_batch *batch, long n);
+/* cycles_per_frame steps then one timer tick, returns as run_cycles */
+long chip8emu_batch_run_frame(chip8emu_batch *batch, long cycles_per_frame);
+void chip8emu_batch_timer_tick(chip8emu_batch *batch);
+/* copy the state of a lane into emu, e.g. to inspect it with chip8emu_take_snapshot */
+void chip8emu_batch_get_lane(chip8emu_batch *batch, uint32_t lane, chip8emu *emu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHIP8EMU_BATCH_H_ */
@@ -0,0 +1,609 @@
+#define _GNU_SOURCE /* memfd_create */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "chip8emu_jit.h"
+
+#if !defined(__x86_64__)
+#error "CHIP8EMU_JIT only supports x86-64 hosts"
+#endif
+
+/*
+ * A region is the code reachable from its entry by falling through, skipping
+ * or jumping forward, over register-only instructions (6XNN, 7XNN, 8XYN,
+ * ANNN, FX1E, FX29, FX65), 3XNN/4XNN/5XY0/9XY0 skips and 1NNN jumps. It is
+ * translated into one host function: guest V[] and I live in host registers
+ * for the whole region, skips and jumps inside it are host branches and a
+ * jump back to an earlier instruction of the region loops without leaving
+ * native code. Everything else (calls, timers, keys, sprites, memory writes,
+ * overridden opcode_handlers) ends the region and is left to the interpreter.
+ *
+ * Generated functions follow the System V ABI:
+ *   uint32_t region(chip8emu *emu, uint32_t budget)
+ * emu stays in rdi, edx keeps the budget and ecx counts down what is left of
+ * it. The budget is checked on entry and on every backward jump, each check
+ * against the longest path to the next one, so a region never runs more
+ * instructions than it was given and chip8emu_run_cycles stays exact.
+ *
+ * The code buffer is one memfd mapped twice, writable and executable, so
+ * translating never changes page protections.
+ */
+
+#define C8_JIT_CODE_SIZE        (2 * 1024 * 1024)
+#define C8_JIT_MAX_BLOCKS       4096
+#define C8_JIT_MAX_BLOCK_BYTES  32768   /* upper bound of one translated region */
+#define C8_JIT_MIN_BLOCK_INSNS  2       /* shorter regions are cheaper to interpret */
+
+/* host registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* condition codes */
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+/* host registers guest V[] and I are allocated to, in order; esi holds the budget until the prologue copied it */
+static const uint8_t _jit_alloc_order[] = { RSI, R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15 };
+#define C8_JIT_REGS ((int) sizeof _jit_alloc_order)
+#define C8_JIT_REG_I 16 /* bit of I in register masks */
+
+#define OFF_MEMORY  ((uint32_t) offsetof(chip8emu, memory))
+#define OFF_V       ((uint32_t) offsetof(chip8emu, V))
+#define OFF_I       ((uint32_t) offsetof(chip8emu, I))
+#define OFF_PC      ((uint32_t) offsetof(chip8emu, pc))
+#define OFF_OPCODE  ((uint32_t) offsetof(chip8emu, opcode))
+
+#ifdef CHIP8EMU_JIT_PERF_MAP
+static FILE *_jit_perf_map = NULL;
+#endif /* CHIP8EMU_JIT_PERF_MAP */
+
+/* ******************** x86-64 encoder ******************** */
+
+static void _emit8(uint8_t **p, uint8_t b)
+{
+    *(*p)++ = b;
+}
+
+static void _emit16(uint8_t **p, uint16_t v)
+{
+    _emit8(p, v & 0xFF);
+    _emit8(p, v >> 8);
+}
+
+static void _emit32(uint8_t **p, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i)
+        _emit8(p, (v >> (8 * i)) & 0xFF);
+}
+
+/* REX prefix for ModRM.reg, SIB.index and ModRM.rm extensions, emitted only when needed unless forced */
+static void _emit_rex(uint8_t **p, int reg, int index, int rm, bool force)
+{
+    uint8_t rex = 0x40 | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((rm >> 3) & 1);
+    if (rex != 0x40 || force)
+        _emit8(p, rex);
+}
+
+static void _emit_modrm(uint8_t **p, int mod, int reg, int rm)
+{
+    _emit8(p, (uint8_t) ((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+/* op dst32, src32; op: 0x01 add, 0x09 or, 0x21 and, 0x29 sub, 0x31 xor, 0x39 cmp, 0x89 mov */
+static void _emit_rr(uint8_t **p, uint8_t op, int dst, int src)
+{
+    _emit_rex(p, src, 0, dst, false);
+    _emit8(p, op);
+    _emit_modrm(p, 3, src, dst);
+}
+
+/* op dst32, imm32; ext: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp */
+static void _emit_ri(uint8_t **p, int ext, int dst, uint32_t imm)
+{
+    _emit_rex(p, 0, 0, dst, false);
+    _emit8(p, 0x81);
+    _emit_modrm(p, 3, ext, dst);
+    _emit32(p, imm);
+}
+
+/* mov dst32, imm32 */
+static void _emit_mov_ri(uint8_t **p, int dst, uint32_t imm)
+{
+    _emit_rex(p, 0, 0, dst, false);
+    _emit8(p, (uint8_t) (0xB8 + (dst & 7)));
+    _emit32(p, imm);
+}
+
+/* shift dst32 by count; ext: 4 shl, 5 shr */
+static void _emit_shift(uint8_t **p, int ext, int dst, uint8_t count)
+{
+    _emit_rex(p, 0, 0, dst, false);
+    _emit8(p, 0xC1);
+    _emit_modrm(p, 3, ext, dst);
+    _emit8(p, count);
+}
+
+/* imul dst32, src32, imm8 */
+static void _emit_imul_ri8(uint8_t **p, int dst, int src, int8_t imm)
+{
+    _emit_rex(p, dst, 0, src, false);
+    _emit8(p, 0x6B);
+    _emit_modrm(p, 3, dst, src);
+    _emit8(p, (uint8_t) imm);
+}
+
+/* movzx dst32, byte/word [rdi + disp32] */
+static void _emit_load(uint8_t **p, int dst, uint32_t disp, bool word)
+{
+    _emit_rex(p, dst, 0, RDI, false);
+    _emit8(p, 0x0F);
+    _emit8(p, word ? 0xB7 : 0xB6);
+    _emit_modrm(p, 2, dst, RDI);
+    _emit32(p, disp);
+}
+
+/* movzx dst32, byte [rdi + index + disp32] */
+static void _emit_load_indexed(uint8_t **p, int dst, int index, uint32_t disp)
+{
+    _emit_rex(p, dst, index, RDI, false);
+    _emit8(p, 0x0F);
+    _emit8(p, 0xB6);
+    _emit_modrm(p, 2, dst, RSP); /* SIB follows */
+    _emit8(p, (uint8_t) (((index & 7) << 3) | (RDI & 7)));
+    _emit32(p, disp);
+}
+
+/* mov byte/word [rdi + disp32], src */
+static void _emit_store(uint8_t **p, int src, uint32_t disp, bool word)
+{
+    if (word)
+        _emit8(p, 0x66);
+    _emit_rex(p, src, 0, RDI, !word); /* REX selects sil/bpl instead of dh/ch */
+    _emit8(p, word ? 0x89 : 0x88);
+    _emit_modrm(p, 2, src, RDI);
+    _emit32(p, disp);
+}
+
+/* mov word [rdi + disp32], imm16: 9 bytes */
+static void _emit_store_imm16(uint8_t **p, uint32_t disp, uint16_t imm)
+{
+    _emit8(p, 0x66);
+    _emit8(p, 0xC7);
+    _emit_modrm(p, 2, 0, RDI);
+    _emit32(p, disp);
+    _emit16(p, imm);
+}
+
+static void _emit_push(uint8_t **p, int reg)
+{
+    _emit_rex(p, 0, 0, reg, false);
+    _emit8(p, (uint8_t) (0x50 + (reg & 7)));
+}
+
+static void _emit_pop(uint8_t **p, int reg)
+{
+    _emit_rex(p, 0, 0, reg, false);
+    _emit8(p, (uint8_t) (0x58 + (reg & 7)));
+}
+
+static bool _is_callee_saved(int reg)
+{
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+/* jcc rel32 or jmp rel32 (cc < 0), returns where the displacement goes */
+static uint8_t* _emit_branch(uint8_t **p, int cc)
+{
+    if (cc < 0) {
+        _emit8(p, 0xE9);
+    } else {
+        _emit8(p, 0x0F);
+        _emit8(p, (uint8_t) (0x80 + cc));
+    }
+    uint8_t *rel = *p;
+    _emit32(p, 0);
+    return rel;
+}
+
+static void _emit_patch(uint8_t *rel, const uint8_t *target)
+{
+    uint32_t disp = (uint32_t) (target - (rel + 4));
+    memcpy(rel, &disp, 4);
+}
+
+/* ******************** /x86-64 encoder ******************** */
+
+/* registers read or written by a translatable instruction, -1 if it can't be translated */
+static long _jit_insn_regs(uint16_t opcode)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+
+    switch (opcode >> 12) {
+    case 0x1:
+        return 0;
+    case 0x3: case 0x4:
+        return 1L << x;
+    case 0x5: case 0x9:
+        return (opcode & 0x000F) ? -1 : 1L << x | 1L << y;
+    case 0x6: case 0x7:
+        return 1L << x;
+    case 0x8:
+        switch (opcode & 0x000F) {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+            return 1L << x | 1L << y;
+        case 0x4: case 0x5: case 0x7:
+            return 1L << x | 1L << y | 1L << 0xF;
+        case 0x6: case 0xE:
+            return 1L << x | 1L << 0xF;
+        }
+        return -1;
+    case 0xA:
+        return 1L << C8_JIT_REG_I;
+    case 0xF:
+        switch (opcode & 0x00FF) {
+        case 0x1E: case 0x29:
+            return 1L << x | 1L << C8_JIT_REG_I;
+        case 0x65:
+            return ((1L << (x + 1)) - 1) | 1L << C8_JIT_REG_I;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+static bool _jit_is_skip(uint16_t opcode)
+{
+    return opcode >> 12 == 0x3 || opcode >> 12 == 0x4 || opcode >> 12 == 0x5 || opcode >> 12 == 0x9;
+}
+
+/* guest register instruction, host[] maps V0..VF and I to host registers */
+static void _jit_emit_insn(uint8_t **p, uint16_t opcode, const int8_t *host)
+{
+    int x = host[(opcode & 0x0F00) >> 8];
+    int y = host[(opcode & 0x00F0) >> 4];
+    int vf = host[0xF];
+    int reg_i = host[C8_JIT_REG_I];
+    uint8_t nn = opcode & 0x00FF;
+
+    switch (opcode >> 12) {
+    case 0x6: /* Vx = NN */
+        _emit_mov_ri(p, x, nn);
+        break;
+    case 0x7: /* Vx += NN */
+        _emit_ri(p, 0, x, nn);
+        _emit_ri(p, 4, x, 0xFF);
+        break;
+    case 0x8:
+        /* VF is always written before Vx, like C8_BODY_8XY* */
+        switch (opcode & 0x000F) {
+        case 0x0: _emit_rr(p, 0x89, x, y); break;
+        case 0x1: _emit_rr(p, 0x09, x, y); break;
+        case 0x2: _emit_rr(p, 0x21, x, y); break;
+        case 0x3: _emit_rr(p, 0x31, x, y); break;
+        case 0x4: /* VF = (Vx + Vy) >> 8; Vx += Vy */
+            _emit_rr(p, 0x89, RAX, x);
+            _emit_rr(p, 0x01, RAX, y);
+            _emit_shift(p, 5, RAX, 8);
+            _emit_rr(p, 0x89, vf, RAX);
+            _emit_rr(p, 0x01, x, y);
+            _emit_ri(p, 4, x, 0xFF);
+            break;
+        case 0x5: /* VF = Vx >= Vy; Vx -= Vy */
+            _emit_rr(p, 0x89, RAX, x);
+            _emit_rr(p, 0x29, RAX, y);
+            _emit_shift(p, 5, RAX, 31);
+            _emit_ri(p, 6, RAX, 1);
+            _emit_rr(p, 0x89, vf, RAX);
+            _emit_rr(p, 0x29, x, y);
+            _emit_ri(p, 4, x, 0xFF);
+            break;
+        case 0x6: /* VF = Vx & 1; Vx >>= 1 */
+            _emit_rr(p, 0x89, RAX, x);
+            _emit_ri(p, 4, RAX, 1);
+            _emit_rr(p, 0x89, vf, RAX);
+            _emit_shift(p, 5, x, 1);
+            break;
+        case 0x7: /* VF = Vy >= Vx; Vx = Vy - Vx */
+            _emit_rr(p, 0x89, RAX, y);
+            _emit_rr(p, 0x29, RAX, x);
+            _emit_shift(p, 5, RAX, 31);
+            _emit_ri(p, 6, RAX, 1);
+            _emit_rr(p, 0x89, vf, RAX);
+            _emit_rr(p, 0x89, RAX, y);
+            _emit_rr(p, 0x29, RAX, x);
+            _emit_ri(p, 4, RAX, 0xFF);
+            _emit_rr(p, 0x89, x, RAX);
+            break;
+        case 0xE: /* VF = Vx >> 7; Vx <<= 1 */
+            _emit_rr(p, 0x89, RAX, x);
+            _emit_shift(p, 5, RAX, 7);
+            _emit_rr(p, 0x89, vf, RAX);
+            _emit_shift(p, 4, x, 1);
+            _emit_ri(p, 4, x, 0xFF);
+            break;
+        }
+        break;
+    case 0xA: /* I = NNN */
+        _emit_mov_ri(p, reg_i, opcode & 0x0FFF);
+        break;
+    case 0xF:
+        switch (opcode & 0x00FF) {
+        case 0x1E: /* I = (I + Vx) & 0xFFF */
+            _emit_rr(p, 0x01, reg_i, x);
+            _emit_ri(p, 4, reg_i, 0xFFF);
+            break;
+        case 0x29: /* I = Vx * 5 */
+            _emit_imul_ri8(p, reg_i, x, 5);
+            break;
+        case 0x65: /* V0..Vx = memory[(I + i) & 0xFFF] */
+            for (int i = 0; i <= (opcode & 0x0F00) >> 8; ++i) {
+                _emit_rr(p, 0x89, RAX, reg_i);
+                if (i)
+                    _emit_ri(p, 0, RAX, (uint32_t) i);
+                _emit_ri(p, 4, RAX, 0xFFF);
+                _emit_load_indexed(p, host[i], RAX, OFF_MEMORY);
+            }
+            break;
+        }
+        break;
+    case 0x3: /* compare only, the caller branches */
+    case 0x4:
+        _emit_ri(p, 7, x, nn);
+        break;
+    case 0x5:
+    case 0x9:
+        _emit_rr(p, 0x39, x, y);
+        break;
+    }
+}
+
+_chip8emu_jit *_chip8emu_jit_new(void)
+{
+    _chip8emu_jit *jit = calloc(1, sizeof (_chip8emu_jit));
+    if (!jit)
+        return NULL;
+
+    /* writable and executable views of the same pages */
+    int fd = memfd_create("chip8emu-jit", MFD_CLOEXEC);
+    jit->code = jit->exec = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, C8_JIT_CODE_SIZE) == 0) {
+        jit->code = mmap(NULL, C8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        jit->exec = mmap(NULL, C8_JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+        close(fd);
+    jit->pool = calloc(C8_JIT_MAX_BLOCKS, sizeof (_chip8emu_jit_block));
+    if (!jit->pool || jit->code == MAP_FAILED || jit->exec == MAP_FAILED) {
+        if (jit->code != MAP_FAILED)
+            munmap(jit->code, C8_JIT_CODE_SIZE);
+        if (jit->exec != MAP_FAILED)
+            munmap(jit->exec, C8_JIT_CODE_SIZE);
+        free(jit->pool);
+        free(jit);
+        return NULL;
+    }
+
+#ifdef CHIP8EMU_JIT_PERF_MAP
+    if (!_jit_perf_map) {
+        char path[64];
+        snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+        _jit_perf_map = fopen(path, "a");
+    }
+#endif /* CHIP8EMU_JIT_PERF_MAP */
+    return jit;
+}
+
+void _chip8emu_jit_free(_chip8emu_jit *jit)
+{
+    if (!jit)
+        return;
+    munmap(jit->code, C8_JIT_CODE_SIZE);
+    munmap(jit->exec, C8_JIT_CODE_SIZE);
+    free(jit->pool);
+    free(jit);
+}
+
+void _chip8emu_jit_flush(_chip8emu_jit *jit, uint16_t overridden)
+{
+    memset(jit->blocks, 0, sizeof jit->blocks);
+    jit->pool_used = 0;
+    jit->code_used = 0;
+    jit->overridden = overridden;
+}
+
+void _chip8emu_jit_invalidate(_chip8emu_jit *jit, uint32_t addr, uint32_t len)
+{
+    uint32_t end = addr + len > 4096 ? 4096 : addr + len;
+    uint32_t from = addr > 2 * C8_JIT_MAX_BLOCK_INSNS ? addr - 2 * C8_JIT_MAX_BLOCK_INSNS : 0;
+
+    for (uint32_t a = from; a < end; ++a) {
+        if (jit->blocks[a] && jit->blocks[a]->end > addr)
+            jit->blocks[a] = NULL;
+    }
+}
+
+/* where a branch goes once the region is emitted */
+typedef struct {
+    uint8_t  *rel;      /* displacement to patch */
+    uint16_t  target;   /* guest address */
+    uint16_t  opcode;   /* last instruction executed when it leaves the region */
+    bool      leave;    /* leaves the region even if target is in it */
+} _jit_fixup;
+
+_chip8emu_jit_block *_chip8emu_jit_compile(_chip8emu_jit *jit, chip8emu *emu, uint16_t pc)
+{
+    uint16_t opcodes[C8_JIT_MAX_BLOCK_INSNS];
+    bool target[C8_JIT_MAX_BLOCK_INSNS + 2] = { false }; /* instruction k is branched to */
+    int count = 0;
+    long used = 0;
+    uint16_t addr = pc;
+
+    /* scan the region */
+    while (count < C8_JIT_MAX_BLOCK_INSNS && addr < 4095) {
+        uint16_t opcode = (uint16_t) (emu->memory[addr] << 8 | emu->memory[addr + 1]);
+        long regs = jit->overridden & (1 << (opcode >> 12)) ? -1 : _jit_insn_regs(opcode);
+        uint16_t nnn = opcode & 0x0FFF;
+
+        if (regs < 0 || __builtin_popcountl(used | regs) > C8_JIT_REGS)
+            break;
+        /* the interpreter checks these for idle loops, unless the loop is in the region (then it has no FX07) */
+        if (opcode >> 12 == 0x1 && (nnn == addr || (nnn + 4 == addr && nnn < pc)))
+            break;
+        used |= regs;
+        opcodes[count++] = opcode;
+        addr += 2;
+
+        if (_jit_is_skip(opcode) && count + 1 <= C8_JIT_MAX_BLOCK_INSNS)
+            target[count + 1] = true;
+        if (opcode >> 12 == 0x1) {
+            if (nnn >= pc && nnn < pc + 2 * C8_JIT_MAX_BLOCK_INSNS && !((nnn - pc) & 1))
+                target[(nnn - pc) / 2] = true;
+            if (!target[count])
+                break; /* nothing falls or branches past the jump */
+        }
+    }
+    if (count < C8_JIT_MIN_BLOCK_INSNS)
+        return NULL;
+    uint16_t end = addr;
+
+    /* longest run of instructions from k to the next budget check or exit, what a check at k must leave room for */
+    int reach[C8_JIT_MAX_BLOCK_INSNS + 2] = { 0 };
+    for (int k = count - 1; k >= 0; --k) {
+        uint16_t opcode = opcodes[k];
+        uint16_t nnn = opcode & 0x0FFF;
+        int next = reach[k + 1];
+        if (_jit_is_skip(opcode) && reach[k + 2] > next)
+            next = reach[k + 2];
+        if (opcode >> 12 == 0x1)
+            next = nnn > pc + 2 * k && nnn < end && !((nnn - pc) & 1) ? reach[(nnn - pc) / 2] : 0;
+        reach[k] = 1 + next;
+    }
+
+    if (jit->pool_used == C8_JIT_MAX_BLOCKS || jit->code_used + C8_JIT_MAX_BLOCK_BYTES > C8_JIT_CODE_SIZE)
+        _chip8emu_jit_flush(jit, jit->overridden);
+
+    /* allocate host registers */
+    int8_t host[C8_JIT_REG_I + 1];
+    int allocated = 0;
+    for (int r = 0; r <= C8_JIT_REG_I; ++r)
+        host[r] = used & (1L << r) ? (int8_t) _jit_alloc_order[allocated++] : -1;
+
+    uint8_t *start = jit->code + jit->code_used;
+    uint8_t *p = start;
+    uint8_t *labels[C8_JIT_MAX_BLOCK_INSNS];
+    _jit_fixup fixups[2 * C8_JIT_MAX_BLOCK_INSNS + 1];
+    int nfixups = 0;
+
+    /* prologue: not even one pass fits in the budget, the interpreter runs it */
+    _emit_ri(&p, 7, RSI, (uint32_t) reach[0]);
+    uint8_t *enter = _emit_branch(&p, CC_AE);
+    _emit_rr(&p, 0x31, RAX, RAX);
+    _emit8(&p, 0xC3); /* ret */
+    _emit_patch(enter, p);
+
+    /* save callee-saved registers, budget in edx and ecx, load guest registers */
+    for (int k = 0; k < allocated; ++k)
+        if (_is_callee_saved(_jit_alloc_order[k]))
+            _emit_push(&p, _jit_alloc_order[k]);
+    _emit_rr(&p, 0x89, RDX, RSI);
+    _emit_rr(&p, 0x89, RCX, RSI);
+    for (int r = 0; r < 0x10; ++r)
+        if (host[r] >= 0)
+            _emit_load(&p, host[r], OFF_V + (uint32_t) r, false);
+    if (host[C8_JIT_REG_I] >= 0)
+        _emit_load(&p, host[C8_JIT_REG_I], OFF_I, true);
+
+    /* body, ecx is charged before every branch and branch target */
+    int pending = 0;
+    for (int k = 0; k < count; ++k) {
+        uint16_t opcode = opcodes[k];
+        uint16_t at = (uint16_t) (pc + 2 * k);
+
+        if (target[k] && pending) {
+            _emit_ri(&p, 5, RCX, (uint32_t) pending);
+            pending = 0;
+        }
+        labels[k] = p;
+        ++pending;
+
+        if (_jit_is_skip(opcode)) {
+            /* 3XNN, 5XY0 skip when equal; 4XNN, 9XY0 when not equal */
+            bool skip_if_equal = opcode >> 12 == 0x3 || opcode >> 12 == 0x5;
+            _emit_ri(&p, 5, RCX, (uint32_t) pending);
+            pending = 0;
+            _jit_emit_insn(&p, opcode, host);
+            fixups[nfixups++] = (_jit_fixup) { _emit_branch(&p, skip_if_equal ? CC_E : CC_NE), (uint16_t) (at + 4), opcode, false };
+        } else if (opcode >> 12 == 0x1) {
+            uint16_t nnn = opcode & 0x0FFF;
+            _emit_ri(&p, 5, RCX, (uint32_t) pending);
+            pending = 0;
+            if (nnn >= pc && nnn <= at && !((nnn - pc) & 1)) {
+                /* loop: another pass only if it fits in what is left of the budget */
+                _emit_ri(&p, 7, RCX, (uint32_t) reach[(nnn - pc) / 2]);
+                fixups[nfixups++] = (_jit_fixup) { _emit_branch(&p, CC_B), nnn, opcode, true };
+                _emit_patch(_emit_branch(&p, -1), labels[(nnn - pc) / 2]);
+            } else {
+                fixups[nfixups++] = (_jit_fixup) { _emit_branch(&p, -1), nnn, opcode, false };
+            }
+        } else {
+            _jit_emit_insn(&p, opcode, host);
+        }
+    }
+    /* falls through out of the region */
+    if (opcodes[count - 1] >> 12 != 0x1) {
+        if (pending)
+            _emit_ri(&p, 5, RCX, (uint32_t) pending);
+        fixups[nfixups++] = (_jit_fixup) { _emit_branch(&p, -1), end, opcodes[count - 1], true };
+    }
+
+    /* branches inside the region go to their label, the others to an exit setting pc and opcode */
+    uint8_t *epilogue_jumps[2 * C8_JIT_MAX_BLOCK_INSNS + 1];
+    int nexits = 0;
+    for (int f = 0; f < nfixups; ++f) {
+        uint16_t t = fixups[f].target;
+        if (!fixups[f].leave && t >= pc && t < end && !((t - pc) & 1)) {
+            _emit_patch(fixups[f].rel, labels[(t - pc) / 2]);
+            continue;
+        }
+        _emit_patch(fixups[f].rel, p);
+        _emit_store_imm16(&p, OFF_PC, t);
+        _emit_store_imm16(&p, OFF_OPCODE, fixups[f].opcode);
+        epilogue_jumps[nexits++] = _emit_branch(&p, -1);
+    }
+
+    /* epilogue: store guest registers, return budget - ecx */
+    for (int k = 0; k < nexits; ++k)
+        _emit_patch(epilogue_jumps[k], p);
+    for (int r = 0; r < 0x10; ++r)
+        if (host[r] >= 0)
+            _emit_store(&p, host[r], OFF_V + (uint32_t) r, false);
+    if (host[C8_JIT_REG_I] >= 0)
+        _emit_store(&p, host[C8_JIT_REG_I], OFF_I, true);
+    _emit_rr(&p, 0x89, RAX, RDX);
+    _emit_rr(&p, 0x29, RAX, RCX);
+    for (int k = allocated - 1; k >= 0; --k)
+        if (_is_callee_saved(_jit_alloc_order[k]))
+            _emit_pop(&p, _jit_alloc_order[k]);
+    _emit8(&p, 0xC3); /* ret */
+
+    uint8_t *fn = jit->exec + (start - jit->code);
+    jit->code_used += (size_t) (p - start);
+    _chip8emu_jit_block *block = &jit->pool[jit->pool_used++];
+    *(void **) &block->fn = fn;
+    block->start = pc;
+    block->end = end;
+    block->count = (uint16_t) count;
+    jit->blocks[pc] = block;
+
+#ifdef CHIP8EMU_JIT_PERF_MAP
+    if (_jit_perf_map) {
+        fprintf(_jit_perf_map, "%lx %lx chip8_block_%03X_%u\n",
+                (unsigned long) fn, (unsigned long) (p - start), pc, (unsigned) count);
+        fflush(_jit_perf_map);
+    }
+#endif /* CHIP8EMU_JIT_PERF_MAP */
+    return block;
+}
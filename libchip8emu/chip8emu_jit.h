@@ -0,0 +1,45 @@
+#ifndef CHIP8EMU_JIT_H_
+#define CHIP8EMU_JIT_H_
+
+/**
+  * x86-64 region translator, internal to libchip8emu
+  * build with CHIP8EMU_JIT (requires CHIP8EMU_THREADED_DISPATCH)
+  **/
+
+#include <stdint.h>
+#include "chip8emu.h"
+
+#define C8_JIT_MAX_BLOCK_INSNS  64
+
+typedef struct _chip8emu_jit _chip8emu_jit;
+typedef struct _chip8emu_jit_block _chip8emu_jit_block;
+
+struct _chip8emu_jit_block {
+    /* runs at most budget instructions, returns how many; 0 if not even one pass fits */
+    uint32_t (*fn)(chip8emu *emu, uint32_t budget);
+    uint16_t start;     /* guest code range [start, end) */
+    uint16_t end;
+    uint16_t count;     /* instructions translated */
+};
+
+struct _chip8emu_jit {
+    _chip8emu_jit_block *blocks[4096];  /* by entry address, NULL: not compiled or invalidated */
+    uint16_t  overridden;               /* opcode_handlers replaced when blocks were compiled */
+
+    _chip8emu_jit_block *pool;
+    int       pool_used;
+    uint8_t  *code;                     /* writable view of the code buffer */
+    uint8_t  *exec;                     /* executable view of the same pages */
+    size_t    code_used;
+};
+
+_chip8emu_jit* _chip8emu_jit_new(void);
+void _chip8emu_jit_free(_chip8emu_jit *jit);
+/* drop every block, overridden opcode handlers are never translated */
+void _chip8emu_jit_flush(_chip8emu_jit *jit, uint16_t overridden);
+/* translate the region starting at pc, returns NULL if it is not worth translating */
+_chip8emu_jit_block* _chip8emu_jit_compile(_chip8emu_jit *jit, chip8emu *emu, uint16_t pc);
+/* drop blocks overlapping guest memory [addr, addr + len) */
+void _chip8emu_jit_invalidate(_chip8emu_jit *jit, uint32_t addr, uint32_t len);
+
+#endif /* CHIP8EMU_JIT_H_ */
@@ -0,0 +1,197 @@
+#ifndef CHIP8EMU_OPS_H_
+#define CHIP8EMU_OPS_H_
+
+/**
+  * instruction semantics, internal to libchip8emu
+  * the C8_BODY_* statements are the single definition of every instruction,
+  * expanded by chip8emu.c for one emulator and by chip8emu_batch.c for each
+  * lane of a group. They are written against accessors the includer defines
+  * before expanding them:
+  *   C8_V(r), C8_I, C8_PC, C8_SP, C8_STACK(i)    registers, lvalues
+  *   C8_READ(addr), C8_WRITE(addr, val)          memory, addresses wrap at 4 KB
+  *   C8_DISPLAY(row)                             packed row, bit 63 is x = 0
+  *   C8_DRAWN(row, bits)                         bits of row are about to change
+  *   C8_DELAY(), C8_SET_DELAY(v), C8_SET_SOUND(v)
+  *   C8_KEY(k)                                   key k is held
+  *   C8_FIRST_KEY(), C8_KEY_WAIT()               lowest new key or > 0xF, no key yet
+  *   C8_RAND()                                   random byte of CXNN
+  * Statement order is part of the semantics: 8XY4 and the like write VF
+  * before VX, which decides what 8FY4 leaves in VF.
+  **/
+
+#include <stdint.h>
+
+#define C8_X(opcode)    (((opcode) & 0x0F00) >> 8)
+#define C8_Y(opcode)    (((opcode) & 0x00F0) >> 4)
+#define C8_N(opcode)    ((opcode) & 0x000F)
+#define C8_NN(opcode)   ((opcode) & 0x00FF)
+#define C8_NNN(opcode)  ((opcode) & 0x0FFF)
+
+static inline uint64_t _chip8emu_rotr64(uint64_t v, unsigned n) {
+    return v >> n | v << ((64 - n) & 63);
+}
+
+/* xorshift32 of CXNN, its whole state fits in a save state */
+static inline uint8_t _chip8emu_xorshift(uint32_t *state) {
+    uint32_t s = *state;
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    *state = s;
+    return (uint8_t) (s >> 24);
+}
+
+/* 00E0: clear screen */
+#define C8_BODY_00E0() do {                                             \
+        for (int row_ = 0; row_ < 32; ++row_) {                         \
+            C8_DRAWN(row_, C8_DISPLAY(row_));                           \
+            C8_DISPLAY(row_) = 0;                                       \
+        }                                                               \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* 00EE: subroutine return, the stack wraps around */
+#define C8_BODY_00EE()          (C8_PC = C8_STACK(--C8_SP & 0xF) + 2)
+
+/* 1NNN: absolute jump */
+#define C8_BODY_1NNN(nnn)       (C8_PC = (nnn))
+
+/* 2NNN: call subroutine, the stack wraps around like in 00EE */
+#define C8_BODY_2NNN(nnn) do {                                          \
+        C8_STACK(C8_SP & 0xF) = C8_PC;                                  \
+        ++C8_SP;                                                        \
+        C8_PC = (nnn);                                                  \
+    } while (0)
+
+/* 3XNN: Skips the next instruction if VX equals NN */
+#define C8_BODY_3XNN(x, nn)     (C8_PC += C8_V(x) == (nn) ? 4 : 2)
+/* 4XNN: Skips the next instruction if VX doesn't equal NN */
+#define C8_BODY_4XNN(x, nn)     (C8_PC += C8_V(x) != (nn) ? 4 : 2)
+/* 5XY0: Skips the next instruction if VX equals VY */
+#define C8_BODY_5XY0(x, y)      (C8_PC += C8_V(x) == C8_V(y) ? 4 : 2)
+/* 9XY0: Skips the next instruction if VX doesn't equal VY */
+#define C8_BODY_9XY0(x, y)      (C8_PC += C8_V(x) != C8_V(y) ? 4 : 2)
+
+/* 6XNN: Sets VX to NN */
+#define C8_BODY_6XNN(x, nn)     do { C8_V(x) = (nn); C8_PC += 2; } while (0)
+/* 7XNN: Adds NN to VX */
+#define C8_BODY_7XNN(x, nn)     do { C8_V(x) += (nn); C8_PC += 2; } while (0)
+
+/* 8XY0: Vx = Vy */
+#define C8_BODY_8XY0(x, y)      do { C8_V(x) = C8_V(y); C8_PC += 2; } while (0)
+/* 8XY1: Vx = Vx | Vy */
+#define C8_BODY_8XY1(x, y)      do { C8_V(x) |= C8_V(y); C8_PC += 2; } while (0)
+/* 8XY2: Vx = Vx & Vy */
+#define C8_BODY_8XY2(x, y)      do { C8_V(x) &= C8_V(y); C8_PC += 2; } while (0)
+/* 8XY3: Vx = Vx XOR Vy */
+#define C8_BODY_8XY3(x, y)      do { C8_V(x) ^= C8_V(y); C8_PC += 2; } while (0)
+
+/* 8XY4: Vx += Vy; VF is set to 1 when there's a carry, and to 0 when there isn't */
+#define C8_BODY_8XY4(x, y) do {                                         \
+        C8_V(0xF) = C8_V(y) > (0xFF - C8_V(x)) ? 1 : 0;                 \
+        C8_V(x) += C8_V(y);                                             \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* 8XY5: Vx -= Vy; VF is set to 0 when there's a borrow, and 1 when there isn't */
+#define C8_BODY_8XY5(x, y) do {                                         \
+        C8_V(0xF) = C8_V(y) > C8_V(x) ? 0 : 1;                          \
+        C8_V(x) -= C8_V(y);                                             \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* 8XY6: Vx >>= 1; VF is set to the least significant bit of VX before the shift */
+#define C8_BODY_8XY6(x) do {                                            \
+        C8_V(0xF) = C8_V(x) & 0x1;                                      \
+        C8_V(x) >>= 1;                                                  \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* 8XY7: Vx = Vy - Vx; VF is set to 0 when there's a borrow, and 1 when there isn't */
+#define C8_BODY_8XY7(x, y) do {                                         \
+        C8_V(0xF) = C8_V(x) > C8_V(y) ? 0 : 1;                          \
+        C8_V(x) = C8_V(y) - C8_V(x);                                    \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* 8XYE: Vx <<= 1; VF is set to the most significant bit of VX before the shift */
+#define C8_BODY_8XYE(x) do {                                            \
+        C8_V(0xF) = C8_V(x) >> 7;                                       \
+        C8_V(x) <<= 1;                                                  \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* ANNN: Sets I to the address NNN */
+#define C8_BODY_ANNN(nnn)       do { C8_I = (nnn); C8_PC += 2; } while (0)
+/* BNNN: Jumps to the address NNN plus V0 */
+#define C8_BODY_BNNN(nnn)       (C8_PC = (nnn) + C8_V(0))
+/* CXNN: Vx = rand() & NN */
+#define C8_BODY_CXNN(x, nn)     do { C8_V(x) = C8_RAND() & (nn); C8_PC += 2; } while (0)
+
+/* DXYN: draw at VX, VY the 8 pixels wide, N rows high sprite at I, VF is set on collision */
+#define C8_BODY_DXYN(x, y, height) do {                                 \
+        unsigned xo_ = C8_V(x) % 64; /* sprite rows wrap around */      \
+        uint8_t yo_ = C8_V(y);                                          \
+        uint64_t collision_ = 0;                                        \
+        for (uint8_t row_ = 0; row_ < (height); row_++) {               \
+            uint64_t bits_ = _chip8emu_rotr64((uint64_t) C8_READ(C8_I + row_) << 56, xo_); \
+            uint8_t dy_ = (yo_ + row_) % 32;                            \
+            C8_DRAWN(dy_, bits_);                                       \
+            collision_ |= C8_DISPLAY(dy_) & bits_;                      \
+            C8_DISPLAY(dy_) ^= bits_;                                   \
+        }                                                               \
+        C8_V(0xF) = collision_ != 0;                                    \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* EX9E: Skips the next instruction if the key stored in VX is pressed */
+#define C8_BODY_EX9E(x)         (C8_PC += C8_KEY(C8_V(x)) ? 4 : 2)
+/* EXA1: Skips the next instruction if the key stored in VX isn't pressed */
+#define C8_BODY_EXA1(x)         (C8_PC += !C8_KEY(C8_V(x)) ? 4 : 2)
+
+/* FX07: Sets VX to the value of the delay timer */
+#define C8_BODY_FX07(x)         do { C8_V(x) = C8_DELAY(); C8_PC += 2; } while (0)
+
+/* FX0A: A key press is awaited, and then stored in VX; pc stays on FX0A until then */
+#define C8_BODY_FX0A(x) do {                                            \
+        uint8_t key_ = C8_FIRST_KEY();                                  \
+        if (key_ > 0xF) {                                               \
+            C8_KEY_WAIT();                                              \
+        } else {                                                        \
+            C8_V(x) = key_;                                             \
+            C8_PC += 2;                                                 \
+        }                                                               \
+    } while (0)
+
+/* FX15: Sets the delay timer to VX */
+#define C8_BODY_FX15(x)         do { C8_SET_DELAY(C8_V(x)); C8_PC += 2; } while (0)
+/* FX18: Sets the sound timer to VX */
+#define C8_BODY_FX18(x)         do { C8_SET_SOUND(C8_V(x)); C8_PC += 2; } while (0)
+/* FX1E: Add VX to I register, I stays a 12 bit address */
+#define C8_BODY_FX1E(x)         do { C8_I = (C8_I + C8_V(x)) & 0xFFF; C8_PC += 2; } while (0)
+/* FX29: Sets I to the location of the font sprite for the character in VX */
+#define C8_BODY_FX29(x)         do { C8_I = C8_V(x) * 5; C8_PC += 2; } while (0)
+
+/* FX33: Store a Binary Coded Decimal (BCD) of register VX to memory started from I */
+#define C8_BODY_FX33(x) do {                                            \
+        C8_WRITE(C8_I, C8_V(x) / 100);                                  \
+        C8_WRITE(C8_I + 1, (C8_V(x) / 10) % 10);                        \
+        C8_WRITE(C8_I + 2, C8_V(x) % 10);                               \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* FX55: Store V0..VX to memory started from I */
+#define C8_BODY_FX55(x) do {                                            \
+        for (int i_ = 0; i_ <= (x); i_++)                               \
+            C8_WRITE(C8_I + i_, C8_V(i_));                              \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+/* FX65: Load V0..VX from memory started from I */
+#define C8_BODY_FX65(x) do {                                            \
+        for (int i_ = 0; i_ <= (x); i_++)                               \
+            C8_V(i_) = C8_READ(C8_I + i_);                              \
+        C8_PC += 2;                                                     \
+    } while (0)
+
+#endif /* CHIP8EMU_OPS_H_ */
@@ -0,0 +1,389 @@
+#ifndef CHIP8EMU_NO_THREAD
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#endif
+
+#include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif /* _WIN32 */
+#include "tinycthread.h"
+#include "chip8emu.h"
+#include "chip8emu_sched.h"
+
+#define NANOSECS_PER_SEC 1000000000
+
+typedef struct {
+    _chip8emu_task **heap;  /* min-heap by deadline */
+    int       size;
+    int       capacity;
+    bool      busy;         /* running a task */
+    cnd_t     wake;
+} _chip8emu_worker;
+
+/* one lock for every heap, held for heap operations only, never while a task runs */
+static struct {
+    mtx_t     mtx;
+    cnd_t     detached;     /* a slice of a detaching task returned */
+    _chip8emu_worker *workers;
+    int       count;
+} _sched;
+
+static int _sched_requested_workers = 0;
+static once_flag _sched_once = ONCE_FLAG_INIT;
+
+/* monotonic: stepping the wall clock back must not freeze the emulators */
+uint64_t _chip8emu_sched_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t) (count.QuadPart / freq.QuadPart) * NANOSECS_PER_SEC
+        + (uint64_t) (count.QuadPart % freq.QuadPart) * NANOSECS_PER_SEC / (uint64_t) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NANOSECS_PER_SEC + (uint64_t) ts.tv_nsec;
+#endif /* _WIN32 */
+}
+
+/* cnd_timedwait takes TIME_UTC deadlines: converted just before waiting */
+static struct timespec _chip8emu_sched_utc(uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t now = _chip8emu_sched_now();
+    timespec_get(&ts, TIME_UTC);
+    uint64_t utc = (uint64_t) ts.tv_sec * NANOSECS_PER_SEC + (uint64_t) ts.tv_nsec
+        + (deadline > now ? deadline - now : 0);
+    ts.tv_sec = (time_t) (utc / NANOSECS_PER_SEC);
+    ts.tv_nsec = (long) (utc % NANOSECS_PER_SEC);
+    return ts;
+}
+
+/* ******************** Deadline heaps, _sched.mtx held ******************** */
+static void _chip8emu_heap_swap(_chip8emu_worker *w, int a, int b)
+{
+    _chip8emu_task *t = w->heap[a];
+    w->heap[a] = w->heap[b];
+    w->heap[b] = t;
+    w->heap[a]->heap_index = a;
+    w->heap[b]->heap_index = b;
+}
+
+static void _chip8emu_heap_up(_chip8emu_worker *w, int i)
+{
+    while (i > 0 && w->heap[(i - 1) / 2]->deadline > w->heap[i]->deadline) {
+        _chip8emu_heap_swap(w, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void _chip8emu_heap_down(_chip8emu_worker *w, int i)
+{
+    while (true) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < w->size && w->heap[l]->deadline < w->heap[min]->deadline)
+            min = l;
+        if (r < w->size && w->heap[r]->deadline < w->heap[min]->deadline)
+            min = r;
+        if (min == i)
+            return;
+        _chip8emu_heap_swap(w, i, min);
+        i = min;
+    }
+}
+
+static void _chip8emu_heap_push(int worker, _chip8emu_task *task)
+{
+    _chip8emu_worker *w = &_sched.workers[worker];
+    if (w->size == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 16;
+        w->heap = realloc(w->heap, w->capacity * sizeof(_chip8emu_task*));
+    }
+    task->worker = worker;
+    task->heap_index = w->size;
+    w->heap[w->size++] = task;
+    _chip8emu_heap_up(w, task->heap_index);
+}
+
+static void _chip8emu_heap_remove(_chip8emu_task *task)
+{
+    _chip8emu_worker *w = &_sched.workers[task->worker];
+    int i = task->heap_index;
+    task->heap_index = -1;
+    if (i == --w->size)
+        return;
+    w->heap[i] = w->heap[w->size];
+    w->heap[i]->heap_index = i;
+    _chip8emu_heap_up(w, i);
+    _chip8emu_heap_down(w, w->heap[i]->heap_index);
+}
+
+/* wakes the task's worker, or an idle one if it is busy so the task can be stolen */
+static void _chip8emu_sched_notify(int worker)
+{
+    cnd_signal(&_sched.workers[worker].wake);
+    if (!_sched.workers[worker].busy)
+        return;
+    for (int i = 0; i < _sched.count; ++i) {
+        if (!_sched.workers[i].busy) {
+            cnd_signal(&_sched.workers[i].wake);
+            return;
+        }
+    }
+}
+/* ******************** /Deadline heaps ******************** */
+
+/* picks a due task: own heap first, else the most overdue task of another worker */
+static _chip8emu_task* _chip8emu_sched_pick(int self, uint64_t now)
+{
+    _chip8emu_worker *w = &_sched.workers[self];
+    if (w->size && w->heap[0]->deadline <= now) {
+        _chip8emu_task *task = w->heap[0];
+        _chip8emu_heap_remove(task);
+        return task;
+    }
+
+    _chip8emu_task *steal = NULL;
+    for (int i = 0; i < _sched.count; ++i) {
+        _chip8emu_worker *victim = &_sched.workers[i];
+        if (i != self && victim->size && victim->heap[0]->deadline <= now
+                && (!steal || victim->heap[0]->deadline < steal->deadline))
+            steal = victim->heap[0];
+    }
+    if (steal)
+        _chip8emu_heap_remove(steal);
+    return steal;
+}
+
+/* earliest deadline of every heap, C8_SCHED_PARK if all are empty */
+static uint64_t _chip8emu_sched_next_deadline(void)
+{
+    uint64_t next = C8_SCHED_PARK;
+    for (int i = 0; i < _sched.count; ++i) {
+        if (_sched.workers[i].size && _sched.workers[i].heap[0]->deadline < next)
+            next = _sched.workers[i].heap[0]->deadline;
+    }
+    return next;
+}
+
+static int _chip8emu_sched_worker(void *arg)
+{
+    int self = (int) (intptr_t) arg;
+    _chip8emu_worker *w = &_sched.workers[self];
+
+    mtx_lock(&_sched.mtx);
+    while (true) {
+        uint64_t now = _chip8emu_sched_now();
+        _chip8emu_task *task = _chip8emu_sched_pick(self, now);
+
+        if (!task) {
+            uint64_t next = _chip8emu_sched_next_deadline();
+            if (next == C8_SCHED_PARK) {
+                cnd_wait(&w->wake, &_sched.mtx);
+            } else {
+                struct timespec until = _chip8emu_sched_utc(next);
+                cnd_timedwait(&w->wake, &_sched.mtx, &until);
+            }
+            continue;
+        }
+
+        task->running = true;
+        w->busy = true;
+        mtx_unlock(&_sched.mtx);
+        uint64_t next = task->run(task, now);
+        mtx_lock(&_sched.mtx);
+        w->busy = false;
+        task->running = false;
+
+        if (task->wake_at < next)
+            next = task->wake_at;
+        task->wake_at = C8_SCHED_PARK;
+        if (!task->attached) {
+            cnd_broadcast(&_sched.detached);
+        } else if (next != C8_SCHED_PARK) {
+            /* a stolen task stays with the worker that ran it */
+            task->deadline = next;
+            _chip8emu_heap_push(self, task);
+        }
+    }
+    return C8ERR_OK;
+}
+
+static void _chip8emu_sched_init(void)
+{
+    int count = _sched_requested_workers;
+    if (count <= 0) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        count = (int) info.dwNumberOfProcessors;
+#else
+        count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif /* _WIN32 */
+    }
+    if (count <= 0)
+        count = 1;
+
+    mtx_init(&_sched.mtx, mtx_plain);
+    cnd_init(&_sched.detached);
+    _sched.workers = calloc(count, sizeof(_chip8emu_worker));
+    _sched.count = count;
+    for (int i = 0; i < count; ++i)
+        cnd_init(&_sched.workers[i].wake);
+    for (int i = 0; i < count; ++i) {
+        thrd_t thrd;
+        if (thrd_create(&thrd, _chip8emu_sched_worker, (void*) (intptr_t) i) == thrd_success)
+            thrd_detach(thrd);
+    }
+}
+
+void chip8emu_set_worker_threads(int count)
+{
+    _sched_requested_workers = count;
+}
+
+_chip8emu_task* _chip8emu_sched_task_new(uint64_t (*run)(_chip8emu_task*, uint64_t), void *arg)
+{
+    _chip8emu_task *task = calloc(1, sizeof(_chip8emu_task));
+    task->run = run;
+    task->arg = arg;
+    task->wake_at = C8_SCHED_PARK;
+    task->heap_index = -1;
+    return task;
+}
+
+void _chip8emu_sched_attach(_chip8emu_task *task)
+{
+    call_once(&_sched_once, _chip8emu_sched_init);
+
+    mtx_lock(&_sched.mtx);
+    if (!task->attached) {
+        /* new tasks go to the least loaded worker */
+        int worker = 0;
+        for (int i = 1; i < _sched.count; ++i) {
+            if (_sched.workers[i].size < _sched.workers[worker].size)
+                worker = i;
+        }
+        task->worker = worker;
+        task->attached = true;
+    }
+    mtx_unlock(&_sched.mtx);
+}
+
+void _chip8emu_sched_detach(_chip8emu_task *task)
+{
+    if (!task->attached)
+        return;
+    mtx_lock(&_sched.mtx);
+    task->attached = false;
+    if (task->heap_index >= 0)
+        _chip8emu_heap_remove(task);
+    while (task->running)
+        cnd_wait(&_sched.detached, &_sched.mtx);
+    mtx_unlock(&_sched.mtx);
+}
+
+typedef struct {
+    mtx_t     mtx;
+    cnd_t     wake;
+} _chip8emu_here;
+
+void _chip8emu_sched_run_here(_chip8emu_task *task)
+{
+    _chip8emu_here here;
+    mtx_init(&here.mtx, mtx_plain);
+    cnd_init(&here.wake);
+
+    mtx_lock(&here.mtx);
+    task->here = &here;
+    while (true) {
+        task->wake_at = C8_SCHED_PARK;
+        mtx_unlock(&here.mtx);
+        uint64_t next = task->run(task, _chip8emu_sched_now());
+        mtx_lock(&here.mtx);
+        if (task->wake_at < next)
+            next = task->wake_at;
+        if (next == C8_SCHED_PARK)
+            break;
+        /* absolute deadline, sleeping late does not shift the following ones */
+        while (task->wake_at == C8_SCHED_PARK && _chip8emu_sched_now() < next) {
+            struct timespec until = _chip8emu_sched_utc(next);
+            cnd_timedwait(&here.wake, &here.mtx, &until);
+        }
+    }
+    task->here = NULL;
+    mtx_unlock(&here.mtx);
+
+    mtx_destroy(&here.mtx);
+    cnd_destroy(&here.wake);
+}
+
+void _chip8emu_sched_wake(_chip8emu_task *task, uint64_t deadline)
+{
+    _chip8emu_here *here = (_chip8emu_here*) task->here;
+    if (here) {
+        mtx_lock(&here->mtx);
+        if (deadline < task->wake_at)
+            task->wake_at = deadline;
+        cnd_signal(&here->wake);
+        mtx_unlock(&here->mtx);
+        return;
+    }
+    if (!task->attached)
+        return;
+    mtx_lock(&_sched.mtx);
+    if (task->running) {
+        /* requeued by the worker when the slice returns */
+        if (deadline < task->wake_at)
+            task->wake_at = deadline;
+    } else if (task->heap_index >= 0) {
+        if (deadline < task->deadline) {
+            task->deadline = deadline;
+            _chip8emu_heap_up(&_sched.workers[task->worker], task->heap_index);
+            _chip8emu_sched_notify(task->worker);
+        }
+    } else if (task->attached) {
+        task->deadline = deadline;
+        _chip8emu_heap_push(task->worker, task);
+        _chip8emu_sched_notify(task->worker);
+    }
+    mtx_unlock(&_sched.mtx);
+}
+
+/* ******************** Clocks ******************** */
+#define C8_CLOCK_UNIT 1000000000000ULL /* ns per tick times millihz */
+
+void _chip8emu_clock_reset(_chip8emu_clock *clock, uint64_t now)
+{
+    clock->next = now;
+    clock->frac = 0;
+}
+
+uint64_t _chip8emu_clock_due(const _chip8emu_clock *clock, uint64_t t)
+{
+    if (t < clock->next)
+        return 0;
+    uint64_t elapsed = (t - clock->next) * clock->millihz; /* callers bound t - next to fractions of a second */
+    if (elapsed < clock->frac)
+        return 0;
+    return (elapsed - clock->frac) / C8_CLOCK_UNIT + 1;
+}
+
+void _chip8emu_clock_advance(_chip8emu_clock *clock, uint64_t ticks)
+{
+    clock->next += ticks * (C8_CLOCK_UNIT / clock->millihz);
+    clock->frac += ticks * (C8_CLOCK_UNIT % clock->millihz);
+    clock->next += clock->frac / clock->millihz;
+    clock->frac %= clock->millihz;
+}
+/* ******************** /Clocks ******************** */
+
+#endif /* CHIP8EMU_NO_THREAD */
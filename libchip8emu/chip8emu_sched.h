@@ -0,0 +1,58 @@
+#ifndef CHIP8EMU_SCHED_H_
+#define CHIP8EMU_SCHED_H_
+
+/**
+  * worker pool shared by every started emulator, internal to libchip8emu
+  * each worker keeps a heap of tasks ordered by deadline, runs the ones that
+  * are due and steals due tasks from busy workers when its own are not
+  **/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define C8_SCHED_PARK   UINT64_MAX  /* run() result: leave the queues until the next wake */
+
+typedef struct _chip8emu_task _chip8emu_task;
+typedef struct _chip8emu_clock _chip8emu_clock;
+
+/* drift-free clock, tick k is due exactly k / rate after the reset */
+struct _chip8emu_clock {
+    uint64_t  next;         /* due time of the next tick in ns, rounded down */
+    uint64_t  frac;         /* the exact due time is next + frac / millihz */
+    uint64_t  millihz;      /* rate in 1/1000 Hz */
+};
+
+struct _chip8emu_task {
+    /* called by a worker once deadline passed, returns the next deadline or C8_SCHED_PARK */
+    uint64_t (*run)(_chip8emu_task *task, uint64_t now);
+    void     *arg;
+
+    /* owned by the scheduler */
+    uint64_t  deadline;
+    uint64_t  wake_at;      /* earliest wake received while running, C8_SCHED_PARK: none */
+    int       worker;       /* heap holding the task, stealing moves it */
+    int       heap_index;   /* -1: not queued */
+    bool      attached;
+    bool      running;
+    void     *here;         /* wait state of _chip8emu_sched_run_here, NULL otherwise */
+};
+
+/* monotonic clock in nanoseconds, same clock as the deadlines */
+uint64_t _chip8emu_sched_now(void);
+_chip8emu_task* _chip8emu_sched_task_new(uint64_t (*run)(_chip8emu_task*, uint64_t), void *arg);
+/* hands the task to the pool (started on first use), it runs once woken */
+void _chip8emu_sched_attach(_chip8emu_task *task);
+/* waits for a running slice to return, then removes the task for good */
+void _chip8emu_sched_detach(_chip8emu_task *task);
+/* run the task at deadline at the latest, ignored unless attached or in run_here */
+void _chip8emu_sched_wake(_chip8emu_task *task, uint64_t deadline);
+/* runs a task that is not attached in the calling thread until it parks */
+void _chip8emu_sched_run_here(_chip8emu_task *task);
+
+/* first tick due at now */
+void _chip8emu_clock_reset(_chip8emu_clock *clock, uint64_t now);
+/* number of ticks due at or before t */
+uint64_t _chip8emu_clock_due(const _chip8emu_clock *clock, uint64_t t);
+void _chip8emu_clock_advance(_chip8emu_clock *clock, uint64_t ticks);
+
+#endif /* CHIP8EMU_SCHED_H_ */
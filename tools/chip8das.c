@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "chip8das.h"
+
+int chip8_disassemble(uint16_t opcode, char *buf, size_t size)
+{
+    unsigned x = (opcode >> 8) & 0xF, y = (opcode >> 4) & 0xF;
+    unsigned n = opcode & 0xF, nn = opcode & 0xFF, nnn = opcode & 0xFFF;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0) return snprintf(buf, size, "CLS");
+        if (opcode == 0x00EE) return snprintf(buf, size, "RET");
+        return snprintf(buf, size, "SYS #%03X", nnn);
+    case 0x1: return snprintf(buf, size, "JP #%03X", nnn);
+    case 0x2: return snprintf(buf, size, "CALL #%03X", nnn);
+    case 0x3: return snprintf(buf, size, "SE V%X, #%02X", x, nn);
+    case 0x4: return snprintf(buf, size, "SNE V%X, #%02X", x, nn);
+    case 0x5:
+        if (n == 0) return snprintf(buf, size, "SE V%X, V%X", x, y);
+        break;
+    case 0x6: return snprintf(buf, size, "LD V%X, #%02X", x, nn);
+    case 0x7: return snprintf(buf, size, "ADD V%X, #%02X", x, nn);
+    case 0x8:
+        switch (n) {
+        case 0x0: return snprintf(buf, size, "LD V%X, V%X", x, y);
+        case 0x1: return snprintf(buf, size, "OR V%X, V%X", x, y);
+        case 0x2: return snprintf(buf, size, "AND V%X, V%X", x, y);
+        case 0x3: return snprintf(buf, size, "XOR V%X, V%X", x, y);
+        case 0x4: return snprintf(buf, size, "ADD V%X, V%X", x, y);
+        case 0x5: return snprintf(buf, size, "SUB V%X, V%X", x, y);
+        case 0x6: return snprintf(buf, size, "SHR V%X, V%X", x, y);
+        case 0x7: return snprintf(buf, size, "SUBN V%X, V%X", x, y);
+        case 0xE: return snprintf(buf, size, "SHL V%X, V%X", x, y);
+        }
+        break;
+    case 0x9:
+        if (n == 0) return snprintf(buf, size, "SNE V%X, V%X", x, y);
+        break;
+    case 0xA: return snprintf(buf, size, "LD I, #%03X", nnn);
+    case 0xB: return snprintf(buf, size, "JP V0, #%03X", nnn);
+    case 0xC: return snprintf(buf, size, "RND V%X, #%02X", x, nn);
+    case 0xD: return snprintf(buf, size, "DRW V%X, V%X, %u", x, y, n);
+    case 0xE:
+        if (nn == 0x9E) return snprintf(buf, size, "SKP V%X", x);
+        if (nn == 0xA1) return snprintf(buf, size, "SKNP V%X", x);
+        break;
+    default:
+        switch (nn) {
+        case 0x07: return snprintf(buf, size, "LD V%X, DT", x);
+        case 0x0A: return snprintf(buf, size, "LD V%X, K", x);
+        case 0x15: return snprintf(buf, size, "LD DT, V%X", x);
+        case 0x18: return snprintf(buf, size, "LD ST, V%X", x);
+        case 0x1E: return snprintf(buf, size, "ADD I, V%X", x);
+        case 0x29: return snprintf(buf, size, "LD F, V%X", x);
+        case 0x33: return snprintf(buf, size, "LD B, V%X", x);
+        case 0x55: return snprintf(buf, size, "LD [I], V%X", x);
+        case 0x65: return snprintf(buf, size, "LD V%X, [I]", x);
+        }
+        break;
+    }
+    return snprintf(buf, size, "DW #%04X", opcode);
+}
@@ -1,6 +1,11 @@
 #ifndef CHIP8DAS_H_
 #define CHIP8DAS_H_
 
-int chip8_disassemble(binary, );
+#include <stddef.h>
+#include <stdint.h>
+
+/* writes the mnemonic of opcode to buf ("LD V1, #2A"), DW #XXXX if it is not an instruction;
+   returns the length it needed, as snprintf */
+int chip8_disassemble(uint16_t opcode, char *buf, size_t size);
 
 #endif /* CHIP8DAS_H_ */
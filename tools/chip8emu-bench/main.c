@@ -0,0 +1,594 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <libgen.h> /* for dirname() */
+#include <sys/resource.h>
+
+#include "chip8emu.h"
+#include "chip8emu_batch.h"
+
+#define DEFAULT_CYCLES      10000000
+#define CYCLES_PER_FRAME    25 /* 1500Hz cpu, 60Hz timers */
+#define STATE_REPEATS       100000
+#define BASELINE_MAX        256
+
+typedef long (*bench_loop_t)(chip8emu *emu, long cycles);
+
+typedef struct {
+    char      rom[64];
+    double    ips;          /* engine instructions per second */
+} baseline_entry;
+
+static long draw_calls;
+static size_t trace_records; /* -t: instruction trace ring of the benchmarked instances */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* peak resident set size in KB since the last reset_peak_rss(), of the whole run where it cannot be reset */
+static long peak_rss_kb(void)
+{
+    char line[256];
+    long kb = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        while (kb < 0 && fgets(line, sizeof line, status))
+            sscanf(line, "VmHWM: %ld", &kb);
+        fclose(status);
+    }
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        kb = usage.ru_maxrss / 1024; /* bytes */
+#else
+        kb = usage.ru_maxrss;
+#endif /* __APPLE__ */
+    }
+    return kb;
+}
+
+static void reset_peak_rss(void)
+{
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w"); /* Linux only, "5" resets VmHWM */
+    if (clear_refs) {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+}
+
+static void draw_callback(chip8emu *emu)
+{
+    (void)emu;
+    ++draw_calls;
+}
+
+/* scripted input: every second press one key for half a second, cycling 0..F */
+static bool keystate_callback(chip8emu *emu, uint8_t key)
+{
+    uint64_t frame = emu->cycles / CYCLES_PER_FRAME;
+    return (frame / 60) % 16 == key && frame % 60 < 30;
+}
+
+/* one chip8emu_exec_cycle call per instruction, dispatched through opcode_handlers */
+static long loop_exec_cycle(chip8emu *emu, long cycles)
+{
+    while ((long)emu->cycles < cycles) {
+        for (int i = 0; i < CYCLES_PER_FRAME; ++i) {
+            uint64_t before = emu->cycles;
+            chip8emu_exec_cycle(emu);
+            if (emu->cycles == before)
+                return (long)emu->cycles; /* fault */
+        }
+        chip8emu_timer_tick(emu);
+    }
+    return (long)emu->cycles;
+}
+
+/* batches through chip8emu_run_cycles dispatch engine */
+static long loop_run_cycles(chip8emu *emu, long cycles)
+{
+    while ((long)emu->cycles < cycles) {
+        if (chip8emu_run_cycles(emu, CYCLES_PER_FRAME) < CYCLES_PER_FRAME)
+            break; /* fault */
+        chip8emu_timer_tick(emu);
+    }
+    return (long)emu->cycles;
+}
+
+/* unthrottled, no frames or timers: one chip8emu_exec_cycle call per instruction */
+static long loop_exec_unthrottled(chip8emu *emu, long cycles)
+{
+    while ((long)emu->cycles < cycles) {
+        uint64_t before = emu->cycles;
+        chip8emu_exec_cycle(emu);
+        if (emu->cycles == before)
+            break; /* fault */
+    }
+    return (long)emu->cycles;
+}
+
+/* unthrottled, no frames or timers: all instructions in one chip8emu_run_cycles call */
+static long loop_run_unthrottled(chip8emu *emu, long cycles)
+{
+    chip8emu_run_cycles(emu, cycles - (long)emu->cycles);
+    return (long)emu->cycles;
+}
+
+/* scripted input of a batch lane, same script as keystate_callback shifted by the lane number */
+static uint16_t batch_keys(uint64_t frame, uint32_t lane)
+{
+    return frame % 60 < 30 ? (uint16_t) (1u << ((frame / 60 + lane) % 16)) : 0;
+}
+
+/* returns lane instructions per second of a batch of lanes copies of rom, groups per step in divergence */
+static double bench_batch(const char *rom, uint32_t lanes, long cycles, double *divergence)
+{
+    chip8emu *emu = chip8emu_new();
+    *divergence = 0;
+    if (chip8emu_load_rom(emu, rom) != C8ERR_OK) {
+        chip8emu_free(emu);
+        return 0;
+    }
+    chip8emu_batch *batch = chip8emu_batch_new(emu, lanes);
+    chip8emu_free(emu);
+    if (!batch)
+        return 0;
+
+    long executed = 0;
+    uint64_t start = now_ns();
+    for (uint64_t frame = 0; (long)batch->cycles < cycles; ++frame) {
+        for (uint32_t lane = 0; lane < lanes; ++lane)
+            batch->keys[lane] = batch_keys(frame, lane);
+        executed += chip8emu_batch_run_frame(batch, CYCLES_PER_FRAME);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    *divergence = batch->cycles ? (double)batch->groups / (double)batch->cycles : 0;
+    chip8emu_batch_free(batch);
+    return elapsed ? (double)executed * 1e9 / (double)elapsed : 0;
+}
+
+/* compute bound programs of -k, register arithmetic, skips and loops without sprites or timers */
+typedef struct {
+    const char *name;
+    uint8_t     code[32];
+    long        size;
+} bench_kernel_t;
+
+static const bench_kernel_t bench_kernels[] = {
+    /* V1:V0 += V2 by repeated 8 bit additions, V3 times */
+    { "mul", { 0x60, 0x00, 0x61, 0x00, 0x62, 0x37, 0x63, 0xC5,     /* 200: V0 = V1 = 0, V2 = 0x37, V3 = 0xC5 */
+               0x80, 0x24, 0x81, 0xF4, 0x73, 0xFF, 0x33, 0x00,     /* 208: V0 += V2, V1 += VF, --V3, skip if V3 == 0 */
+               0x12, 0x08, 0x12, 0x00 }, 20 },                     /* 210: loop to 208, restart */
+    /* 8 bit Galois LFSR, 256 steps per round */
+    { "lfsr", { 0x6A, 0x01, 0x6B, 0xB8, 0x6C, 0x00, 0x8A, 0x06,    /* 200: VA = 1, VB = taps, VC = 0, VA >>= 1 */
+                0x3F, 0x00, 0x8A, 0xB3, 0x7C, 0x01, 0x3C, 0x00,    /* 208: skip if VF == 0, VA ^= VB, ++VC, skip if VC == 0 */
+                0x12, 0x06, 0x12, 0x04 }, 20 },                    /* 210: loop to 206, restart */
+    /* V4 = byte sum of 1 KB of memory read four bytes at a time */
+    { "sum", { 0xA3, 0x00, 0x66, 0x00, 0x65, 0x04, 0xF3, 0x65,     /* 200: I = 0x300, V6 = 0, V5 = 4, V0..V3 = [I] */
+               0x84, 0x04, 0x84, 0x14, 0x84, 0x24, 0x84, 0x34,     /* 208: V4 += V0..V3 */
+               0xF5, 0x1E, 0x76, 0x01, 0x46, 0x00, 0x12, 0x00,     /* 210: I += V5, ++V6, skip if V6 != 0, restart */
+               0x12, 0x06 }, 26 },                                 /* 218: loop to 206 */
+};
+
+/* returns instructions per second of a bench_kernels program */
+static double bench_kernel(const bench_kernel_t *kernel, bench_loop_t loop, long cycles)
+{
+    chip8emu *emu = chip8emu_new();
+    if (chip8emu_load_code(emu, (uint8_t *) kernel->code, kernel->size) != C8ERR_OK) {
+        chip8emu_free(emu);
+        return 0;
+    }
+
+    uint64_t start = now_ns();
+    long executed = loop(emu, cycles);
+    uint64_t elapsed = now_ns() - start;
+
+    chip8emu_free(emu);
+    return elapsed ? (double)executed * 1e9 / (double)elapsed : 0;
+}
+
+/* returns instructions per second, fused receives chip8emu_get_fusion_stats() if not NULL, draw calls are counted in draw_calls */
+static double bench_rom(const char *rom, bench_loop_t loop, long cycles, long *executed, uint64_t *fused)
+{
+    chip8emu *emu = chip8emu_new();
+    emu->keystate = &keystate_callback;
+    emu->draw = &draw_callback;
+    draw_calls = 0;
+    if (trace_records && !chip8emu_set_trace(emu, trace_records, NULL)) {
+        printf("-t: libchip8emu built without CHIP8EMU_TRACE, not tracing\n");
+        trace_records = 0;
+    }
+
+    if (chip8emu_load_rom(emu, rom) != C8ERR_OK) {
+        chip8emu_free(emu);
+        return 0;
+    }
+
+    uint64_t start = now_ns();
+    *executed = loop(emu, cycles);
+    uint64_t elapsed = now_ns() - start;
+
+    if (fused)
+        chip8emu_get_fusion_stats(emu, fused);
+    chip8emu_free(emu);
+    return elapsed ? (double)*executed * 1e9 / (double)elapsed : 0;
+}
+
+/* average save and load times in ns of the state of rom after cycles instructions */
+static size_t bench_state(const char *rom, long cycles, double *save_ns, double *load_ns)
+{
+    static uint8_t state[C8STATE_MAX_SIZE];
+    chip8emu *emu = chip8emu_new();
+    emu->keystate = &keystate_callback;
+    *save_ns = *load_ns = 0;
+
+    if (chip8emu_load_rom(emu, rom) != C8ERR_OK) {
+        chip8emu_free(emu);
+        return 0;
+    }
+    loop_run_cycles(emu, cycles);
+
+    size_t size = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < STATE_REPEATS; ++i)
+        size = chip8emu_save_state(emu, state, sizeof state);
+    *save_ns = (double)(now_ns() - start) / STATE_REPEATS;
+
+    start = now_ns();
+    for (int i = 0; i < STATE_REPEATS; ++i)
+        chip8emu_load_state(emu, state, size);
+    *load_ns = (double)(now_ns() - start) / STATE_REPEATS;
+
+    chip8emu_free(emu);
+    return size;
+}
+
+/* runs rom through the engine and adds its chip8emu_get_opcode_stats() to totals, false if not instrumented */
+static bool bench_opcodes(const char *rom, long cycles, chip8emu_opstat stats[C8OP_COUNT], chip8emu_opstat totals[C8OP_COUNT])
+{
+    chip8emu *emu = chip8emu_new();
+    emu->keystate = &keystate_callback;
+    memset(stats, 0, C8OP_COUNT * sizeof (chip8emu_opstat));
+
+    if (chip8emu_load_rom(emu, rom) != C8ERR_OK) {
+        chip8emu_free(emu);
+        return true;
+    }
+    loop_run_cycles(emu, cycles);
+    bool instrumented = chip8emu_get_opcode_stats(emu, stats);
+    chip8emu_free(emu);
+
+    for (int op = 0; op < C8OP_COUNT; ++op) {
+        totals[op].count += stats[op].count;
+        totals[op].samples += stats[op].samples;
+        totals[op].ticks += stats[op].ticks;
+        for (int b = 0; b < C8OPSTAT_BUCKETS; ++b)
+            totals[op].histogram[b] += stats[op].histogram[b];
+    }
+    return instrumented;
+}
+
+/* estimated ticks spent in an instruction: executions times the mean of the timed ones */
+static double opstat_time(const chip8emu_opstat *stat)
+{
+    return stat->samples ? (double)stat->count * (double)stat->ticks / (double)stat->samples : 0;
+}
+
+/* upper bound of the histogram bucket holding the median timed execution */
+static long opstat_median(const chip8emu_opstat *stat)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < C8OPSTAT_BUCKETS; ++b) {
+        seen += stat->histogram[b];
+        if (seen * 2 >= stat->samples && stat->samples)
+            return (1L << (b + 1)) - 1;
+    }
+    return 0;
+}
+
+/* replays a recorded session unthrottled, returns replayed frames per second */
+static double bench_movie(const char *movie, long *frames, int *ret)
+{
+    chip8emu *emu = chip8emu_new();
+
+    uint64_t start = now_ns();
+    *ret = chip8emu_play_movie_file(emu, movie, frames);
+    uint64_t elapsed = now_ns() - start;
+
+    chip8emu_free(emu);
+    return elapsed ? (double)*frames * 1e9 / (double)elapsed : 0;
+}
+
+/* reads the engine_ips of every rom of a json report written by -j, returns the number of roms */
+static int load_baseline(const char *path, baseline_entry *baseline)
+{
+    char line[512];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    while (count < BASELINE_MAX && fgets(line, sizeof line, file)) {
+        const char *ips = strstr(line, "\"engine_ips\":");
+        if (sscanf(line, " { \"rom\": \"%63[^\"]\"", baseline[count].rom) == 1 && ips
+                && sscanf(ips, "\"engine_ips\": %lf", &baseline[count].ips) == 1)
+            count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static double baseline_ips(const baseline_entry *baseline, int count, const char *rom)
+{
+    for (int i = 0; i < count; ++i) {
+        if (!strcmp(baseline[i].rom, rom))
+            return baseline[i].ips;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-n instructions] [-t records] [-j report.json] [-c baseline.json] [-b lanes | -s | -o | -k | -m movie] [roms_dir]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    long cycles = DEFAULT_CYCLES;
+    long lanes = 0;
+    bool states = false;
+    bool opcodes = false;
+    bool kernels = false;
+    const char *movie = NULL;
+    const char *json_path = NULL;
+    const char *baseline_path = NULL;
+    char roms_dir[1024] = {0};
+    int argi;
+
+    snprintf(roms_dir, sizeof roms_dir, "%s/roms", dirname(strdup(argv[0])));
+
+    for (argi = 1; argi < argc; ++argi) {
+        if (!strcmp(argv[argi], "-n") && argi + 1 < argc) {
+            cycles = atol(argv[++argi]);
+        } else if (!strcmp(argv[argi], "-t") && argi + 1 < argc) {
+            trace_records = (size_t) atol(argv[++argi]);
+        } else if (!strcmp(argv[argi], "-b") && argi + 1 < argc) {
+            lanes = atol(argv[++argi]);
+        } else if (!strcmp(argv[argi], "-s")) {
+            states = true;
+        } else if (!strcmp(argv[argi], "-o")) {
+            opcodes = true;
+        } else if (!strcmp(argv[argi], "-k")) {
+            kernels = true;
+        } else if (!strcmp(argv[argi], "-m") && argi + 1 < argc) {
+            movie = argv[++argi];
+        } else if (!strcmp(argv[argi], "-j") && argi + 1 < argc) {
+            json_path = argv[++argi];
+        } else if (!strcmp(argv[argi], "-c") && argi + 1 < argc) {
+            baseline_path = argv[++argi];
+        } else if (argv[argi][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            snprintf(roms_dir, sizeof roms_dir, "%s", argv[argi]);
+        }
+    }
+
+    if (movie) {
+        long frames;
+        int ret;
+        double fps = bench_movie(movie, &frames, &ret);
+        printf("%s: %ld frames, %.0f frames/s, %.0fx real time, %s\n", movie, frames, fps, fps / 60,
+               ret == C8ERR_OK ? "replay matches" : ret == C8ERR_DESYNC ? "DESYNC" : "not a movie");
+        return ret == C8ERR_OK ? 0 : 1;
+    }
+
+    if (kernels) {
+        printf("%-10s %12s %12s %8s\n", "kernel", "table MIPS", "engine MIPS", "speedup");
+        for (size_t k = 0; k < sizeof bench_kernels / sizeof bench_kernels[0]; ++k) {
+            double table = bench_kernel(&bench_kernels[k], &loop_exec_unthrottled, cycles);
+            double engine = bench_kernel(&bench_kernels[k], &loop_run_unthrottled, cycles);
+            printf("%-10s %12.2f %12.2f %7.2fx\n", bench_kernels[k].name, table / 1e6, engine / 1e6,
+                   table ? engine / table : 0);
+        }
+        return 0;
+    }
+
+    struct dirent **namelist;
+    int entries_count = scandir(roms_dir, &namelist, NULL, alphasort);
+    if (entries_count < 0) {
+        printf("cannot open roms directory %s\n", roms_dir);
+        return 1;
+    }
+
+    if (states) {
+        printf("%-10s %10s %10s %10s\n", "ROM", "bytes", "save ns", "load ns");
+        for (int i = 0; i < entries_count; ++i) {
+            char rom[2048];
+            double save_ns, load_ns;
+
+            if (namelist[i]->d_name[0] == '.' || strstr(namelist[i]->d_name, "CMakeLists")) {
+                free(namelist[i]);
+                continue;
+            }
+            snprintf(rom, sizeof rom, "%s/%s", roms_dir, namelist[i]->d_name);
+
+            size_t size = bench_state(rom, cycles, &save_ns, &load_ns);
+            printf("%-10s %10zu %10.0f %10.0f\n", namelist[i]->d_name, size, save_ns, load_ns);
+            free(namelist[i]);
+        }
+        free(namelist);
+        return 0;
+    }
+
+    if (opcodes) {
+        static chip8emu_opstat stats[C8OP_COUNT], totals[C8OP_COUNT];
+        bool instrumented = true;
+
+        printf("%-10s  %s\n", "ROM", "instructions taking the most time, share of the ROM's time");
+        for (int i = 0; i < entries_count; ++i) {
+            char rom[2048];
+
+            if (namelist[i]->d_name[0] == '.' || strstr(namelist[i]->d_name, "CMakeLists")) {
+                free(namelist[i]);
+                continue;
+            }
+            snprintf(rom, sizeof rom, "%s/%s", roms_dir, namelist[i]->d_name);
+
+            instrumented = bench_opcodes(rom, cycles, stats, totals) && instrumented;
+            double total = 0;
+            for (int op = 0; op < C8OP_COUNT; ++op)
+                total += opstat_time(&stats[op]);
+            printf("%-10s", namelist[i]->d_name);
+            for (int top = 0; top < 4 && total > 0; ++top) {
+                int best = 0;
+                for (int op = 1; op < C8OP_COUNT; ++op)
+                    if (opstat_time(&stats[op]) > opstat_time(&stats[best]))
+                        best = op;
+                printf("  %s %4.1f%%", chip8emu_opcode_name(best), opstat_time(&stats[best]) * 100 / total);
+                stats[best].samples = 0; /* excluded from the next picks */
+            }
+            printf("\n");
+            free(namelist[i]);
+        }
+        free(namelist);
+        if (!instrumented) {
+            printf("libchip8emu was built without CHIP8EMU_OPSTATS, no counts\n");
+            return 1;
+        }
+
+        uint64_t executed = 0;
+        double total = 0;
+        for (int op = 0; op < C8OP_COUNT; ++op) {
+            executed += totals[op].count;
+            total += opstat_time(&totals[op]);
+        }
+        printf("\n%-6s %10s %8s %8s %10s %8s\n", "op", "executed", "exec %", "time %", "ticks/op", "median");
+        for (int op = 0; op < C8OP_COUNT; ++op) {
+            if (!totals[op].count)
+                continue;
+            printf("%-6s %10llu %7.2f%% %7.2f%% %10.1f %8ld\n", chip8emu_opcode_name(op),
+                   (unsigned long long)totals[op].count, totals[op].count * 100.0 / executed,
+                   total ? opstat_time(&totals[op]) * 100 / total : 0,
+                   totals[op].samples ? (double)totals[op].ticks / totals[op].samples : 0,
+                   opstat_median(&totals[op]));
+        }
+        return 0;
+    }
+
+    if (lanes > 0) {
+        printf("%-10s %12s %12s %8s %12s %12s\n", "ROM", "engine MIPS", "batch MIPS", "speedup",
+               "groups/step", "lanes/s");
+        for (int i = 0; i < entries_count; ++i) {
+            char rom[2048];
+            long executed_engine;
+            double divergence;
+
+            if (namelist[i]->d_name[0] == '.' || strstr(namelist[i]->d_name, "CMakeLists")) {
+                free(namelist[i]);
+                continue;
+            }
+            snprintf(rom, sizeof rom, "%s/%s", roms_dir, namelist[i]->d_name);
+
+            /* same instruction count: one instance for n cycles, lanes instances for n / lanes */
+            double engine = bench_rom(rom, &loop_run_cycles, cycles, &executed_engine, NULL);
+            double batch = bench_batch(rom, (uint32_t) lanes, cycles / lanes, &divergence);
+            /* lanes/s: emulated seconds per wall clock second, 60 frames of CYCLES_PER_FRAME */
+            printf("%-10s %12.2f %12.2f %7.2fx %12.2f %12.0f\n", namelist[i]->d_name,
+                   engine / 1e6, batch / 1e6, engine ? batch / engine : 0, divergence,
+                   batch / (CYCLES_PER_FRAME * 60));
+            free(namelist[i]);
+        }
+        free(namelist);
+        return 0;
+    }
+
+    static baseline_entry baseline[BASELINE_MAX];
+    int baseline_count = 0;
+    if (baseline_path && (baseline_count = load_baseline(baseline_path, baseline)) < 0) {
+        printf("cannot read baseline %s\n", baseline_path);
+        return 1;
+    }
+
+    FILE *json = NULL;
+    if (json_path) {
+        if (!(json = fopen(json_path, "w"))) {
+            printf("cannot write %s\n", json_path);
+            return 1;
+        }
+        /* one rom per line, read back by load_baseline() */
+        fprintf(json, "{\n  \"instructions\": %ld,\n  \"cycles_per_frame\": %d,\n  \"roms\": [", cycles, CYCLES_PER_FRAME);
+    }
+
+    printf("%-10s %12s %12s %8s %8s %10s %8s %10s %10s %10s%s\n", "ROM", "table MIPS", "engine MIPS", "speedup",
+           "ns/inst", "draws/s", "RSS KB", "load+skip", "delay", "sprite", baseline_path ? "    vs base" : "");
+    double total_table = 0, total_engine = 0;
+    int roms_count = 0;
+    for (int i = 0; i < entries_count; ++i) {
+        char rom[2048];
+        long executed_table, executed_engine;
+        uint64_t fused[C8FUSE_COUNT];
+
+        if (namelist[i]->d_name[0] == '.' || strstr(namelist[i]->d_name, "CMakeLists")) {
+            free(namelist[i]);
+            continue;
+        }
+        snprintf(rom, sizeof rom, "%s/%s", roms_dir, namelist[i]->d_name);
+
+        reset_peak_rss();
+        double table = bench_rom(rom, &loop_exec_cycle, cycles, &executed_table, NULL);
+        double engine = bench_rom(rom, &loop_run_cycles, cycles, &executed_engine, fused);
+        long rss = peak_rss_kb();
+        if (executed_table != executed_engine)
+            printf("%s: instruction streams differ (%ld vs %ld)\n", namelist[i]->d_name, executed_table, executed_engine);
+
+        /* engine figures, draws in wall clock time */
+        double ns_per_inst = engine ? 1e9 / engine : 0;
+        double draws = executed_engine ? (double)draw_calls * engine / executed_engine : 0;
+        double base = baseline_ips(baseline, baseline_count, namelist[i]->d_name);
+
+        /* superinstructions executed by the engine, per mille of executed instructions */
+        printf("%-10s %12.2f %12.2f %7.2fx %8.2f %10.0f %8ld %10.1f %10.1f %10.1f", namelist[i]->d_name,
+               table / 1e6, engine / 1e6, table ? engine / table : 0, ns_per_inst, draws, rss,
+               fused[C8FUSE_LOAD_SKIP] * 1000.0 / executed_engine,
+               fused[C8FUSE_DELAY_LOOP] * 1000.0 / executed_engine,
+               fused[C8FUSE_SPRITE] * 1000.0 / executed_engine);
+        if (base)
+            printf(" %+9.1f%%", (engine / base - 1) * 100);
+        else if (baseline_path)
+            printf(" %10s", "new");
+        printf("\n");
+
+        if (json) {
+            fprintf(json, "%s\n    { \"rom\": \"%s\", \"executed\": %ld, \"table_ips\": %.0f, \"engine_ips\": %.0f, "
+                    "\"ns_per_instruction\": %.3f, \"draws_per_sec\": %.0f, \"draw_calls\": %ld, \"peak_rss_kb\": %ld }",
+                    roms_count ? "," : "", namelist[i]->d_name, executed_engine, table, engine,
+                    ns_per_inst, draws, draw_calls, rss);
+        }
+        total_table += table;
+        total_engine += engine;
+        roms_count++;
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    if (roms_count) {
+        printf("%-10s %12.2f %12.2f %7.2fx\n", "average",
+               total_table / roms_count / 1e6, total_engine / roms_count / 1e6,
+               total_table ? total_engine / total_table : 0);
+    }
+    if (json) {
+        fprintf(json, "\n  ],\n  \"average_engine_ips\": %.0f\n}\n", roms_count ? total_engine / roms_count : 0);
+        fclose(json);
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <libgen.h> /* for dirname() */
+#include <sys/stat.h>
+
+#include "chip8emu.h"
+#include "chip8das.h"
+
+#define DEFAULT_CYCLES      10000000
+#define DEFAULT_LOOPS       5
+#define CYCLES_PER_FRAME    25 /* 1500Hz cpu, 60Hz timers */
+#define LISTING_MAX         16 /* instructions listed per loop */
+
+typedef struct {
+    uint16_t  start;        /* jump target */
+    uint16_t  end;          /* address of the backward jump */
+    uint64_t  cost;         /* instructions executed in start..end */
+} hot_loop;
+
+static chip8emu_profile profile;
+static hot_loop loops[4096];
+
+/* scripted input, same as chip8emu-bench: every second press one key for half a second, cycling 0..F */
+static bool keystate_callback(chip8emu *emu, uint8_t key)
+{
+    uint64_t frame = emu->cycles / CYCLES_PER_FRAME;
+    return (frame / 60) % 16 == key && frame % 60 < 30;
+}
+
+static int compare_loops(const void *a, const void *b)
+{
+    const hot_loop *la = a, *lb = b;
+    return la->cost < lb->cost ? 1 : la->cost > lb->cost ? -1 : (int)la->start - (int)lb->start;
+}
+
+static uint16_t opcode_at(chip8emu *emu, uint16_t addr)
+{
+    return (uint16_t) (emu->memory[addr & 0xFFF] << 8 | emu->memory[(addr + 1) & 0xFFF]);
+}
+
+/* byte counts of the rom area by use */
+static void print_coverage(long rom_size)
+{
+    long code = 0, data = 0, both = 0, unused = 0, written = 0;
+    for (long a = 0x200; a < 0x200 + rom_size && a < 4096; ++a) {
+        uint8_t f = profile.flags[a];
+        if ((f & C8PROF_CODE) && (f & C8PROF_DATA))
+            both++;
+        else if (f & C8PROF_CODE)
+            code++;
+        else if (f & C8PROF_DATA)
+            data++;
+        else if (!(f & C8PROF_WRITTEN))
+            unused++;
+        if (f & C8PROF_WRITTEN)
+            written++;
+    }
+    printf("coverage: code %ld B (%.0f%%), data %ld B (%.0f%%), code and data %ld B, written %ld B, untouched %ld B (%.0f%%)\n",
+           code, code * 100.0 / rom_size, data, data * 100.0 / rom_size, both, written,
+           unused, unused * 100.0 / rom_size);
+}
+
+/* loops are the ranges closed by an executed backward 1NNN, ranked by the instructions executed inside */
+static void print_loops(chip8emu *emu, uint64_t executed, int max_loops)
+{
+    int count = 0;
+    for (int a = 0; a < 4095; ++a) {
+        uint16_t opcode = opcode_at(emu, (uint16_t) a);
+        if (!profile.exec[a] || opcode >> 12 != 0x1 || (opcode & 0xFFF) > a)
+            continue;
+        hot_loop *loop = &loops[count++];
+        loop->start = opcode & 0xFFF;
+        loop->end = (uint16_t) a;
+        loop->cost = 0;
+        for (int b = loop->start; b <= a; ++b)
+            loop->cost += profile.exec[b];
+    }
+    qsort(loops, count, sizeof (hot_loop), compare_loops);
+
+    for (int l = 0; l < count && l < max_loops; ++l) {
+        hot_loop *loop = &loops[l];
+        int length = 0;
+        for (int b = loop->start; b <= loop->end; ++b)
+            length += profile.exec[b] != 0;
+        /* long bodies only list their hottest instructions */
+        uint64_t threshold = length > LISTING_MAX ? loop->cost / 100 : 0;
+
+        printf("loop #%03X-#%03X  %5.1f%% of executed, %llu iterations\n", loop->start, loop->end,
+               executed ? loop->cost * 100.0 / executed : 0, (unsigned long long)profile.exec[loop->end]);
+        int listed = 0;
+        for (int b = loop->start; b <= loop->end && listed < LISTING_MAX; ++b) {
+            char text[32];
+            if (!profile.exec[b] || profile.exec[b] < threshold)
+                continue;
+            uint16_t opcode = opcode_at(emu, (uint16_t) b);
+            chip8_disassemble(opcode, text, sizeof text);
+            printf("    %03X  %04X  %-16s %12llu %5.1f%%%s\n", b, opcode, text,
+                   (unsigned long long)profile.exec[b], profile.exec[b] * 100.0 / executed,
+                   profile.flags[b] & C8PROF_WRITTEN ? "  self-modified" : "");
+            listed++;
+        }
+    }
+    if (!count)
+        printf("no backward jump executed\n");
+}
+
+static int profile_rom(const char *rom, long cycles, int max_loops)
+{
+    struct stat st;
+    chip8emu *emu = chip8emu_new();
+    emu->keystate = &keystate_callback;
+
+    if (stat(rom, &st) != 0 || chip8emu_load_rom(emu, rom) != C8ERR_OK) {
+        printf("cannot load %s\n", rom);
+        chip8emu_free(emu);
+        return 1;
+    }
+    while ((long)emu->cycles < cycles) {
+        if (chip8emu_run_frame(emu, CYCLES_PER_FRAME) == C8RUN_FAULT)
+            break;
+    }
+    if (!chip8emu_get_profile(emu, &profile)) {
+        printf("libchip8emu was built without CHIP8EMU_PROFILE\n");
+        chip8emu_free(emu);
+        return 1;
+    }
+
+    uint64_t executed = 0;
+    for (int a = 0; a < 4096; ++a)
+        executed += profile.exec[a];
+    printf("== %s (%ld bytes): %llu instructions, %llu executed, %.1f%% skipped as idle\n",
+           rom, (long)st.st_size, (unsigned long long)emu->cycles, (unsigned long long)executed,
+           emu->cycles ? (emu->cycles - executed) * 100.0 / emu->cycles : 0);
+    print_coverage((long)st.st_size);
+    print_loops(emu, executed, max_loops);
+    printf("\n");
+
+    chip8emu_free(emu);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-n instructions] [-l loops] [rom | roms_dir]...\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    long cycles = DEFAULT_CYCLES;
+    int max_loops = DEFAULT_LOOPS;
+    char roms_dir[1024] = {0};
+    const char *paths[256];
+    int paths_count = 0;
+    int ret = 0;
+
+    snprintf(roms_dir, sizeof roms_dir, "%s/roms", dirname(strdup(argv[0])));
+
+    for (int argi = 1; argi < argc; ++argi) {
+        if (!strcmp(argv[argi], "-n") && argi + 1 < argc) {
+            cycles = atol(argv[++argi]);
+        } else if (!strcmp(argv[argi], "-l") && argi + 1 < argc) {
+            max_loops = atoi(argv[++argi]);
+        } else if (argv[argi][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else if (paths_count < 256) {
+            paths[paths_count++] = argv[argi];
+        }
+    }
+    if (!paths_count)
+        paths[paths_count++] = roms_dir;
+
+    for (int p = 0; p < paths_count; ++p) {
+        struct stat st;
+        if (stat(paths[p], &st) == 0 && !S_ISDIR(st.st_mode)) {
+            ret |= profile_rom(paths[p], cycles, max_loops);
+            continue;
+        }
+
+        struct dirent **namelist;
+        int entries_count = scandir(paths[p], &namelist, NULL, alphasort);
+        if (entries_count < 0) {
+            printf("cannot open %s\n", paths[p]);
+            ret = 1;
+            continue;
+        }
+        for (int i = 0; i < entries_count; ++i) {
+            char rom[2048];
+            if (namelist[i]->d_name[0] != '.' && !strstr(namelist[i]->d_name, "CMakeLists")) {
+                snprintf(rom, sizeof rom, "%s/%s", paths[p], namelist[i]->d_name);
+                ret |= profile_rom(rom, cycles, max_loops);
+            }
+            free(namelist[i]);
+        }
+        free(namelist);
+    }
+    return ret;
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8emu.h"
+#include "chip8das.h"
+
+#define TRACE_HEADER    16
+#define TRACE_RECORD    8
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/* "V3=2A" for instructions with an X register */
+static void format_vx(uint16_t opcode, uint8_t vx, char *buf, size_t size)
+{
+    switch (opcode >> 12) {
+    case 0x0: case 0x1: case 0x2: case 0xA: case 0xB:
+        snprintf(buf, size, "-");
+        break;
+    default:
+        snprintf(buf, size, "V%X=%02X", (opcode >> 8) & 0xF, vx);
+        break;
+    }
+}
+
+/* prints the last records of a chip8emu_dump_trace dump, oldest first */
+static int decode_trace(const char *filename, long last)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("cannot open %s\n", filename);
+        return 1;
+    }
+    uint8_t header[TRACE_HEADER];
+    if (fread(header, 1, TRACE_HEADER, f) != TRACE_HEADER || memcmp(header, "C8TR", 4)) {
+        printf("%s is not a chip8emu trace\n", filename);
+        fclose(f);
+        return 1;
+    }
+    if (header[4] != C8TRACE_VERSION) {
+        printf("%s: trace version %d, expected %d\n", filename, header[4], C8TRACE_VERSION);
+        fclose(f);
+        return 1;
+    }
+    bool faulted = header[5] & C8TRACE_FAULTED;
+    uint16_t fault_pc = (uint16_t) get_le(header + 6, 2);
+    uint16_t fault_opcode = (uint16_t) get_le(header + 8, 2);
+    long count = (long) get_le(header + 10, 4);
+
+    long skip = last > 0 && last < count ? count - last : 0;
+    if (fseek(f, skip * TRACE_RECORD, SEEK_CUR) != 0) {
+        printf("%s: truncated\n", filename);
+        fclose(f);
+        return 1;
+    }
+    printf("== %s: %ld instructions%s\n", filename, count, skip ? ", older ones not listed" : "");
+    printf("     #  pc   opcode  instruction          I    VX     VF\n");
+
+    char mnemonic[32], vx[8];
+    for (long n = skip; n < count; ++n) {
+        uint8_t buf[TRACE_RECORD];
+        if (fread(buf, 1, TRACE_RECORD, f) != TRACE_RECORD) {
+            printf("%s: truncated after %ld records\n", filename, n);
+            fclose(f);
+            return 1;
+        }
+        uint64_t record = get_le(buf, TRACE_RECORD);
+        uint16_t opcode = (uint16_t) (record >> 16);
+        chip8_disassemble(opcode, mnemonic, sizeof mnemonic);
+        format_vx(opcode, (uint8_t) (record >> 48), vx, sizeof vx);
+        printf("%6ld  %03X  %04X    %-18s  %03X  %-5s  %02X\n", n - count, (unsigned) (record & 0xFFF),
+               opcode, mnemonic, (unsigned) ((record >> 32) & 0xFFFF), vx, (unsigned) (record >> 56));
+    }
+    fclose(f);
+
+    if (faulted) {
+        chip8_disassemble(fault_opcode, mnemonic, sizeof mnemonic);
+        printf(" fault  %03X  %04X    %-18s  cannot be executed\n", fault_pc, fault_opcode, mnemonic);
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-n instructions] trace...\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    long last = 0;
+    int traces = 0;
+    int ret = 0;
+
+    for (int argi = 1; argi < argc; ++argi) {
+        if (!strcmp(argv[argi], "-n") && argi + 1 < argc) {
+            last = atol(argv[++argi]);
+        } else if (argv[argi][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            ret |= decode_trace(argv[argi], last);
+            traces++;
+        }
+    }
+    if (!traces) {
+        usage(argv[0]);
+        return 1;
+    }
+    return ret;
+}